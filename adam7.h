@@ -0,0 +1,61 @@
+// adam7.h
+// Adam7 pass extraction for interlaced PNG output (the PNG-24 writer in
+// compress.cpp and lodepng's Adam7_interlace for 8-bit and wider pixels).
+//
+// An interlaced PNG stores the image as seven reduced images, each one a
+// regular grid of pixels (every 8th pixel of every 8th row first, ..., the
+// odd rows last), so a viewer can paint a coarse version from the first
+// bytes. Extraction is a strided gather; the kernel copies whole rows for
+// the last pass and fixed-size pixels for the others instead of lodepng's
+// per-byte position arithmetic.
+
+#ifndef IMGC_ADAM7_H
+#define IMGC_ADAM7_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class Adam7 {
+public:
+    static constexpr int kPasses = 7;
+
+    static size_t passWidth(int pass, size_t w) { return (w + kDX[pass] - kIX[pass] - 1) / kDX[pass]; }
+    static size_t passHeight(int pass, size_t h) { return (h + kDY[pass] - kIY[pass] - 1) / kDY[pass]; }
+
+    // Gathers pass 'pass' (0..6) of a w x h image of 'bpp'-byte pixels into
+    // 'out', passWidth * passHeight pixels, rows packed.
+    static void extract(const uint8_t* in, size_t w, size_t h, size_t bpp, int pass, uint8_t* out) {
+        switch (bpp) {
+        case 1: gather<1>(in, w, h, pass, out); break;
+        case 3: gather<3>(in, w, h, pass, out); break;
+        case 4: gather<4>(in, w, h, pass, out); break;
+        default: gather<0>(in, w, h, pass, out, bpp); break;
+        }
+    }
+
+private:
+    static constexpr size_t kIX[kPasses] = {0, 4, 0, 2, 0, 1, 0};
+    static constexpr size_t kIY[kPasses] = {0, 0, 4, 0, 2, 0, 1};
+    static constexpr size_t kDX[kPasses] = {8, 8, 4, 4, 2, 2, 1};
+    static constexpr size_t kDY[kPasses] = {8, 8, 8, 4, 4, 2, 2};
+
+    // Bpp == 0: the pixel size is only known at run time.
+    template <size_t Bpp>
+    static void gather(const uint8_t* in, size_t w, size_t h, int pass, uint8_t* out, size_t bpp = Bpp) {
+        const size_t pw = passWidth(pass, w), ph = passHeight(pass, h);
+        if (pw == 0) return;
+        const size_t size = Bpp ? Bpp : bpp, step = kDX[pass] * size, stride = w * size;
+        for (size_t y = 0; y < ph; ++y) {
+            const uint8_t* src = in + (kIY[pass] + y * kDY[pass]) * stride + kIX[pass] * size;
+            if (kDX[pass] == 1) {
+                std::memcpy(out, src, pw * size);
+            } else {
+                for (size_t x = 0; x < pw; ++x) std::memcpy(out + x * size, src + x * step, Bpp ? Bpp : bpp);
+            }
+            out += pw * size;
+        }
+    }
+};
+
+#endif // IMGC_ADAM7_H
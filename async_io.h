@@ -0,0 +1,367 @@
+// async_io.h
+// Asynchronous file I/O for the compressor daemon (compress --serve).
+//
+// On Linux, operations go through an io_uring driven with raw syscalls (no
+// liburing dependency). Reads are queued as they are requested and handed
+// to the kernel together by submit(), one syscall per batch. A file that
+// fits lands in one of a few buffers registered with the kernel at startup
+// (READ_FIXED: no per-read page pinning); larger ones get a heap buffer.
+// Writes take shared ownership of their bytes and report through a
+// completion callback run from poll()/wait()/drain(). Where io_uring is
+// unavailable (other platforms, seccomp, old kernels), every operation runs
+// synchronously and completes at once.
+
+#ifndef IMGC_ASYNC_IO_H
+#define IMGC_ASYNC_IO_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define IMGC_HAVE_URING 1
+#else
+#include <cstdio>
+#define IMGC_HAVE_URING 0
+#endif
+
+class AsyncIO {
+public:
+    struct Read {
+        bool done = false;
+        bool ok = false;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        std::vector<uint8_t> heap;   // used when no registered buffer was free
+        int slot = -1;
+    };
+    using ReadTicket = std::shared_ptr<Read>;
+    using Bytes = std::shared_ptr<const std::vector<uint8_t>>;
+    using WriteDone = std::function<void(bool ok)>;
+
+    explicit AsyncIO(unsigned entries = 64, int slots = 3, size_t slotBytes = size_t(2) << 20) {
+#if IMGC_HAVE_URING
+        io_uring_params params;
+        std::memset(&params, 0, sizeof params);
+        ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd_ < 0 || !mapRings(params)) {
+            shutdown();
+            return;
+        }
+        capacity_ = params.sq_entries;
+        // registered buffers count against RLIMIT_MEMLOCK; run without them if refused
+        void* pool = mmap(nullptr, slotBytes * slots, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool != MAP_FAILED) {
+            std::vector<iovec> iov(slots);
+            for (int i = 0; i < slots; ++i) iov[i] = {static_cast<uint8_t*>(pool) + slotBytes * i, slotBytes};
+            if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iov.data(), slots) == 0) {
+                slotPool_ = static_cast<uint8_t*>(pool);
+                slotBytes_ = slotBytes;
+                slotFree_.assign(slots, true);
+            } else {
+                munmap(pool, slotBytes * slots);
+            }
+        }
+#else
+        (void)entries; (void)slots; (void)slotBytes;
+#endif
+    }
+
+    ~AsyncIO() {
+        drain();
+        shutdown();
+    }
+
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+
+    bool usingUring() const { return ringFd_ >= 0; }
+    int registeredBuffers() const { return static_cast<int>(slotFree_.size()); }
+
+    // Queues a whole-file read; ticket->done once it completes (see wait()).
+    ReadTicket read(const std::string& path) {
+        auto ticket = std::make_shared<Read>();
+#if IMGC_HAVE_URING
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+            if (fd >= 0) ::close(fd);
+            ticket->done = true;
+            return ticket;
+        }
+        ticket->size = static_cast<size_t>(st.st_size);
+        uint8_t* buffer;
+        for (size_t i = 0; i < slotFree_.size() && ticket->slot < 0; ++i) {
+            if (slotFree_[i] && ticket->size <= slotBytes_) {
+                slotFree_[i] = false;
+                ticket->slot = static_cast<int>(i);
+            }
+        }
+        if (ticket->slot >= 0) {
+            buffer = slotPool_ + slotBytes_ * ticket->slot;
+        } else {
+            ticket->heap.resize(ticket->size);
+            buffer = ticket->heap.data();
+        }
+        ticket->data = buffer;
+        if (usingUring()) {
+            Op op;
+            op.fd = fd;
+            op.buffer = buffer;
+            op.length = ticket->size;
+            op.read = ticket;
+            enqueue(std::move(op));
+        } else {
+            size_t got = 0;
+            while (got < ticket->size) {
+                const ssize_t n = pread(fd, buffer + got, ticket->size - got, static_cast<off_t>(got));
+                if (n <= 0) break;
+                got += static_cast<size_t>(n);
+            }
+            ::close(fd);
+            ticket->ok = (got == ticket->size);
+            ticket->done = true;
+        }
+#else
+        if (FILE* f = std::fopen(path.c_str(), "rb")) {
+            uint8_t chunk[65536];
+            for (size_t n; (n = std::fread(chunk, 1, sizeof chunk, f)) > 0;)
+                ticket->heap.insert(ticket->heap.end(), chunk, chunk + n);
+            ticket->ok = !std::ferror(f) && !ticket->heap.empty();
+            std::fclose(f);
+        }
+        ticket->data = ticket->heap.data();
+        ticket->size = ticket->heap.size();
+        ticket->done = true;
+#endif
+        return ticket;
+    }
+
+    // Writes `bytes` to `path` (created or truncated); `done` runs on completion.
+    void write(const std::string& path, Bytes bytes, WriteDone done) {
+#if IMGC_HAVE_URING
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            done(false);
+            return;
+        }
+        if (usingUring() && !bytes->empty()) {
+            Op op;
+            op.write = true;
+            op.fd = fd;
+            op.buffer = const_cast<uint8_t*>(bytes->data());
+            op.length = bytes->size();
+            op.bytes = std::move(bytes);
+            op.done = std::move(done);
+            enqueue(std::move(op));
+            return;
+        }
+        size_t put = 0;
+        while (put < bytes->size()) {
+            const ssize_t n = ::write(fd, bytes->data() + put, bytes->size() - put);
+            if (n <= 0) break;
+            put += static_cast<size_t>(n);
+        }
+        const bool closed = ::close(fd) == 0;
+        done(closed && put == bytes->size());
+#else
+        FILE* f = std::fopen(path.c_str(), "wb");
+        bool ok = f && std::fwrite(bytes->data(), 1, bytes->size(), f) == bytes->size();
+        if (f) ok = (std::fclose(f) == 0) && ok;
+        done(ok);
+#endif
+    }
+
+    // Hands every queued operation to the kernel.
+    void submit() {
+#if IMGC_HAVE_URING
+        if (!usingUring()) return;
+        unsigned queued = 0;
+        while (!backlog_.empty() && ops_.size() < capacity_) {
+            const uint64_t id = nextId_++;
+            Op& op = ops_.emplace(id, std::move(backlog_.front())).first->second;
+            backlog_.pop_front();
+            prepare(op, id);
+            ++queued;
+        }
+        if (queued > 0) enter(queued, 0);
+#endif
+    }
+
+    // Runs the callbacks of finished operations without blocking.
+    void poll() { reap(false); }
+
+    // Blocks until the read has completed.
+    void wait(const ReadTicket& ticket) {
+        while (!ticket->done) reap(true);
+    }
+
+    // Blocks until nothing is in flight.
+    void drain() {
+        while (!ops_.empty() || !backlog_.empty()) reap(true);
+    }
+
+    // Returns a read's registered buffer to the pool; its data is gone.
+    void release(const ReadTicket& ticket) {
+        if (ticket && ticket->slot >= 0) {
+            slotFree_[ticket->slot] = true;
+            ticket->slot = -1;
+            ticket->data = nullptr;
+        }
+    }
+
+private:
+    struct Op {
+        bool write = false;
+        int fd = -1;
+        uint8_t* buffer = nullptr;
+        size_t length = 0;
+        size_t completed = 0;
+        ReadTicket read;
+        Bytes bytes;
+        WriteDone done;
+    };
+
+    void enqueue(Op op) {
+        backlog_.push_back(std::move(op));
+    }
+
+    void reap(bool block) {
+#if IMGC_HAVE_URING
+        if (!usingUring()) return;
+        submit();
+        if (block && !ops_.empty() && cqReady() == 0) enter(0, 1);
+        unsigned head = *cqHead_;
+        while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe cqe = cqes_[head & *cqMask_];
+            __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+            complete(cqe.user_data, cqe.res);
+            head = *cqHead_;
+        }
+#else
+        (void)block;
+#endif
+    }
+
+#if IMGC_HAVE_URING
+    void complete(uint64_t id, int res) {
+        auto it = ops_.find(id);
+        if (it == ops_.end()) return;
+        Op op = std::move(it->second);
+        ops_.erase(it);
+        if (res > 0) op.completed += static_cast<size_t>(res);
+        if (res > 0 && op.completed < op.length) {
+            backlog_.push_front(std::move(op));   // short transfer: continue where it stopped
+            return;
+        }
+        const bool closed = ::close(op.fd) == 0;
+        const bool ok = closed && op.completed == op.length;
+        if (op.write) {
+            op.done(ok);
+        } else {
+            op.read->ok = ok;
+            op.read->done = true;
+        }
+    }
+
+    void prepare(const Op& op, uint64_t id) {
+        const unsigned tail = *sqTail_;
+        const unsigned index = tail & *sqMask_;
+        io_uring_sqe& sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof sqe);
+        const bool fixed = !op.write && op.read->slot >= 0;
+        sqe.opcode = op.write ? IORING_OP_WRITE : fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = op.fd;
+        sqe.off = op.completed;
+        sqe.addr = reinterpret_cast<uint64_t>(op.buffer + op.completed);
+        sqe.len = static_cast<uint32_t>(std::min<size_t>(op.length - op.completed, 1u << 30));
+        if (fixed) sqe.buf_index = static_cast<uint16_t>(op.read->slot);
+        sqe.user_data = id;
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    unsigned cqReady() const {
+        return __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - *cqHead_;
+    }
+
+    void enter(unsigned submit, unsigned wait) {
+        const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        while (syscall(__NR_io_uring_enter, ringFd_, submit, wait, flags, nullptr, 0) < 0 && errno == EINTR) {}
+    }
+
+    bool mapRings(const io_uring_params& p) {
+        sqBytes_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqBytes_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sqBytes_ = cqBytes_ = std::max(sqBytes_, cqBytes_);
+        void* sq = mmap(nullptr, sqBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) return false;
+        sqRing_ = static_cast<uint8_t*>(sq);
+        void* cq = single ? sq
+            : mmap(nullptr, cqBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return false;
+        cqRing_ = static_cast<uint8_t*>(cq);
+        sqesBytes_ = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqesBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        sqTail_ = reinterpret_cast<unsigned*>(sqRing_ + p.sq_off.tail);
+        sqMask_ = reinterpret_cast<unsigned*>(sqRing_ + p.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(sqRing_ + p.sq_off.array);
+        cqHead_ = reinterpret_cast<unsigned*>(cqRing_ + p.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cqRing_ + p.cq_off.tail);
+        cqMask_ = reinterpret_cast<unsigned*>(cqRing_ + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cqRing_ + p.cq_off.cqes);
+        return true;
+    }
+
+    uint8_t* sqRing_ = nullptr;
+    uint8_t* cqRing_ = nullptr;
+    size_t sqBytes_ = 0, cqBytes_ = 0, sqesBytes_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned *sqTail_ = nullptr, *sqMask_ = nullptr, *sqArray_ = nullptr;
+    unsigned *cqHead_ = nullptr, *cqTail_ = nullptr, *cqMask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+#endif
+
+    void shutdown() {
+#if IMGC_HAVE_URING
+        if (slotPool_) munmap(slotPool_, slotBytes_ * slotFree_.size());
+        if (sqes_) munmap(sqes_, sqesBytes_);
+        if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqBytes_);
+        if (sqRing_) munmap(sqRing_, sqBytes_);
+        if (ringFd_ >= 0) ::close(ringFd_);
+        sqes_ = nullptr;
+        cqRing_ = sqRing_ = nullptr;
+#endif
+        slotPool_ = nullptr;
+        slotFree_.clear();
+        ringFd_ = -1;
+    }
+
+    int ringFd_ = -1;
+    unsigned capacity_ = 0;
+    uint64_t nextId_ = 1;
+    std::map<uint64_t, Op> ops_;
+    std::deque<Op> backlog_;
+    uint8_t* slotPool_ = nullptr;
+    size_t slotBytes_ = 0;
+    std::vector<bool> slotFree_;
+};
+
+#endif // IMGC_ASYNC_IO_H
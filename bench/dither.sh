@@ -0,0 +1,61 @@
+#!/bin/bash
+# Compares the --dither modes on the dithering PNG qualities over the bench
+# corpus: output bytes, PSNR against the source, and banding PSNR (luma PSNR
+# after a 9x9 blur, bench/psnr.cpp; higher means less visible banding).
+#
+# Usage: bench/dither.sh [compress-binary] [corpus-dir]
+#   BENCH_QUALITIES overrides the qualities, BENCH_MODES the dither modes,
+#   BENCH_ARGS is appended to every run.
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BIN="${1:-$BENCH_DIR/../compress}"
+CORPUS="${2:-$BENCH_DIR/corpus}"
+QUALITIES="${BENCH_QUALITIES:-0.5 0.6 0.85}"
+MODES="${BENCH_MODES:-bayer rows columns residual fs sierra}"
+
+if [ ! -x "$BIN" ]; then
+    echo "compress binary not found: $BIN (run ./build.sh first)" >&2
+    exit 1
+fi
+if [ -z "$(ls "$CORPUS"/*.png "$CORPUS"/*.jpg 2>/dev/null)" ]; then
+    echo "no corpus in $CORPUS (bench/run.sh generates it)" >&2
+    exit 1
+fi
+if [ ! -x "$BENCH_DIR/psnr" ] || [ "$BENCH_DIR/psnr.cpp" -nt "$BENCH_DIR/psnr" ]; then
+    g++ -O2 -I"$BENCH_DIR/.." "$BENCH_DIR/psnr.cpp" -o "$BENCH_DIR/psnr"
+fi
+
+OUT="$(mktemp -d)"
+trap 'rm -rf "$OUT"' EXIT
+
+# totals per quality and mode: bytes, and PSNR sums for the means
+declare -A bytesTotal psnrTotal bandTotal
+count=0
+printf "%-22s %-5s %-9s %10s %8s %9s\n" image q dither bytes psnr_dB banding_dB
+for img in "$CORPUS"/*.png "$CORPUS"/*.jpg "$CORPUS"/*.jpeg; do
+    [ -f "$img" ] || continue
+    count=$((count + 1))
+    for q in $QUALITIES; do
+        for mode in $MODES; do
+            "$BIN" "$img" "$OUT/out.png" "$q" --dither="$mode" $BENCH_ARGS > /dev/null
+            bytes=$(stat -c %s "$OUT/out.png")
+            read -r psnr _ band <<< "$("$BENCH_DIR/psnr" "$img" "$OUT/out.png")"
+            printf "%-22s %-5s %-9s %10d %8s %9s\n" "$(basename "$img")" "$q" "$mode" "$bytes" "$psnr" "$band"
+            key="$q $mode"
+            bytesTotal[$key]=$(( ${bytesTotal[$key]:-0} + bytes ))
+            psnrTotal[$key]=$(awk -v a="${psnrTotal[$key]:-0}" -v b="$psnr" 'BEGIN { print a + b }')
+            bandTotal[$key]=$(awk -v a="${bandTotal[$key]:-0}" -v b="$band" 'BEGIN { print a + b }')
+        done
+    done
+done
+echo "--------------------------------------------------------------------"
+printf "%-5s %-9s %12s %10s %10s\n" q dither total_bytes mean_psnr mean_band
+for q in $QUALITIES; do
+    for mode in $MODES; do
+        key="$q $mode"
+        printf "%-5s %-9s %12d %10s %10s\n" "$q" "$mode" "${bytesTotal[$key]}" \
+            "$(awk -v s="${psnrTotal[$key]}" -v n="$count" 'BEGIN { printf "%.2f", s / n }')" \
+            "$(awk -v s="${bandTotal[$key]}" -v n="$count" 'BEGIN { printf "%.2f", s / n }')"
+    done
+done
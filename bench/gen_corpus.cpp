@@ -0,0 +1,139 @@
+// gen_corpus.cpp
+// Writes the synthetic benchmark corpus: deterministic stand-ins for the
+// image classes the service sees (camera photos, UI screenshots, smooth
+// gradients, flat logos, thumbnails), each as PNG and JPEG so both decoders
+// are exercised. Real images dropped into the same directory are benched too.
+//
+// Build: g++ -O2 -I.. gen_corpus.cpp -o gen_corpus
+// Usage: gen_corpus <output-dir>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// xorshift32: fixed seed so every run produces byte-identical inputs
+struct Rng {
+    uint32_t s;
+    explicit Rng(uint32_t seed) : s(seed) {}
+    uint32_t next() { s ^= s << 13; s ^= s >> 17; s ^= s << 5; return s; }
+    float uniform() { return (next() >> 8) * (1.0f / 16777216.0f); }
+};
+
+// smooth value noise on a coarse lattice, bilinearly interpolated
+static float valueNoise(const std::vector<float>& lattice, int lw, float x, float y) {
+    const int x0 = static_cast<int>(x), y0 = static_cast<int>(y);
+    const float fx = x - x0, fy = y - y0;
+    auto at = [&](int xi, int yi) { return lattice[yi * lw + xi]; };
+    const float a = at(x0, y0) + (at(x0 + 1, y0) - at(x0, y0)) * fx;
+    const float b = at(x0, y0 + 1) + (at(x0 + 1, y0 + 1) - at(x0, y0 + 1)) * fx;
+    return a + (b - a) * fy;
+}
+
+static uint8_t clampByte(float v) {
+    return static_cast<uint8_t>(std::clamp(static_cast<int>(std::lround(v)), 0, 255));
+}
+
+using Painter = std::function<void(int x, int y, uint8_t* rgb)>;
+
+static std::vector<uint8_t> render(int w, int h, const Painter& paint) {
+    std::vector<uint8_t> rgb(size_t(w) * h * 3);
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+            paint(x, y, &rgb[(size_t(y) * w + x) * 3]);
+    return rgb;
+}
+
+static std::vector<uint8_t> photo(int w, int h, uint32_t seed) {
+    Rng rng(seed);
+    const int cell = 48, lw = w / cell + 2, lh = h / cell + 2;
+    std::vector<float> lr(lw * lh), lg(lw * lh), lb(lw * lh);
+    for (int i = 0; i < lw * lh; ++i) {
+        lr[i] = rng.uniform(); lg[i] = rng.uniform(); lb[i] = rng.uniform();
+    }
+    return render(w, h, [&](int x, int y, uint8_t* p) {
+        const float fx = float(x) / cell, fy = float(y) / cell;
+        const float light = 0.6f + 0.4f * std::sin(x * 0.004f + y * 0.003f);
+        const float grain = (rng.uniform() - 0.5f) * 14.0f;
+        p[0] = clampByte((40 + 190 * valueNoise(lr, lw, fx, fy)) * light + grain);
+        p[1] = clampByte((40 + 170 * valueNoise(lg, lw, fx, fy)) * light + grain);
+        p[2] = clampByte((30 + 160 * valueNoise(lb, lw, fx, fy)) * light + grain);
+    });
+}
+
+static std::vector<uint8_t> screenshot(int w, int h, uint32_t seed) {
+    Rng rng(seed);
+    return render(w, h, [&](int x, int y, uint8_t* p) {
+        uint8_t c[3] = {246, 247, 250};
+        if (y < 56) { c[0] = 38; c[1] = 50; c[2] = 72; }                 // title bar
+        else if (x < 220) { c[0] = 232; c[1] = 235; c[2] = 241; }       // sidebar
+        const bool textRow = (y % 22) > 6 && (y % 22) < 16;
+        const bool glyph = ((x * 7 + (y / 22) * 13) % 11) < 6 && (x % 90) < 70;
+        if (y > 70 && textRow && glyph && x > 240 && x < w - 40) {       // body text
+            c[0] = c[1] = c[2] = 40;
+        }
+        if (x > w / 2 && x < w / 2 + 260 && y > 120 && y < 300) {        // embedded image
+            c[0] = clampByte(120 + 80 * std::sin(x * 0.05f));
+            c[1] = clampByte(100 + 60 * std::cos(y * 0.07f));
+            c[2] = clampByte(140 + (rng.uniform() - 0.5f) * 30);
+        }
+        p[0] = c[0]; p[1] = c[1]; p[2] = c[2];
+    });
+}
+
+static std::vector<uint8_t> gradient(int w, int h) {
+    return render(w, h, [&](int x, int y, uint8_t* p) {
+        const float t = float(y) / h, s = float(x) / w;
+        p[0] = clampByte(40 + 150 * t + 20 * s);
+        p[1] = clampByte(90 + 110 * t);
+        p[2] = clampByte(200 - 40 * t + 30 * s);
+    });
+}
+
+static std::vector<uint8_t> logo(int w, int h) {
+    static const uint8_t colors[5][3] = {
+        {255, 255, 255}, {224, 49, 49}, {33, 37, 41}, {250, 176, 5}, {28, 126, 214}};
+    return render(w, h, [&](int x, int y, uint8_t* p) {
+        const float dx = x - w * 0.5f, dy = y - h * 0.5f, r = std::sqrt(dx * dx + dy * dy);
+        int c = 0;
+        if (r < h * 0.35f) c = 1;
+        if (r < h * 0.25f) c = 0;
+        if (std::abs(dx) < w * 0.06f && std::abs(dy) < h * 0.3f) c = 2;
+        if (y > h * 0.85f) c = (x / 40) % 2 ? 3 : 4;
+        p[0] = colors[c][0]; p[1] = colors[c][1]; p[2] = colors[c][2];
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cout << "Usage: " << argv[0] << " <output-dir>\n";
+        return 1;
+    }
+    const std::string dir = argv[1];
+
+    struct Entry { const char* name; int w, h; std::vector<uint8_t> rgb; };
+    std::vector<Entry> corpus;
+    corpus.push_back({"photo_large",   2400, 1600, photo(2400, 1600, 0x1234567u)});
+    corpus.push_back({"photo_medium",  1280,  853, photo(1280,  853, 0x89abcdeu)});
+    corpus.push_back({"thumbnail",      256,  256, photo( 256,  256, 0x2468aceu)});
+    corpus.push_back({"screenshot",    1440,  900, screenshot(1440, 900, 0x13579bdu)});
+    corpus.push_back({"gradient",      1600, 1000, gradient(1600, 1000)});
+    corpus.push_back({"logo",           800,  600, logo(800, 600)});
+
+    for (const auto& e : corpus) {
+        const std::string base = dir + "/" + e.name;
+        if (!stbi_write_png((base + ".png").c_str(), e.w, e.h, 3, e.rgb.data(), e.w * 3) ||
+            !stbi_write_jpg((base + ".jpg").c_str(), e.w, e.h, 3, e.rgb.data(), 92)) {
+            std::cerr << "Failed to write " << base << "\n";
+            return 1;
+        }
+        std::cout << "Wrote " << base << ".{png,jpg} (" << e.w << "x" << e.h << ")\n";
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Compares non-interlaced and Adam7-interlaced PNG output over the bench
+# corpus: output bytes and encode-stage time (from the compressor's "Stages:"
+# line) for --interlace=off and --interlace=on, and the cost of interlacing.
+#
+# Usage: bench/interlace.sh [compress-binary] [corpus-dir]
+#   BENCH_QUALITIES overrides the sweep, BENCH_ARGS is appended to every run.
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BIN="${1:-$BENCH_DIR/../compress}"
+CORPUS="${2:-$BENCH_DIR/corpus}"
+QUALITIES="${BENCH_QUALITIES:-0.1 0.5 0.85 1.0}"
+
+if [ ! -x "$BIN" ]; then
+    echo "compress binary not found: $BIN (run ./build.sh first)" >&2
+    exit 1
+fi
+if [ -z "$(ls "$CORPUS"/*.png "$CORPUS"/*.jpg 2>/dev/null)" ]; then
+    echo "no corpus in $CORPUS (bench/run.sh generates it)" >&2
+    exit 1
+fi
+
+OUT="$(mktemp -d)"
+trap 'rm -rf "$OUT"' EXIT
+
+# bytes and encode ms of one run
+run() {
+    local log
+    log=$("$BIN" "$1" "$OUT/out.png" "$2" --interlace="$3" $BENCH_ARGS)
+    echo "$(stat -c %s "$OUT/out.png") $(echo "$log" | sed -n 's/.*encode \([0-9.]*\) ms.*/\1/p')"
+}
+
+total_off=0; total_on=0
+printf "%-22s %5s %10s %10s %7s %9s %9s\n" image q off_bytes on_bytes size% off_enc_ms on_enc_ms
+for img in "$CORPUS"/*.png "$CORPUS"/*.jpg "$CORPUS"/*.jpeg; do
+    [ -f "$img" ] || continue
+    for q in $QUALITIES; do
+        read -r off_bytes off_ms <<< "$(run "$img" "$q" off)"
+        read -r on_bytes on_ms <<< "$(run "$img" "$q" on)"
+        awk -v img="$(basename "$img")" -v q="$q" -v a="$off_bytes" -v b="$on_bytes" -v ta="$off_ms" -v tb="$on_ms" \
+            'BEGIN { printf "%-22s %5s %10d %10d %+6.1f%% %9.1f %9.1f\n", img, q, a, b, (b - a) * 100 / a, ta, tb }'
+        total_off=$((total_off + off_bytes)); total_on=$((total_on + on_bytes))
+    done
+done
+echo "--------------------------------------------"
+awk -v a="$total_off" -v b="$total_on" \
+    'BEGIN { printf "Total: off %d bytes, on %d bytes (%+.1f%%)\n", a, b, (b - a) * 100 / a }'
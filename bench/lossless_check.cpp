@@ -0,0 +1,106 @@
+// lossless_check.cpp
+// Round-trip check for --lossless over the PNG inputs that 8-bit RGB cannot
+// hold: RGBA, grey+alpha, 16-bit RGB and a palette with tRNS (plus plain RGB).
+// Each input is written with lodepng, compressed, and both files are decoded
+// to 16-bit RGBA, which every one of them converts to exactly; any differing
+// sample fails the check.
+//
+// Build: g++ -O2 -I.. lossless_check.cpp ../lodepng.cpp -o lossless_check
+// Usage: lossless_check <compress-binary> <scratch-dir>   exit status 0 if all pass
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+// lodepng.h leaves LODEPNG_COMPILE_CRC off (the compressor brings its own)
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+    unsigned crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// xorshift32: fixed seed so every run checks the same pixels
+struct Rng {
+    uint32_t s;
+    explicit Rng(uint32_t seed) : s(seed) {}
+    uint32_t next() { s ^= s << 13; s ^= s >> 17; s ^= s << 5; return s; }
+};
+
+struct Input {
+    const char* name;
+    LodePNGColorType type;
+    unsigned depth;
+    bool tRNS;  // palette: some entries translucent
+};
+
+static const Input kInputs[] = {
+    {"rgb8", LCT_RGB, 8, false},
+    {"rgba8", LCT_RGBA, 8, false},
+    {"grey_alpha8", LCT_GREY_ALPHA, 8, false},
+    {"rgb16", LCT_RGB, 16, false},
+    {"palette_trns", LCT_PALETTE, 8, true},
+};
+
+// A gradient with noise, in the input's own mode (palette: 16 entries).
+static bool writeInput(const Input& in, unsigned w, unsigned h, const std::string& path) {
+    lodepng::State state;
+    state.info_raw.colortype = in.type;
+    state.info_raw.bitdepth = in.depth;
+    if (in.type == LCT_PALETTE) {
+        for (unsigned i = 0; i < 16; ++i) {
+            const unsigned char a = in.tRNS && i % 3 == 0 ? static_cast<unsigned char>(i * 16) : 255;
+            lodepng_palette_add(&state.info_raw, static_cast<unsigned char>(i * 17), static_cast<unsigned char>(255 - i * 17),
+                                static_cast<unsigned char>(i * 5), a);
+        }
+    }
+    lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+    state.encoder.auto_convert = 0;
+
+    const unsigned channels = lodepng_get_channels(&state.info_raw), bytes = in.depth / 8;
+    std::vector<unsigned char> pixels(size_t(w) * h * channels * bytes);
+    Rng rng(0x1234567u + in.type * 31 + in.depth);
+    for (unsigned y = 0; y < h; ++y)
+        for (unsigned x = 0; x < w; ++x)
+            for (unsigned c = 0; c < channels; ++c) {
+                unsigned char* p = &pixels[((size_t(y) * w + x) * channels + c) * bytes];
+                if (in.type == LCT_PALETTE) {
+                    p[0] = static_cast<unsigned char>((x / 8 + y / 8 + rng.next() % 2) % 16);
+                } else {
+                    const unsigned v = (x * 65535 / w + y * 257 * (c + 1) + rng.next() % 4096) & 0xFFFF;
+                    p[0] = static_cast<unsigned char>(v >> 8);
+                    if (bytes == 2) p[1] = static_cast<unsigned char>(v);
+                }
+            }
+    std::vector<unsigned char> png;
+    return lodepng::encode(png, pixels, w, h, state) == 0 && lodepng::save_file(png, path) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: %s <compress-binary> <scratch-dir>\n", argv[0]);
+        return 1;
+    }
+    int failed = 0;
+    for (const Input& in : kInputs) {
+        const std::string src = std::string(argv[2]) + "/" + in.name + ".png";
+        const std::string out = std::string(argv[2]) + "/" + in.name + "_lossless.png";
+        bool ok = writeInput(in, 97, 61, src);
+        const std::string command = std::string(argv[1]) + " " + src + " " + out + " 1.0 --lossless > /dev/null";
+        ok = ok && std::system(command.c_str()) == 0;
+
+        std::vector<unsigned char> a, b;
+        unsigned wa = 0, ha = 0, wb = 0, hb = 0;
+        ok = ok && lodepng::decode(a, wa, ha, src, LCT_RGBA, 16) == 0 && lodepng::decode(b, wb, hb, out, LCT_RGBA, 16) == 0;
+        ok = ok && wa == wb && ha == hb && a == b;
+        std::printf("%-14s %s\n", in.name, ok ? "ok" : "FAIL");
+        if (!ok) ++failed;
+    }
+    return failed ? 1 : 0;
+}
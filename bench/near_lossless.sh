@@ -0,0 +1,57 @@
+#!/bin/bash
+# Compares near-lossless PNG output with the tier-1 PNG pipeline over the
+# bench corpus: output bytes, PSNR against the source and the largest
+# per-channel error (bench/psnr.cpp) for each tier-1 quality and each
+# --near-lossless bound.
+#
+# Usage: bench/near_lossless.sh [compress-binary] [corpus-dir]
+#   BENCH_QUALITIES overrides the tier-1 qualities, BENCH_BOUNDS the
+#   near-lossless bounds, BENCH_ARGS is appended to every run.
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BIN="${1:-$BENCH_DIR/../compress}"
+CORPUS="${2:-$BENCH_DIR/corpus}"
+QUALITIES="${BENCH_QUALITIES:-0.7 0.85 1.0}"
+BOUNDS="${BENCH_BOUNDS:-1 2 4 8}"
+
+if [ ! -x "$BIN" ]; then
+    echo "compress binary not found: $BIN (run ./build.sh first)" >&2
+    exit 1
+fi
+if [ -z "$(ls "$CORPUS"/*.png "$CORPUS"/*.jpg 2>/dev/null)" ]; then
+    echo "no corpus in $CORPUS (bench/run.sh generates it)" >&2
+    exit 1
+fi
+if [ ! -x "$BENCH_DIR/psnr" ] || [ "$BENCH_DIR/psnr.cpp" -nt "$BENCH_DIR/psnr" ]; then
+    g++ -O2 -I"$BENCH_DIR/.." "$BENCH_DIR/psnr.cpp" -o "$BENCH_DIR/psnr"
+fi
+
+OUT="$(mktemp -d)"
+trap 'rm -rf "$OUT"' EXIT
+
+# one row: image, setting, bytes, PSNR, max error; totals per setting
+declare -A total
+row() {
+    local img="$1" setting="$2" bytes psnr maxerr
+    bytes=$(stat -c %s "$OUT/out.png")
+    read -r psnr maxerr _ <<< "$("$BENCH_DIR/psnr" "$img" "$OUT/out.png")"
+    printf "%-22s %-10s %10d %8s %7s\n" "$(basename "$img")" "$setting" "$bytes" "$psnr" "$maxerr"
+    total[$setting]=$(( ${total[$setting]:-0} + bytes ))
+}
+
+printf "%-22s %-10s %10s %8s %7s\n" image setting bytes psnr_dB max_err
+for img in "$CORPUS"/*.png "$CORPUS"/*.jpg "$CORPUS"/*.jpeg; do
+    [ -f "$img" ] || continue
+    for q in $QUALITIES; do
+        "$BIN" "$img" "$OUT/out.png" "$q" $BENCH_ARGS > /dev/null
+        row "$img" "q=$q"
+    done
+    for k in $BOUNDS; do
+        "$BIN" "$img" "$OUT/out.png" 1.0 --near-lossless="$k" $BENCH_ARGS > /dev/null
+        row "$img" "near=$k"
+    done
+done
+echo "--------------------------------------------"
+for q in $QUALITIES; do echo "Total q=$q: ${total[q=$q]} bytes"; done
+for k in $BOUNDS; do echo "Total near=$k: ${total[near=$k]} bytes"; done
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Runs a compress binary over the bench corpus at every format/quality pair and
+# prints output bytes and wall time per job, plus totals.
+#
+# Usage: bench/run.sh [compress-binary] [corpus-dir]
+#   BENCH_QUALITIES / BENCH_FORMATS override the sweep, BENCH_ARGS is appended
+#   to every compress invocation.
+# The synthetic corpus is generated on first use (see gen_corpus.cpp); any
+# extra .png/.jpg dropped into the corpus directory is benched as well.
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+BIN="${1:-$BENCH_DIR/../compress}"
+CORPUS="${2:-$BENCH_DIR/corpus}"
+QUALITIES="${BENCH_QUALITIES:-0.1 0.3 0.5 0.7 0.85 1.0}"
+FORMATS="${BENCH_FORMATS:-png jpg}"
+
+if [ ! -x "$BIN" ]; then
+    echo "compress binary not found: $BIN (run ./build.sh first)" >&2
+    exit 1
+fi
+
+if [ -z "$(ls "$CORPUS"/*.png "$CORPUS"/*.jpg 2>/dev/null)" ]; then
+    echo "Generating bench corpus in $CORPUS..."
+    mkdir -p "$CORPUS"
+    g++ -O2 -I"$BENCH_DIR/.." "$BENCH_DIR/gen_corpus.cpp" -o "$BENCH_DIR/gen_corpus"
+    "$BENCH_DIR/gen_corpus" "$CORPUS"
+fi
+
+OUT="$(mktemp -d)"
+trap 'rm -rf "$OUT"' EXIT
+
+total_in=0; total_out=0; total_ms=0; jobs=0
+printf "%-24s %-4s %5s %11s %11s %8s\n" image fmt q in_bytes out_bytes ms
+for img in "$CORPUS"/*.png "$CORPUS"/*.jpg "$CORPUS"/*.jpeg; do
+    [ -f "$img" ] || continue
+    in_bytes=$(stat -c %s "$img")
+    for fmt in $FORMATS; do
+        for q in $QUALITIES; do
+            out="$OUT/out.$fmt"
+            t0=$(date +%s%N)
+            "$BIN" "$img" "$out" "$q" $BENCH_ARGS > /dev/null
+            t1=$(date +%s%N)
+            ms=$(( (t1 - t0) / 1000000 ))
+            out_bytes=$(stat -c %s "$out")
+            printf "%-24s %-4s %5s %11d %11d %8d\n" "$(basename "$img")" "$fmt" "$q" "$in_bytes" "$out_bytes" "$ms"
+            total_in=$((total_in + in_bytes)); total_out=$((total_out + out_bytes))
+            total_ms=$((total_ms + ms)); jobs=$((jobs + 1))
+        done
+    done
+done
+echo "--------------------------------------------"
+echo "Jobs: $jobs  Input: $total_in bytes  Output: $total_out bytes  Time: ${total_ms} ms"
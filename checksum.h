@@ -0,0 +1,197 @@
+// checksum.h
+// CRC-32 (PNG chunks) and Adler-32 (zlib streams) for every PNG the
+// compressor writes: lodepng (built without its own CRC, see lodepng.h),
+// stb_image_write (STBIW_CRC32 / STBIW_ADLER32) and the shard stitcher.
+//
+// Both are bound per CPU at load time like the kernels in cpu_dispatch.h,
+// except that the clones are different algorithms rather than one loop
+// compiled several ways: CRC-32 folds 64 bytes per step with carry-less
+// multiplies (PCLMULQDQ, Intel's "Fast CRC Computation Using PCLMULQDQ"
+// constants as used by zlib-ng and Chromium) and finishes with a Barrett
+// reduction; Adler-32 sums 32 bytes per step with AVX2 multiply-adds. The
+// portable versions are slicing-by-8 CRC and a scalar Adler loop.
+//
+// Both take and return the running value zlib-style: start CRC at 0 and
+// Adler at 1, and pass the previous result to continue a stream.
+
+#ifndef IMGC_CHECKSUM_H
+#define IMGC_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_dispatch.h"
+
+#if IMGC_HAVE_MULTIVERSION
+#include <immintrin.h>
+#endif
+
+class Checksum {
+public:
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length) {
+        crc = ~crc;
+        if (length >= 64) {
+            const size_t folded = length & ~size_t(15);
+            crc = crcFold(crc, data, folded);
+            data += folded;
+            length -= folded;
+        }
+        return ~crcTable(crc, data, length);
+    }
+
+    static uint32_t adler32(uint32_t adler, const uint8_t* data, size_t length) {
+        uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+        adlerSums(s1, s2, data, length);
+        return (s2 << 16) | s1;
+    }
+
+    // The variants bound on this CPU, for --cpu-info.
+    static const char* crcVariant() { return crcFoldVariant(); }
+    static const char* adlerVariant() { return adlerSumsVariant(); }
+
+private:
+    static constexpr uint32_t kAdlerBase = 65521;
+    static constexpr size_t kAdlerRun = 5552;  // longest run before the sums can overflow
+
+    struct Tables {
+        uint32_t t[8][256];
+        constexpr Tables() : t() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xedb88320u & (0u - (c & 1)));
+                t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; ++i)
+                for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        }
+    };
+
+    // Slicing-by-8 on the inverted CRC.
+    static uint32_t crcTable(uint32_t c, const uint8_t* p, size_t n) {
+        static constexpr Tables kCrc{};
+        for (; n >= 8; p += 8, n -= 8) {
+            const uint32_t lo = c ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+            c = kCrc.t[7][lo & 0xff] ^ kCrc.t[6][(lo >> 8) & 0xff] ^ kCrc.t[5][(lo >> 16) & 0xff] ^ kCrc.t[4][lo >> 24] ^
+                kCrc.t[3][p[4]] ^ kCrc.t[2][p[5]] ^ kCrc.t[1][p[6]] ^ kCrc.t[0][p[7]];
+        }
+        while (n--) c = kCrc.t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        return c;
+    }
+
+    static void adlerScalar(uint32_t& s1, uint32_t& s2, const uint8_t* p, size_t n) {
+        while (n) {
+            const size_t run = n < kAdlerRun ? n : kAdlerRun;
+            for (size_t i = 0; i < run; ++i) {
+                s1 += p[i];
+                s2 += s1;
+            }
+            s1 %= kAdlerBase;
+            s2 %= kAdlerBase;
+            p += run;
+            n -= run;
+        }
+    }
+
+#if IMGC_HAVE_MULTIVERSION
+    // 'n' is a multiple of 16 and at least 64.
+    __attribute__((target("default")))
+    static uint32_t crcFold(uint32_t c, const uint8_t* p, size_t n) { return crcTable(c, p, n); }
+    __attribute__((target("default")))
+    static const char* crcFoldVariant() { return "slicing-by-8"; }
+
+    __attribute__((target("pclmul")))
+    static const char* crcFoldVariant() { return "pclmul"; }
+
+    static __m128i load(const uint8_t* q) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(q)); }
+
+    __attribute__((target("pclmul")))
+    static __m128i fold(__m128i x, __m128i k, __m128i next) {
+        return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+    }
+
+    __attribute__((target("pclmul")))
+    static uint32_t crcFold(uint32_t c, const uint8_t* p, size_t n) {
+        alignas(16) static const uint64_t k1k2[2] = {0x0154442bd4, 0x01c6e41596};  // fold by 512 bits
+        alignas(16) static const uint64_t k3k4[2] = {0x01751997d0, 0x00ccaa009e};  // fold by 128 bits
+        alignas(16) static const uint64_t k5k0[2] = {0x0163cd6124, 0};
+        alignas(16) static const uint64_t poly[2] = {0x01db710641, 0x01f7011641};  // P(x)' and mu
+        __m128i x1 = _mm_xor_si128(load(p), _mm_cvtsi32_si128(static_cast<int>(c)));
+        __m128i x2 = load(p + 16), x3 = load(p + 32), x4 = load(p + 48);
+        p += 64;
+        n -= 64;
+        __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+        for (; n >= 64; p += 64, n -= 64) {
+            x1 = fold(x1, k, load(p));
+            x2 = fold(x2, k, load(p + 16));
+            x3 = fold(x3, k, load(p + 32));
+            x4 = fold(x4, k, load(p + 48));
+        }
+        k = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+        x1 = fold(x1, k, x2);
+        x1 = fold(x1, k, x3);
+        x1 = fold(x1, k, x4);
+        for (; n >= 16; p += 16, n -= 16) x1 = fold(x1, k, load(p));
+
+        // 128 -> 64 bits, then Barrett reduction to 32
+        const __m128i low32 = _mm_setr_epi32(-1, 0, -1, 0);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k, 0x10));
+        k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k, 0x00));
+        k = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+        __m128i x2r = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k, 0x10);
+        x2r = _mm_clmulepi64_si128(_mm_and_si128(x2r, low32), k, 0x00);
+        x1 = _mm_xor_si128(x1, x2r);
+        return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+    }
+
+    __attribute__((target("default")))
+    static void adlerSums(uint32_t& s1, uint32_t& s2, const uint8_t* p, size_t n) { adlerScalar(s1, s2, p, n); }
+    __attribute__((target("default")))
+    static const char* adlerSumsVariant() { return "scalar"; }
+
+    __attribute__((target("avx2")))
+    static const char* adlerSumsVariant() { return "avx2"; }
+
+    __attribute__((target("avx2")))
+    static uint32_t total(__m256i v) {
+        __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0x4e));
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0xb1));
+        return static_cast<uint32_t>(_mm_cvtsi128_si32(x));
+    }
+
+    // Per 32-byte block: s2 += 32 * s1 + sum((32 - i) * p[i]), s1 += sum(p[i]).
+    // The 32 * s1 terms are gathered in 'prefix' and applied once per run.
+    __attribute__((target("avx2")))
+    static void adlerSums(uint32_t& s1, uint32_t& s2, const uint8_t* p, size_t n) {
+        const __m256i taps = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                              16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+        while (n >= 32) {
+            size_t blocks = (n < kAdlerRun ? n : kAdlerRun) / 32;
+            n -= blocks * 32;
+            __m256i sum1 = zero, prefix = zero, sum2 = zero;
+            const uint32_t startS1 = s1;
+            const size_t runBlocks = blocks;
+            for (; blocks; --blocks, p += 32) {
+                const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                prefix = _mm256_add_epi32(prefix, sum1);
+                sum1 = _mm256_add_epi32(sum1, _mm256_sad_epu8(bytes, zero));
+                sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, taps), ones));
+            }
+            s1 += total(sum1);
+            s2 += static_cast<uint32_t>((32 * (uint64_t(startS1) * runBlocks + total(prefix)) + total(sum2)) % kAdlerBase);
+            s1 %= kAdlerBase;
+            s2 %= kAdlerBase;
+        }
+        adlerScalar(s1, s2, p, n);
+    }
+#else
+    static uint32_t crcFold(uint32_t c, const uint8_t* p, size_t n) { return crcTable(c, p, n); }
+    static const char* crcFoldVariant() { return "slicing-by-8"; }
+    static void adlerSums(uint32_t& s1, uint32_t& s2, const uint8_t* p, size_t n) { adlerScalar(s1, s2, p, n); }
+    static const char* adlerSumsVariant() { return "scalar"; }
+#endif
+};
+
+#endif // IMGC_CHECKSUM_H
@@ -1,6 +1,6 @@
 // image_compress.cpp
-// Build example: g++ -O3 image_compress.cpp lodepng.cpp -o imgc
-// Requires: stb_image.h, stb_image_write.h, lodepng.h, lodepng.cpp
+// Build example: g++ -O3 -ffp-contract=off image_compress.cpp lodepng.cpp -o imgc
+// Requires: stb_image.h, stb_image_write.h, lodepng.h, lodepng.cpp, cpu_dispatch.h, async_io.h, png_decode.h, checksum.h, png_filter.h, adam7.h, near_lossless.h, lossy_lz.h
 
 #include <iostream>
 #include <vector>
@@ -10,10 +10,60 @@
 #include <cstdint>
 #include <cstdlib>   // strtof
 #include <limits>
-#include <unordered_map>
 #include <set>
 #include <cctype>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <array>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <functional>
 
+#ifdef __linux__
+#include <sys/mman.h>  // memfd_create, mmap (shared ring for --serve)
+#include <poll.h>      // command lookahead for --serve
+#include <unistd.h>
+#include <sys/socket.h>  // shard nodes (--sharded)
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <csignal>
+#endif
+
+#include "cpu_dispatch.h"
+#include "async_io.h"
+#include "png_decode.h"
+#include "checksum.h"
+#include "png_filter.h"
+#include "adam7.h"
+#include "near_lossless.h"
+#include "lossy_lz.h"
+#include "jpeg_aq.h"
+
+// stbi_write_png's filter choice (stb's own sum-of-magnitudes estimate), fused.
+static int stbFilterRow(const uint8_t* row, const uint8_t* prior, uint8_t* out, size_t length, size_t bpp,
+                        int force, uint8_t* scratch) {
+    if (force >= 0) {
+        PngFilter::apply(force, row, prior, out, length, bpp, PngFilter::Score::SignedSum);
+        return force;
+    }
+    return PngFilter::choose(row, prior, out, length, bpp, PngFilter::Score::SignedSum, scratch);
+}
+
+#define STBIW_KERNEL IMGC_MULTIVERSION  // clone stb's JPEG DCT and deflate too
+#define STBIW_CRC32(buffer, len) Checksum::crc32(0, buffer, static_cast<size_t>(len))
+#define STBIW_ADLER32(data, len) Checksum::adler32(1, data, static_cast<size_t>(len))
+#define STBIW_FILTER_ROW(row, prior, out, len, n, force, scratch) \
+    stbFilterRow(row, prior, out, static_cast<size_t>(len), static_cast<size_t>(n), force, scratch)
+#define STBIW_JPG_ADAPT_DU(du, coeffs) JpegAQ::adapt(du, coeffs)
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image.h"
@@ -21,46 +71,62 @@
 
 #include "lodepng.h"  // for PNG-8 (indexed) output
 
-struct RGB { uint8_t r, g, b; };
+// lodepng.h leaves LODEPNG_COMPILE_CRC off, so its chunk CRC is this one.
+unsigned lodepng_crc32(const unsigned char* data, size_t length) { return Checksum::crc32(0, data, length); }
 
-// ---------- YCbCr helpers ----------
-struct YCbCr {
-    float y, cb, cr;
+// ---------- planar YCbCr ----------
+// One float plane per channel so the per-pixel kernels below are flat loops
+// the compiler can vectorize (and clone per ISA level, see cpu_dispatch.h).
+struct PlanarYCbCr {
+    int w = 0, h = 0;
+    std::vector<float> y, cb, cr;
 
-    static YCbCr fromRGB(const RGB& rgb) {
-        YCbCr c;
-        c.y  = 0.299f * rgb.r + 0.587f * rgb.g + 0.114f * rgb.b;
-        c.cb = 128.0f - 0.168736f * rgb.r - 0.331264f * rgb.g + 0.5f * rgb.b;
-        c.cr = 128.0f + 0.5f * rgb.r - 0.418688f * rgb.g - 0.081312f * rgb.b;
-        return c;
-    }
+    PlanarYCbCr(int width, int height)
+        : w(width), h(height), y(size_t(width) * size_t(height)), cb(y.size()), cr(y.size()) {}
 
-    RGB toRGB() const {
-        float r = y + 1.402f * (cr - 128.0f);
-        float g = y - 0.344136f * (cb - 128.0f) - 0.714136f * (cr - 128.0f);
-        float b = y + 1.772f * (cb - 128.0f);
-        RGB out;
-        out.r = static_cast<uint8_t>(std::clamp<int>(static_cast<int>(std::lround(r)), 0, 255));
-        out.g = static_cast<uint8_t>(std::clamp<int>(static_cast<int>(std::lround(g)), 0, 255));
-        out.b = static_cast<uint8_t>(std::clamp<int>(static_cast<int>(std::lround(b)), 0, 255));
-        return out;
+    size_t size() const { return y.size(); }
+};
+
+// The kernels below work on runs of pixels or rows given by pointer, so the
+// whole-frame stages, the band executor and the tile executor share them and
+// produce the same bits.
+IMGC_MULTIVERSION
+static void convertPixels(const uint8_t* rgb, float* Y, float* Cb, float* Cr, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        const float r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+        Y[i]  = 0.299f * r + 0.587f * g + 0.114f * b;
+        Cb[i] = 128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b;
+        Cr[i] = 128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b;
     }
+}
 
-    RGB toRGBRounded(int multiple = 2) const {
-        auto roundToMultiple = [](float val, int mult) -> uint8_t {
-            int v = static_cast<int>(std::lround(val / mult) * mult);
-            return static_cast<uint8_t>(std::clamp(v, 0, 255));
-        };
-        float r = y + 1.402f * (cr - 128.0f);
-        float g = y - 0.344136f * (cb - 128.0f) - 0.714136f * (cr - 128.0f);
-        float b = y + 1.772f * (cb - 128.0f);
-        RGB out;
-        out.r = roundToMultiple(r, multiple);
-        out.g = roundToMultiple(g, multiple);
-        out.b = roundToMultiple(b, multiple);
-        return out;
+// pixels [begin, end)
+void rgbToPlanar(const uint8_t* rgb, PlanarYCbCr& p, size_t begin, size_t end) {
+    convertPixels(rgb + begin * 3, p.y.data() + begin, p.cb.data() + begin, p.cr.data() + begin, end - begin);
+}
+
+void rgbToPlanar(const uint8_t* rgb, PlanarYCbCr& p) { rgbToPlanar(rgb, p, 0, p.size()); }
+
+// Back to interleaved RGB, rounding each channel to the nearest multiple of
+// 'multiple' (1 = plain rounding, 2/4 = perceptual rounding) and clamping.
+IMGC_MULTIVERSION
+static void toRGBPixels(const float* Y, const float* Cb, const float* Cr, uint8_t* rgb, size_t n, int multiple) {
+    const float m = static_cast<float>(multiple);
+    for (size_t i = 0; i < n; ++i) {
+        const float r = Y[i] + 1.402f * (Cr[i] - 128.0f);
+        const float g = Y[i] - 0.344136f * (Cb[i] - 128.0f) - 0.714136f * (Cr[i] - 128.0f);
+        const float b = Y[i] + 1.772f * (Cb[i] - 128.0f);
+        rgb[i*3]   = static_cast<uint8_t>(std::clamp(std::round(r / m) * m, 0.0f, 255.0f));
+        rgb[i*3+1] = static_cast<uint8_t>(std::clamp(std::round(g / m) * m, 0.0f, 255.0f));
+        rgb[i*3+2] = static_cast<uint8_t>(std::clamp(std::round(b / m) * m, 0.0f, 255.0f));
     }
-};
+}
+
+void planarToRGB(const PlanarYCbCr& p, uint8_t* rgb, int multiple, size_t begin, size_t end) {
+    toRGBPixels(p.y.data() + begin, p.cb.data() + begin, p.cr.data() + begin, rgb + begin * 3, end - begin, multiple);
+}
+
+void planarToRGB(const PlanarYCbCr& p, uint8_t* rgb, int multiple) { planarToRGB(p, rgb, multiple, 0, p.size()); }
 
 // ---------- core processing ----------
 static inline float quantize(float value, int levels) {
@@ -69,21 +135,88 @@ static inline float quantize(float value, int levels) {
     return std::round(value / step) * step;
 }
 
-static inline float orderedDither(float value, int x, int y, int levels) {
+// Ordered dither patterns. Bayer is the 4x4 matrix, whose texture none of
+// PNG's filters can predict; Rows and Columns spread four thresholds over y or
+// over x only, so in a flat area every row (column) is constant and the Sub
+// (Up) filter predicts it exactly.
+enum class OrderedPattern { None, Bayer, Rows, Columns };
+
+static inline float orderedDither(float value, int x, int y, int levels, OrderedPattern pattern) {
     static constexpr float bayer[4][4] = {
         {0.0f/16, 8.0f/16, 2.0f/16, 10.0f/16},
         {12.0f/16, 4.0f/16, 14.0f/16, 6.0f/16},
         {3.0f/16, 11.0f/16, 1.0f/16, 9.0f/16},
         {15.0f/16, 7.0f/16, 13.0f/16, 5.0f/16}
     };
+    static constexpr float line[4] = {1.0f/8, 5.0f/8, 3.0f/8, 7.0f/8};
     const float step = 255.0f / (std::max(levels, 2) - 1);
-    const float threshold = (bayer[y % 4][x % 4] - 0.5f) * step;
+    const float t = pattern == OrderedPattern::Rows ? line[y % 4]
+                  : pattern == OrderedPattern::Columns ? line[x % 4] : bayer[y % 4][x % 4];
+    const float threshold = (t - 0.5f) * step;
     const float out = value + threshold;
     return std::clamp(out, 0.0f, 255.0f);
 }
 
-void chromaBlur(std::vector<YCbCr>& px, int w, int h, float sigma) {
-    if (sigma < 0.1f) return;
+// Separable Gaussian over one plane. Each row is edge-padded into a scratch
+// line so the inner loops are branch-free runs over contiguous floats; taps
+// are accumulated in the same order as a direct clamped convolution. The two
+// passes take row ranges so the band executor can run them as rows arrive:
+// output rows [y0, y1) need horizontal rows up to y1 + radius.
+
+// dst[x] = sum over k of line[x + k] * kernel[k]; line holds n + 2 * radius samples
+IMGC_MULTIVERSION
+static void blurLine(const float* line, float* dst, int n, const std::vector<float>& kernel) {
+    std::fill(dst, dst + n, 0.0f);
+    for (size_t k = 0; k < kernel.size(); ++k) {
+        const float kv = kernel[k];
+        const float* s = line + k;
+        for (int x = 0; x < n; ++x) dst[x] += s[x] * kv;
+    }
+}
+
+// dst[x] = sum over i of rows[i][x] * kernel[i]
+IMGC_MULTIVERSION
+static void blurColumns(const float* const* rows, float* dst, int n, const std::vector<float>& kernel) {
+    std::fill(dst, dst + n, 0.0f);
+    for (size_t i = 0; i < kernel.size(); ++i) {
+        const float kv = kernel[i];
+        const float* s = rows[i];
+        for (int x = 0; x < n; ++x) dst[x] += s[x] * kv;
+    }
+}
+
+static void blurRowsH(const std::vector<float>& plane, std::vector<float>& tmp, int w, int y0, int y1,
+                      const std::vector<float>& kernel, std::vector<float>& line) {
+    const int radius = static_cast<int>(kernel.size() / 2);
+    line.resize(w + 2 * radius);
+    for (int y = y0; y < y1; ++y) {
+        const float* src = &plane[size_t(y) * w];
+        for (int i = 0; i < radius; ++i) {
+            line[i] = src[0];
+            line[radius + w + i] = src[w - 1];
+        }
+        std::copy(src, src + w, line.begin() + radius);
+        blurLine(line.data(), &tmp[size_t(y) * w], w, kernel);
+    }
+}
+
+static void blurRowsV(std::vector<float>& plane, const std::vector<float>& tmp, int w, int h, int y0, int y1,
+                      const std::vector<float>& kernel) {
+    const int radius = static_cast<int>(kernel.size() / 2);
+    std::vector<const float*> rows(kernel.size());
+    for (int y = y0; y < y1; ++y) {
+        for (int i = -radius; i <= radius; ++i) rows[i + radius] = &tmp[size_t(std::clamp(y + i, 0, h - 1)) * w];
+        blurColumns(rows.data(), &plane[size_t(y) * w], w, kernel);
+    }
+}
+
+static void blurPlane(std::vector<float>& plane, int w, int h, const std::vector<float>& kernel) {
+    std::vector<float> tmp(plane.size()), line;
+    blurRowsH(plane, tmp, w, 0, h, kernel, line);  // plane -> tmp
+    blurRowsV(plane, tmp, w, h, 0, h, kernel);     // tmp -> plane
+}
+
+static std::vector<float> gaussianKernel(float sigma) {
     const int radius = static_cast<int>(std::ceil(sigma * 2));
     std::vector<float> kernel(radius * 2 + 1);
     float sum = 0.0f;
@@ -92,72 +225,771 @@ void chromaBlur(std::vector<YCbCr>& px, int w, int h, float sigma) {
         kernel[i + radius] = v; sum += v;
     }
     for (auto& k : kernel) k /= sum;
+    return kernel;
+}
+
+void chromaBlur(PlanarYCbCr& p, float sigma) {
+    if (sigma < 0.1f) return;
+    const std::vector<float> kernel = gaussianKernel(sigma);
+    blurPlane(p.cb, p.w, p.h, kernel);
+    blurPlane(p.cr, p.w, p.h, kernel);
+}
+
+// Averages factor x factor blocks in place over a w x h region starting on a
+// block corner; blocks at the region's right and bottom edges may be partial.
+IMGC_MULTIVERSION
+static void subsampleBlocks(float* plane, size_t stride, int w, int h, int factor) {
+    for (int y = 0; y < h; y += factor) {
+        const int bh = std::min(factor, h - y);
+        for (int x = 0; x < w; x += factor) {
+            const int bw = std::min(factor, w - x);
+            float avg = 0.0f;
+            for (int dy = 0; dy < bh; ++dy) {
+                const float* row = &plane[size_t(y + dy) * stride + x];
+                for (int dx = 0; dx < bw; ++dx) avg += row[dx];
+            }
+            avg /= static_cast<float>(bw * bh);
+            for (int dy = 0; dy < bh; ++dy) {
+                float* row = &plane[size_t(y + dy) * stride + x];
+                for (int dx = 0; dx < bw; ++dx) row[dx] = avg;
+            }
+        }
+    }
+}
+
+// rows [y0, y1) with y0 a multiple of factor and y1 one too, or h
+static void subsamplePlane(std::vector<float>& plane, int w, int factor, int y0, int y1) {
+    subsampleBlocks(&plane[size_t(y0) * w], w, w, y1 - y0, factor);
+}
+
+void chromaSubsample(PlanarYCbCr& p, int factor) {
+    if (factor <= 1) return;
+    subsamplePlane(p.cb, p.w, factor, 0, p.h);
+    subsamplePlane(p.cr, p.w, factor, 0, p.h);
+}
+
+// Fused quantize pass: optional ordered dither on Y, level quantization of all
+// three planes, and (when dithering) rounding Y to even values. One run of n
+// pixels starting at image position (x0, y).
+IMGC_MULTIVERSION
+static void quantizeRow(float* Y, float* Cb, float* Cr, int n, int x0, int y,
+                        int lumaLevels, int chromaLevels, OrderedPattern dither) {
+    for (int i = 0; i < n; ++i) {
+        const int x = x0 + i;
+        if (dither != OrderedPattern::None) {
+            const float q = quantize(orderedDither(Y[i], x, y, lumaLevels, dither), lumaLevels);
+            Y[i] = std::clamp(std::round(q / 2.0f) * 2.0f, 0.0f, 255.0f);
+        } else {
+            Y[i] = quantize(Y[i], lumaLevels);
+        }
+        Cb[i] = quantize(Cb[i], chromaLevels);
+        Cr[i] = quantize(Cr[i], chromaLevels);
+    }
+}
+
+// rows [y0, y1)
+void quantizePlanes(PlanarYCbCr& p, int lumaLevels, int chromaLevels, OrderedPattern dither, int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+        const size_t row = size_t(y) * p.w;
+        quantizeRow(&p.y[row], &p.cb[row], &p.cr[row], p.w, 0, y, lumaLevels, chromaLevels, dither);
+    }
+}
+
+void quantizePlanes(PlanarYCbCr& p, int lumaLevels, int chromaLevels, OrderedPattern dither) {
+    quantizePlanes(p, lumaLevels, chromaLevels, dither, 0, p.h);
+}
+
+void quantizeChromaPlanes(PlanarYCbCr& p, int chromaLevels) {
+    for (size_t i = 0; i < p.size(); ++i) {
+        p.cb[i] = quantize(p.cb[i], chromaLevels);
+        p.cr[i] = quantize(p.cr[i], chromaLevels);
+    }
+}
+
+// ---------- histogram-adapted levels ----------
+// Reconstruction levels of one plane as a table indexed by the rounded sample.
+struct LevelMap {
+    std::array<float, 256> lut{};
+    int used = 0;  // distinct reconstruction levels
+
+    float operator()(float v) const {
+        return lut[static_cast<int>(std::clamp(v, 0.0f, 255.0f) + 0.5f)];
+    }
+};
+
+// Prefix sums of a plane's 256-bin histogram: count[b] and moment[b] cover
+// bins below b, so any cell's population and centroid are O(1).
+struct LevelHistogram {
+    std::array<double, 257> count{}, moment{}, square{};
+
+    explicit LevelHistogram(const std::vector<float>& plane) {
+        std::array<uint32_t, 256> hist{};
+        for (float v : plane) ++hist[static_cast<int>(std::clamp(v, 0.0f, 255.0f) + 0.5f)];
+        for (int b = 0; b < 256; ++b) {
+            count[b + 1]  = count[b] + hist[b];
+            moment[b + 1] = moment[b] + double(b) * hist[b];
+            square[b + 1] = square[b] + double(b) * b * hist[b];
+        }
+    }
+    // sum of (b - level)^2 over bins [first, last]
+    double error(int first, int last, double level) const {
+        const double n = count[last + 1] - count[first], m = moment[last + 1] - moment[first];
+        return (square[last + 1] - square[first]) - 2.0 * level * m + level * level * n;
+    }
+};
+
+// Fills map.lut with nearest-level lookups and returns the squared error.
+static double applyLevels(const LevelHistogram& hist, const std::vector<double>& lv, LevelMap& map) {
+    double err = 0.0;
+    int first = 0;
+    for (int b = 0, i = 0; b < 256; ++b) {
+        if (i + 1 < static_cast<int>(lv.size()) && b - lv[i] > lv[i + 1] - b) {
+            err += hist.error(first, b - 1, lv[i]);
+            first = b;
+            while (i + 1 < static_cast<int>(lv.size()) && b - lv[i] > lv[i + 1] - b) ++i;
+        }
+        map.lut[b] = static_cast<float>(lv[i]);
+        if (b == 255) err += hist.error(first, 255, lv[i]);
+    }
+    map.used = static_cast<int>(lv.size());
+    return err;
+}
+
+// Lloyd-Max fit of 'levels' levels over the occupied range: alternately place
+// decision thresholds midway between levels and move each level to the
+// centroid of its cell. Each iteration is O(levels).
+static double lloydMaxFit(const LevelHistogram& hist, int lo, int hi, int levels, LevelMap& map) {
+    std::vector<double> lv;
+    for (int i = 0; i < levels; ++i) lv.push_back(lo + double(hi - lo) * i / (levels - 1));
+    auto upper = [&](size_t i) {  // cell i holds bins (upper(i-1), upper(i)]
+        return i + 1 == lv.size() ? 255 : static_cast<int>(std::floor((lv[i] + lv[i + 1]) / 2));
+    };
+    for (int iter = 0; iter < 64; ++iter) {
+        double moved = 0.0;
+        int first = 0;
+        for (size_t i = 0; i < lv.size(); ++i) {
+            const int last = std::max(upper(i), first - 1);
+            const double n = hist.count[last + 1] - hist.count[first];
+            if (n > 0) {
+                const double c = (hist.moment[last + 1] - hist.moment[first]) / n;
+                moved = std::max(moved, std::abs(c - lv[i]));
+                lv[i] = c;
+            }
+            first = last + 1;
+        }
+        if (moved < 0.01) break;
+    }
+    return applyLevels(hist, lv, map);
+}
+
+// Rate-distortion fit: the fewest Lloyd-Max levels whose error on the plane's
+// histogram does not exceed that of 'levels' uniform steps. Fewer levels mean
+// fewer distinct colors at no loss in fidelity; a binary search over the count
+// costs a few dozen fits, i.e. microseconds next to the histogram pass.
+LevelMap lloydMaxLevels(const std::vector<float>& plane, int levels) {
+    const LevelHistogram hist(plane);
+    levels = std::max(levels, 2);
+    int lo = 255, hi = 0, occupied = 0;
+    for (int b = 0; b < 256; ++b)
+        if (hist.count[b + 1] > hist.count[b]) { lo = std::min(lo, b); hi = b; ++occupied; }
+
+    LevelMap map;
+    if (occupied == 0) return map;
+    if (occupied == 1) { applyLevels(hist, {double(lo)}, map); return map; }
+
+    std::vector<double> uniform(levels);
+    for (int i = 0; i < levels; ++i) uniform[i] = 255.0 * i / (levels - 1);
+    const double budget = applyLevels(hist, uniform, map);  // kept if no fit is within budget
+
+    LevelMap fit;
+    int a = 2, b = std::min(levels, occupied);
+    if (lloydMaxFit(hist, lo, hi, b, fit) > budget) return map;
+    map = fit;
+    while (a < b) {  // map holds the fit for b
+        const int mid = (a + b) / 2;
+        if (lloydMaxFit(hist, lo, hi, mid, fit) <= budget) { map = fit; b = mid; }
+        else a = mid + 1;
+    }
+    return map;
+}
+
+struct PlaneLevels { LevelMap y, cb, cr; };
+
+PlaneLevels lloydMaxPlanes(const PlanarYCbCr& p, int lumaLevels, int chromaLevels) {
+    return {lloydMaxLevels(p.y, lumaLevels), lloydMaxLevels(p.cb, chromaLevels),
+            lloydMaxLevels(p.cr, chromaLevels)};
+}
 
-    std::vector<YCbCr> tmp = px;
-    // horizontal
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            float cb = 0.0f, cr = 0.0f;
-            for (int i = -radius; i <= radius; ++i) {
-                int sx = std::clamp(x + i, 0, w - 1);
-                float k = kernel[i + radius];
-                const auto& s = tmp[y * w + sx];
-                cb += s.cb * k; cr += s.cr * k;
+// quantizePlanes with table levels; the dither amplitude still follows the
+// uniform step for lumaLevels.
+IMGC_MULTIVERSION
+void quantizePlanes(PlanarYCbCr& p, const PlaneLevels& lv, int lumaLevels, OrderedPattern dither) {
+    for (int y = 0; y < p.h; ++y) {
+        const size_t row = size_t(y) * p.w;
+        float* Y  = &p.y[row];
+        float* Cb = &p.cb[row];
+        float* Cr = &p.cr[row];
+        for (int x = 0; x < p.w; ++x) {
+            if (dither != OrderedPattern::None) {
+                const float q = lv.y(orderedDither(Y[x], x, y, lumaLevels, dither));
+                Y[x] = std::clamp(std::round(q / 2.0f) * 2.0f, 0.0f, 255.0f);
+            } else {
+                Y[x] = lv.y(Y[x]);
             }
-            auto& d = px[y * w + x];
-            d.cb = cb; d.cr = cr;
+            Cb[x] = lv.cb(Cb[x]);
+            Cr[x] = lv.cr(Cr[x]);
         }
     }
-    // vertical
-    tmp = px;
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            float cb = 0.0f, cr = 0.0f;
-            for (int i = -radius; i <= radius; ++i) {
-                int sy = std::clamp(y + i, 0, h - 1);
-                float k = kernel[i + radius];
-                const auto& s = tmp[sy * w + x];
-                cb += s.cb * k; cr += s.cr * k;
+}
+
+void quantizeChromaPlanes(PlanarYCbCr& p, const PlaneLevels& lv) {
+    for (size_t i = 0; i < p.size(); ++i) {
+        p.cb[i] = lv.cb(p.cb[i]);
+        p.cr[i] = lv.cr(p.cr[i]);
+    }
+}
+
+static int workerThreads(int requested) {
+    if (requested > 0) return requested;
+    const unsigned hc = std::thread::hardware_concurrency();
+    return hc ? static_cast<int>(hc) : 1;
+}
+
+// Splits [0, n) into one contiguous range per worker; fn(begin, end).
+template <typename F>
+void parallelFor(size_t n, int threads, F&& fn) {
+    static constexpr size_t kMinPerThread = 16384;
+    threads = static_cast<int>(std::clamp<size_t>(n / kMinPerThread, 1, std::max(threads, 1)));
+    const size_t chunk = (n + threads - 1) / threads;
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t) {
+        const size_t begin = std::min(n, chunk * t), end = std::min(n, chunk * (t + 1));
+        pool.emplace_back([&fn, begin, end] { fn(begin, end); });
+    }
+    fn(size_t(0), std::min(n, chunk));
+    for (auto& t : pool) t.join();
+}
+
+// ---------- band dataflow ----------
+// Streams row bands through a chain of stages that each read only a few rows
+// around their own (per-pixel kernels, the blur's halo, subsample blocks).
+// Every stage takes bands in order and publishes how many rows it has
+// finished; a band may start once the previous stage has finished all the
+// rows it reads, i.e. the band plus the stage's halo below it. With
+// 'threaded' each stage runs on its own thread, so a frame costs about its
+// slowest stage instead of the sum; otherwise bands are interleaved on the
+// calling thread, which at least keeps each band in cache between stages.
+// Returns each stage's busy time in ms.
+struct BandStage {
+    const char* name;
+    int halo;                               // rows past a band read from the previous stage
+    std::function<void(int y0, int y1)> run;
+};
+
+static std::vector<double> runBands(const std::vector<BandStage>& stages, int h, int band, bool threaded) {
+    const size_t n = stages.size();
+    std::vector<int> done(n, 0);
+    std::vector<double> busy(n, 0.0);
+    std::mutex mutex;
+    std::condition_variable progressed;
+
+    auto ready = [&](size_t i, int y1) {
+        return i == 0 || done[i - 1] >= std::min(h, y1 + stages[i].halo);
+    };
+    auto runBand = [&](size_t i, int y0, int y1) {
+        const auto t0 = std::chrono::steady_clock::now();
+        stages[i].run(y0, y1);
+        busy[i] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+
+    if (!threaded) {
+        while (done[n - 1] < h) {
+            for (size_t i = 0; i < n; ++i) {
+                const int y1 = std::min(h, done[i] + band);
+                if (done[i] < h && ready(i, y1)) {
+                    runBand(i, done[i], y1);
+                    done[i] = y1;
+                }
             }
-            auto& d = px[y * w + x];
-            d.cb = cb; d.cr = cr;
         }
+        return busy;
+    }
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < n; ++i) {
+        pool.emplace_back([&, i] {
+            for (int y0 = 0; y0 < h; y0 += band) {
+                const int y1 = std::min(h, y0 + band);
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    progressed.wait(lock, [&] { return ready(i, y1); });
+                }
+                runBand(i, y0, y1);
+                std::lock_guard<std::mutex> lock(mutex);
+                done[i] = y1;
+                progressed.notify_all();
+            }
+        });
     }
+    for (auto& t : pool) t.join();
+    return busy;
 }
 
-void chromaSubsample(std::vector<YCbCr>& px, int w, int h, int factor) {
-    if (factor <= 1) return;
-    for (int y = 0; y < h; y += factor) {
-        for (int x = 0; x < w; x += factor) {
-            float avgCb = 0.0f, avgCr = 0.0f;
-            int cnt = 0;
-            for (int dy = 0; dy < factor && y + dy < h; ++dy) {
-                for (int dx = 0; dx < factor && x + dx < w; ++dx) {
-                    const auto& p = px[(y + dy) * w + (x + dx)];
-                    avgCb += p.cb; avgCr += p.cr; ++cnt;
+// ---------- tiled execution ----------
+// Fuses convert, blur, subsample, quantize and toRGB per tile. A tile of the
+// output is computed from its RGB input plus a halo of the blur radius, in
+// scratch small enough to stay in L2 (~150 KB for 128x64), so the frame is
+// read once as RGB and written once as RGB instead of every stage sweeping
+// full float planes through DRAM. Tiles are independent and spread over the
+// threads; their sides are multiples of the subsample factor so no block
+// straddles two tiles. Same kernels as the full-frame stages, same bits.
+struct TilePlan {
+    float blurSigma = 0.0f;  // chroma blur when >= 0.1
+    int subsample = 1;       // chroma block size
+    bool quantize = false;   // uniform levels, ordered or no dither
+    int lumaLevels = 0, chromaLevels = 0;
+    OrderedPattern dither = OrderedPattern::None;
+    int rgbMultiple = 1;
+};
+
+// Output rows [y0, y1) of a w x h frame, from 'rgb' holding its rows from
+// inputY0 on (at least y0 - radius .. y1 + radius, clipped to the frame) into
+// 'out' holding rows y0 .. y1; y0 must be a multiple of the subsample factor.
+static void runTiles(const uint8_t* rgb, int w, int h, uint8_t* out, const TilePlan& plan, int threads,
+                     int y0, int y1, int inputY0) {
+    static constexpr int kTileW = 128, kTileH = 64;
+    const std::vector<float> kernel = plan.blurSigma >= 0.1f ? gaussianKernel(plan.blurSigma) : std::vector<float>();
+    const int radius = static_cast<int>(kernel.size() / 2);
+    const int f = std::max(plan.subsample, 1);
+    const int tileW = (kTileW + f - 1) / f * f, tileH = (kTileH + f - 1) / f * f;
+    const int cols = (w + tileW - 1) / tileW, rows = (y1 - y0 + tileH - 1) / tileH;
+    const size_t tiles = size_t(cols) * rows, pixels = size_t(w) * (y1 - y0);
+    if (pixels == 0) return;
+
+    parallelFor(pixels, threads, [&](size_t begin, size_t end) {
+        std::vector<float> Y, Cb, Cr, tmpCb, tmpCr, line;
+        std::vector<const float*> taps(kernel.size());
+        for (size_t t = begin * tiles / pixels; t < end * tiles / pixels; ++t) {
+            const int tx0 = static_cast<int>(t % cols) * tileW, ty0 = y0 + static_cast<int>(t / cols) * tileH;
+            const int tw = std::min(w, tx0 + tileW) - tx0, th = std::min(y1, ty0 + tileH) - ty0;
+            const int hx0 = std::max(0, tx0 - radius), hy0 = std::max(0, ty0 - radius);
+            const int hw = std::min(w, tx0 + tw + radius) - hx0, hh = std::min(h, ty0 + th + radius) - hy0;
+            Y.resize(size_t(hw) * hh); Cb.resize(Y.size()); Cr.resize(Y.size());
+            auto at = [&](int x, int y) { return size_t(y - hy0) * hw + (x - hx0); };
+
+            for (int y = hy0; y < hy0 + hh; ++y)
+                convertPixels(rgb + (size_t(y - inputY0) * w + hx0) * 3, &Y[at(hx0, y)], &Cb[at(hx0, y)], &Cr[at(hx0, y)], hw);
+
+            if (radius > 0) {
+                tmpCb.resize(size_t(tw) * hh); tmpCr.resize(tmpCb.size()); line.resize(tw + 2 * radius);
+                for (auto [plane, tmp] : {std::pair{&Cb, &tmpCb}, std::pair{&Cr, &tmpCr}}) {
+                    for (int y = hy0; y < hy0 + hh; ++y) {
+                        for (int j = 0; j < tw + 2 * radius; ++j)
+                            line[j] = (*plane)[at(std::clamp(tx0 - radius + j, 0, w - 1), y)];
+                        blurLine(line.data(), &(*tmp)[size_t(y - hy0) * tw], tw, kernel);
+                    }
+                    for (int y = ty0; y < ty0 + th; ++y) {
+                        for (int i = -radius; i <= radius; ++i)
+                            taps[i + radius] = &(*tmp)[size_t(std::clamp(y + i, 0, h - 1) - hy0) * tw];
+                        blurColumns(taps.data(), &(*plane)[at(tx0, y)], tw, kernel);
+                    }
+                }
+            }
+            if (f > 1) {
+                subsampleBlocks(&Cb[at(tx0, ty0)], hw, tw, th, f);
+                subsampleBlocks(&Cr[at(tx0, ty0)], hw, tw, th, f);
+            }
+            for (int y = ty0; y < ty0 + th; ++y) {
+                const size_t i = at(tx0, y);
+                if (plan.quantize)
+                    quantizeRow(&Y[i], &Cb[i], &Cr[i], tw, tx0, y, plan.lumaLevels, plan.chromaLevels, plan.dither);
+                toRGBPixels(&Y[i], &Cb[i], &Cr[i], out + (size_t(y - y0) * w + tx0) * 3, tw, plan.rgbMultiple);
+            }
+        }
+    });
+}
+
+static void runTiles(const uint8_t* rgb, int w, int h, uint8_t* out, const TilePlan& plan, int threads) {
+    runTiles(rgb, w, h, out, plan, threads, 0, h, 0);
+}
+
+// ---------- error diffusion ----------
+// Floyd-Steinberg / Sierra error diffusion for any target with a load/quantize
+// pair (luma levels, an RGB palette, ...). Rows run in parallel as a wavefront:
+// row y+1 trails row y by 'lag' pixels, so every error it reads has already
+// been pushed down, and two rows never write the same error cell at once.
+// Errors for lower rows live in a ring of line buffers (rows in flight plus the
+// kernel's look-ahead) rather than a full frame; errors along the current row
+// stay in the worker's own line.
+// Rows and Columns are ordered patterns (see OrderedPattern); Residual carries
+// each pixel's error into the next one on its row only, so the dither lives in
+// the Sub residual and a flat area's rows come out identical for Up.
+enum class DitherMode { Bayer, FloydSteinberg, Sierra, Rows, Columns, Residual };
+
+static bool isOrdered(DitherMode mode) {
+    return mode == DitherMode::Bayer || mode == DitherMode::Rows || mode == DitherMode::Columns;
+}
+
+static OrderedPattern orderedPattern(DitherMode mode) {
+    return mode == DitherMode::Rows ? OrderedPattern::Rows
+         : mode == DitherMode::Columns ? OrderedPattern::Columns : OrderedPattern::Bayer;
+}
+
+struct DiffusionTap { int dx, dy; float weight; };
+
+struct DiffusionKernel {
+    const char* name;
+    int reach;  // max |dx| of the taps
+    int rows;   // rows touched, including the current one
+    std::vector<DiffusionTap> taps;
+};
+
+static const DiffusionKernel kFloydSteinberg = {
+    "floyd-steinberg", 1, 2,
+    {{1, 0, 7 / 16.0f}, {-1, 1, 3 / 16.0f}, {0, 1, 5 / 16.0f}, {1, 1, 1 / 16.0f}}};
+
+static const DiffusionKernel kSierra = {
+    "sierra", 2, 3,
+    {{1, 0, 5 / 32.0f}, {2, 0, 3 / 32.0f},
+     {-2, 1, 2 / 32.0f}, {-1, 1, 4 / 32.0f}, {0, 1, 5 / 32.0f}, {1, 1, 4 / 32.0f}, {2, 1, 2 / 32.0f},
+     {-1, 2, 2 / 32.0f}, {0, 2, 3 / 32.0f}, {1, 2, 2 / 32.0f}}};
+
+static const DiffusionKernel kRowCarry = {"row error carry", 1, 1, {{1, 0, 1.0f}}};
+
+static const DiffusionKernel& diffusionKernel(DitherMode mode) {
+    return mode == DitherMode::Sierra ? kSierra : mode == DitherMode::Residual ? kRowCarry : kFloydSteinberg;
+}
+
+// Target concept: 'channels', load(x, y, v) reads the source value and
+// quantize(x, y, v) stores the output for v and replaces v by what it decodes to.
+template <typename Target>
+void diffuseErrors(Target& target, int w, int h, const DiffusionKernel& k, int threads) {
+    constexpr int C = Target::channels;
+    threads = std::clamp(threads, 1, std::max(h, 1));
+    const int lag = (k.rows > 2 ? 2 * k.reach : k.reach) + 1;
+    const int ringRows = threads + k.rows - 1;
+    const size_t stride = size_t(w) * C;
+    std::vector<float> ring(stride * ringRows, 0.0f);
+    std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[std::max(h, 1)]);
+    for (int y = 0; y < h; ++y) progress[y].store(0, std::memory_order_relaxed);
+    std::atomic<int> nextRow{0};
+    static constexpr int kPublishEvery = 32;
+
+    auto worker = [&]() {
+        std::vector<float> own(stride + size_t(k.reach) * C, 0.0f);
+        for (int y; (y = nextRow.fetch_add(1)) < h; ) {
+            float* cur = &ring[size_t(y % ringRows) * stride];
+            std::fill(own.begin(), own.end(), 0.0f);
+            int ready = (y == 0 || k.rows == 1) ? w : 0;  // one-row kernels need nothing from above
+            for (int x = 0; x < w; ++x) {
+                const int need = std::min(w, x + lag);
+                while (ready < need) {
+                    ready = progress[y - 1].load(std::memory_order_acquire);
+                    if (ready < need) std::this_thread::yield();
+                }
+                float v[C], in[C];
+                target.load(x, y, v);
+                for (int c = 0; c < C; ++c) {
+                    float& e = cur[size_t(x) * C + c];
+                    in[c] = std::clamp(v[c] + e + own[size_t(x) * C + c], 0.0f, 255.0f);
+                    e = 0.0f;  // consumed: the slot is clean when the ring wraps
+                    v[c] = in[c];
                 }
+                target.quantize(x, y, v);
+                for (const auto& t : k.taps) {
+                    const int tx = x + t.dx, ty = y + t.dy;
+                    if (tx < 0 || tx >= w || ty >= h) continue;
+                    float* dst = t.dy == 0 ? &own[size_t(tx) * C]
+                                           : &ring[size_t(ty % ringRows) * stride + size_t(tx) * C];
+                    for (int c = 0; c < C; ++c) dst[c] += (in[c] - v[c]) * t.weight;
+                }
+                if ((x + 1) % kPublishEvery == 0) progress[y].store(x + 1, std::memory_order_release);
+            }
+            progress[y].store(w, std::memory_order_release);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+}
+
+// Luma to 'levels' steps (or the given table), then even-rounded like the
+// ordered-dither path.
+struct LumaLevelsTarget {
+    static constexpr int channels = 1;
+    PlanarYCbCr& p;
+    int levels;
+    const LevelMap* map;
+
+    void load(int x, int y, float* v) const { v[0] = p.y[size_t(y) * p.w + x]; }
+    void quantize(int x, int y, float* v) const {
+        const float q = map ? (*map)(v[0]) : ::quantize(v[0], levels);
+        v[0] = std::clamp(std::round(q / 2.0f) * 2.0f, 0.0f, 255.0f);
+        p.y[size_t(y) * p.w + x] = v[0];
+    }
+};
+
+void diffuseLuma(PlanarYCbCr& p, int lumaLevels, DitherMode mode, int threads,
+                 const LevelMap* map = nullptr) {
+    LumaLevelsTarget target{p, lumaLevels, map};
+    diffuseErrors(target, p.w, p.h, diffusionKernel(mode), threads);
+}
+
+// ---------- nearest palette color lookup ----------
+// Exact nearest palette entry (squared RGB distance, ties to the lower index).
+// A lazily filled 64^3 cell cache answers most queries with one load: a cell
+// caches an entry only when the triangle inequality proves it nearest for every
+// color in the cell, otherwise the cell is marked ambiguous and its colors take
+// the search. The search walks the palette sorted by luma outward from the
+// query's luma, scoring kBlock entries at a time with a vectorized distance
+// kernel, and stops once the luma gap alone rules out the rest.
+struct PaletteTables {
+    static constexpr int kBlock = 8;
+    // coordinates doubled so cell centers are integers; kBlock sentinel entries
+    // on both ends keep every block load in bounds
+    std::vector<int32_t> r2, g2, b2, luma, index;
+    int count = 0;
+};
+
+// squared distance in doubled coordinates from (qr2, qg2, qb2) to n entries
+IMGC_MULTIVERSION
+static void paletteDistances(const int32_t* r2, const int32_t* g2, const int32_t* b2, int n,
+                             int32_t qr2, int32_t qg2, int32_t qb2, int32_t* out) {
+    for (int i = 0; i < n; ++i) {
+        const int32_t dr = r2[i] - qr2, dg = g2[i] - qg2, db = b2[i] - qb2;
+        out[i] = dr * dr + dg * dg + db * db;
+    }
+}
+
+IMGC_MULTIVERSION
+static int paletteSearch(const PaletteTables& t, int r, int g, int b) {
+    constexpr int B = PaletteTables::kBlock;
+    constexpr int64_t kLumaNorm = 77 * 77 + 150 * 150 + 29 * 29;  // |luma weights|^2
+    const int32_t* R = t.r2.data() + B;
+    const int32_t* G = t.g2.data() + B;
+    const int32_t* Bl = t.b2.data() + B;
+    const int32_t* L = t.luma.data() + B;
+    const int32_t* I = t.index.data() + B;
+    const int32_t ql = 77 * r + 150 * g + 29 * b;
+    int32_t bestD = std::numeric_limits<int32_t>::max(), bestI = 0;
+    // d^2 >= dLuma^2 / |w|^2 (Cauchy-Schwarz); distances here are 4x, luma is 1x
+    auto beyond = [&](int32_t gap) { return int64_t(gap) * gap * 4 > int64_t(bestD) * kLumaNorm; };
+    auto scan = [&](int start) {
+        int32_t d[B];
+        for (int k = 0; k < B; ++k) {
+            const int32_t dr = R[start + k] - 2 * r, dg = G[start + k] - 2 * g, db = Bl[start + k] - 2 * b;
+            d[k] = dr * dr + dg * dg + db * db;
+        }
+        for (int k = 0; k < B; ++k)
+            if (d[k] < bestD || (d[k] == bestD && I[start + k] < bestI)) { bestD = d[k]; bestI = I[start + k]; }
+    };
+    int hi = static_cast<int>(std::lower_bound(L, L + t.count, ql) - L);
+    int lo = hi - 1;
+    while (hi < t.count || lo >= 0) {
+        if (hi < t.count) {
+            if (beyond(L[hi] - ql)) hi = t.count;
+            else { scan(hi); hi += B; }
+        }
+        if (lo >= 0) {
+            if (beyond(ql - L[lo])) lo = -1;
+            else { scan(lo - B + 1); lo -= B; }
+        }
+    }
+    return bestI;
+}
+
+class PaletteLookup {
+public:
+    explicit PaletteLookup(const std::vector<uint8_t>& paletteRGBA)
+        : cache_(new std::atomic<uint16_t>[kCells]) {
+        constexpr int B = PaletteTables::kBlock;
+        const int n = static_cast<int>(paletteRGBA.size() / 4);
+        std::vector<int> order(n);
+        for (int i = 0; i < n; ++i) order[i] = i;
+        auto lumaOf = [&](int i) {
+            return 77 * paletteRGBA[i*4] + 150 * paletteRGBA[i*4+1] + 29 * paletteRGBA[i*4+2];
+        };
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return lumaOf(a) < lumaOf(b); });
+        // sentinels sit far outside the cube; they never win and never overflow
+        const size_t padded = size_t(n) + 2 * B;
+        t_.r2.assign(padded, 20000); t_.g2.assign(padded, 20000); t_.b2.assign(padded, 20000);
+        t_.luma.assign(padded, 0); t_.index.assign(padded, 0xFFFF);
+        for (int k = 0; k < n; ++k) {
+            const int i = order[k];
+            t_.r2[B + k] = 2 * paletteRGBA[i*4];
+            t_.g2[B + k] = 2 * paletteRGBA[i*4+1];
+            t_.b2[B + k] = 2 * paletteRGBA[i*4+2];
+            t_.luma[B + k] = lumaOf(i);
+            t_.index[B + k] = i;
+        }
+        t_.count = n;
+        for (size_t c = 0; c < kCells; ++c) cache_[c].store(kEmpty, std::memory_order_relaxed);
+    }
+
+    int nearest(int r, int g, int b) const {
+        const size_t cell = (size_t(r >> 2) << 12) | (size_t(g >> 2) << 6) | size_t(b >> 2);
+        uint16_t e = cache_[cell].load(std::memory_order_relaxed);
+        if (e == kEmpty) e = fill(cell);
+        return e == kAmbiguous ? paletteSearch(t_, r, g, b) : e;
+    }
+
+    int search(int r, int g, int b) const { return paletteSearch(t_, r, g, b); }
+
+    void mapIndices(const uint8_t* rgb, size_t n, uint8_t* indices, int threads) const {
+        parallelFor(n, threads, [&](size_t begin, size_t end) {
+            uint32_t prev = 0xFFFFFFFFu;  // runs of one color skip the lookup
+            uint8_t idx = 0;
+            for (size_t i = begin; i < end; ++i) {
+                const uint32_t c = (uint32_t(rgb[i*3]) << 16) | (uint32_t(rgb[i*3+1]) << 8) | rgb[i*3+2];
+                if (c != prev) { idx = static_cast<uint8_t>(nearest(c >> 16, (c >> 8) & 0xFF, c & 0xFF)); prev = c; }
+                indices[i] = idx;
             }
-            avgCb /= static_cast<float>(cnt);
-            avgCr /= static_cast<float>(cnt);
-            for (int dy = 0; dy < factor && y + dy < h; ++dy) {
-                for (int dx = 0; dx < factor && x + dx < w; ++dx) {
-                    auto& p = px[(y + dy) * w + (x + dx)];
-                    p.cb = avgCb; p.cr = avgCr;
+        });
+    }
+
+private:
+    static constexpr size_t kCells = 64 * 64 * 64;
+    static constexpr uint16_t kEmpty = 0xFFFF, kAmbiguous = 0xFFFE;
+
+    // Cell values span 4 per channel; in doubled coordinates the center is
+    // 8c+3 and no member color is farther than sqrt(3) * 3 from it.
+    uint16_t fill(size_t cell) const {
+        constexpr int B = PaletteTables::kBlock;
+        const int32_t cr = 8 * int32_t(cell >> 12) + 3;
+        const int32_t cg = 8 * int32_t((cell >> 6) & 63) + 3;
+        const int32_t cb = 8 * int32_t(cell & 63) + 3;
+        std::vector<int32_t> d(t_.count);
+        paletteDistances(t_.r2.data() + B, t_.g2.data() + B, t_.b2.data() + B, t_.count, cr, cg, cb, d.data());
+        int32_t d1 = std::numeric_limits<int32_t>::max(), d2 = d1;
+        int best = 0;
+        for (int k = 0; k < t_.count; ++k) {
+            if (d[k] < d1) { d2 = d1; d1 = d[k]; best = t_.index[B + k]; }
+            else if (d[k] < d2) d2 = d[k];
+        }
+        const double radius = std::sqrt(3.0) * 3.0;
+        const uint16_t e = (std::sqrt(double(d2)) - std::sqrt(double(d1)) > 2.0 * radius)
+                               ? static_cast<uint16_t>(best) : kAmbiguous;
+        cache_[cell].store(e, std::memory_order_relaxed);
+        return e;
+    }
+
+    PaletteTables t_;
+    std::unique_ptr<std::atomic<uint16_t>[]> cache_;
+};
+
+// Interleaved RGB onto an arbitrary palette (RGBA entries, alpha ignored).
+struct PaletteTarget {
+    static constexpr int channels = 3;
+    const uint8_t* rgb;
+    const std::vector<uint8_t>& paletteRGBA;
+    const PaletteLookup& lookup;
+    uint8_t* indices;
+    int w;
+
+    void load(int x, int y, float* v) const {
+        const uint8_t* px = &rgb[(size_t(y) * w + x) * 3];
+        v[0] = px[0]; v[1] = px[1]; v[2] = px[2];
+    }
+    void quantize(int x, int y, float* v) const {
+        const int best = lookup.nearest(static_cast<int>(std::lround(v[0])),
+                                        static_cast<int>(std::lround(v[1])),
+                                        static_cast<int>(std::lround(v[2])));
+        indices[size_t(y) * w + x] = static_cast<uint8_t>(best);
+        v[0] = paletteRGBA[best*4]; v[1] = paletteRGBA[best*4+1]; v[2] = paletteRGBA[best*4+2];
+    }
+};
+
+void diffuseToPalette(const uint8_t* rgb, int w, int h, const std::vector<uint8_t>& paletteRGBA,
+                      std::vector<uint8_t>& indices, DitherMode mode, int threads) {
+    indices.resize(size_t(w) * h);
+    PaletteLookup lookup(paletteRGBA);
+    PaletteTarget target{rgb, paletteRGBA, lookup, indices.data(), w};
+    diffuseErrors(target, w, h, diffusionKernel(mode), threads);
+}
+
+// ---------- palette quantizer ----------
+// Median cut over a 5:5:5 histogram: repeatedly split the box with the most
+// pixels * extent along its longest axis at the pixel median. Palette entries
+// are the pixel-weighted box means (RGBA, opaque).
+std::vector<uint8_t> medianCutPalette(const uint8_t* rgb, size_t n, int colors) {
+    std::vector<uint32_t> hist(32 * 32 * 32, 0);
+    for (size_t i = 0; i < n; ++i)
+        ++hist[((rgb[i*3] >> 3) << 10) | ((rgb[i*3+1] >> 3) << 5) | (rgb[i*3+2] >> 3)];
+
+    struct Box { int lo[3], hi[3]; uint64_t count; };
+    auto boxCount = [&](Box& b) {
+        b.count = 0;
+        for (int r = b.lo[0]; r <= b.hi[0]; ++r)
+            for (int g = b.lo[1]; g <= b.hi[1]; ++g)
+                for (int bl = b.lo[2]; bl <= b.hi[2]; ++bl) b.count += hist[(r << 10) | (g << 5) | bl];
+    };
+    std::vector<Box> boxes{{{0, 0, 0}, {31, 31, 31}, 0}};
+    boxCount(boxes[0]);
+
+    while (static_cast<int>(boxes.size()) < colors) {
+        int pick = -1, axis = 0;
+        uint64_t bestScore = 0;
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            for (int a = 0; a < 3; ++a) {
+                const uint64_t extent = boxes[i].hi[a] - boxes[i].lo[a];
+                if (extent > 0 && boxes[i].count * extent > bestScore) {
+                    bestScore = boxes[i].count * extent; pick = static_cast<int>(i); axis = a;
                 }
             }
         }
+        if (pick < 0) break;  // every box is a single cell
+        Box b = boxes[pick];
+        // pixel histogram along the split axis
+        std::vector<uint64_t> slab(32, 0);
+        for (int r = b.lo[0]; r <= b.hi[0]; ++r)
+            for (int g = b.lo[1]; g <= b.hi[1]; ++g)
+                for (int bl = b.lo[2]; bl <= b.hi[2]; ++bl) {
+                    const int c[3] = {r, g, bl};
+                    slab[c[axis]] += hist[(r << 10) | (g << 5) | bl];
+                }
+        uint64_t acc = 0;
+        int cut = b.lo[axis];
+        for (int v = b.lo[axis]; v < b.hi[axis]; ++v) {
+            acc += slab[v];
+            cut = v;
+            if (acc * 2 >= b.count) break;
+        }
+        Box lo = b, hi = b;
+        lo.hi[axis] = cut;
+        hi.lo[axis] = cut + 1;
+        boxCount(lo); boxCount(hi);
+        boxes[pick] = lo;
+        boxes.push_back(hi);
+    }
+
+    std::vector<uint8_t> palette;
+    for (const auto& b : boxes) {
+        if (b.count == 0) continue;
+        double sum[3] = {0, 0, 0};
+        for (int r = b.lo[0]; r <= b.hi[0]; ++r)
+            for (int g = b.lo[1]; g <= b.hi[1]; ++g)
+                for (int bl = b.lo[2]; bl <= b.hi[2]; ++bl) {
+                    const double c = hist[(r << 10) | (g << 5) | bl];
+                    sum[0] += c * (r * 8 + 4); sum[1] += c * (g * 8 + 4); sum[2] += c * (bl * 8 + 4);
+                }
+        for (double v : sum) palette.push_back(static_cast<uint8_t>(std::clamp(v / b.count, 0.0, 255.0)));
+        palette.push_back(255);
     }
+    return palette;
 }
 
 // ---------- PNG-8 helper via lodepng ----------
-static bool write_png8_indexed(
-    const char* filename,
+static bool encode_png8_indexed(
+    std::vector<unsigned char>& outPNG,
     const std::vector<uint8_t>& indices,
     const std::vector<uint8_t>& paletteRGBA,
-    unsigned w, unsigned h
+    unsigned w, unsigned h,
+    bool interlace = false
 ) {
-    std::vector<unsigned char> outPNG;
     lodepng::State state;
+    state.info_png.interlace_method = interlace ? 1 : 0;  // Adam7
     state.info_raw.colortype = LCT_PALETTE;
     state.info_raw.bitdepth  = 8;
     state.info_png.color.colortype = LCT_PALETTE;
@@ -180,218 +1012,2482 @@ static bool write_png8_indexed(
                   << lodepng_error_text(err) << "\n";
         return false;
     }
-    err = lodepng::save_file(outPNG, filename);
-    if (err) {
-        std::cerr << "lodepng save_file error " << err << ": "
-                  << lodepng_error_text(err) << "\n";
-        return false;
-    }
     return true;
 }
 
-static inline uint32_t packRGB(uint8_t r, uint8_t g, uint8_t b) {
-    return (uint32_t(r) << 16) | (uint32_t(g) << 8) | uint32_t(b);
+// ---------- lossless PNG optimizer ----------
+// --lossless writes the decoded pixels exactly, as small as lodepng can make
+// them. The color type and bit depth are reduced once from the image's color
+// statistics (grey, palette, fewer bits where every pixel allows it), then the
+// filter/deflate trials below encode that in parallel and the smallest wins.
+// Filter strategies, each tried with the first deflate setting; the two
+// smallest are then tried with the other settings as well.
+struct LosslessFilter {
+    const char* name;
+    LodePNGFilterStrategy filter;
+};
+static const LosslessFilter kLosslessFilters[] = {
+    {"none", LFS_ZERO},
+    {"minsum", LFS_MINSUM},
+    {"entropy", LFS_ENTROPY},
+    {"paeth", LFS_FOUR},
+    {"brute-force", LFS_BRUTE_FORCE},  // deflates every filter of every row
+};
+constexpr size_t kLosslessBruteForcePixels = size_t(1) << 18;
+constexpr size_t kLosslessFinalists = 2;
+
+struct LosslessDeflate {
+    const char* name;
+    unsigned windowsize, nicematch, lazymatching;
+    bool smallOnly;  // only up to kLosslessBruteForcePixels
+};
+static const LosslessDeflate kLosslessDeflates[] = {
+    {"32K window", 32768, 258, 1, false},
+    {"greedy matching", 32768, 258, 0, false},  // a lazy match can cost more than it saves
+    {"nicematch 128", 32768, 128, 1, false},    // stops on shorter matches, so the hash chain ends differently
+    {"4K window", 4096, 258, 1, true},          // nearer matches, shorter distance codes
+};
+
+static std::string colorModeName(const LodePNGColorMode& mode) {
+    const char* type = mode.colortype == LCT_GREY ? "grey" : mode.colortype == LCT_RGB ? "RGB"
+                     : mode.colortype == LCT_PALETTE ? "palette" : mode.colortype == LCT_GREY_ALPHA ? "grey+alpha"
+                     : "RGBA";
+    std::string name = std::string(type) + " " + std::to_string(mode.bitdepth) + "-bit";
+    if (mode.colortype == LCT_PALETTE) name += ", " + std::to_string(mode.palettesize) + " colors";
+    if (mode.key_defined) name += ", tRNS key";
+    return name;
 }
 
-// ---------- main compression ----------
-// NOTE: 'compression' here means QUALITY in [0,1], where 1.0 = highest quality.
-bool compressImage(const char* input, const char* output, float compression) {
-    if (!(compression >= 0.0f && compression <= 1.0f) || !std::isfinite(compression)) {
-        std::cerr << "Compression (quality) must be a finite float in [0.0, 1.0]\n";
-        return false;
+// The source's pixels in its own PNG color mode, for --lossless where 8-bit
+// RGB would drop part of it.
+struct NativePixels {
+    lodepng::State state;  // info_png.color: the mode of 'pixels'
+    std::vector<uint8_t> pixels;
+};
+
+// Whether decoding this PNG to 8-bit RGB loses anything: 16-bit samples, an
+// alpha channel or a tRNS chunk. false for anything else, JPEG included.
+static bool pngNeedsNative(const uint8_t* bytes, size_t size) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 33 || std::memcmp(bytes, signature, 8) != 0) return false;
+    const uint8_t depth = bytes[24], colorType = bytes[25];
+    if (depth == 16 || colorType == 4 || colorType == 6) return true;
+    for (size_t pos = 8; pos + 8 <= size;) {
+        const size_t length = (size_t(bytes[pos]) << 24) | (size_t(bytes[pos + 1]) << 16) |
+                              (size_t(bytes[pos + 2]) << 8) | bytes[pos + 3];
+        const uint8_t* type = bytes + pos + 4;
+        if (std::memcmp(type, "tRNS", 4) == 0) return true;
+        if (std::memcmp(type, "IDAT", 4) == 0 || std::memcmp(type, "IEND", 4) == 0) break;  // tRNS comes first
+        pos += 12 + length;
     }
-    const float quality = compression;     // alias for clarity
-    const float inv     = 1.0f - quality;  // old "compression" scale
+    return false;
+}
 
-    // detect extension early
-    std::string outPath(output);
-    std::size_t dotPos = outPath.find_last_of('.');
-    if (dotPos == std::string::npos) {
-        std::cerr << "Error: Output filename must end with .png or .jpg/.jpeg\n";
-        return false;
+static std::shared_ptr<NativePixels> decodeNative(const uint8_t* bytes, size_t size) {
+    auto native = std::make_shared<NativePixels>();
+    native->state.decoder.color_convert = 0;  // keep the file's color type and depth
+    unsigned w = 0, h = 0;
+    if (const unsigned err = lodepng::decode(native->pixels, w, h, native->state, bytes, size)) {
+        std::cerr << "lodepng decode error " << err << ": " << lodepng_error_text(err) << "\n";
+        return nullptr;
     }
-    std::string ext = outPath.substr(dotPos + 1);
-    std::transform(ext.begin(), ext.end(), ext.begin(),
-                   [](unsigned char c){ return static_cast<char>(std::tolower(c)); });
-    const bool isJPEG = (ext == "jpg" || ext == "jpeg");
-    const bool isPNG  = (ext == "png");
+    return native;
+}
 
-    int w = 0, h = 0, src_ch = 0;
-    unsigned char* data = stbi_load(input, &w, &h, &src_ch, 3);
-    if (!data) {
-        std::cerr << "Failed to load image: " << input << "\n";
+// 'pixels' are in 'raw' (8-bit RGB, or the source's own mode, see NativePixels).
+static bool encode_png_lossless(std::vector<unsigned char>& outPNG, std::string& description,
+                                const uint8_t* pixels, const LodePNGColorMode& raw, unsigned w, unsigned h,
+                                bool interlace, int threads) {
+    LodePNGColorMode chosen;
+    lodepng_color_mode_init(&chosen);
+    LodePNGColorStats stats;
+    lodepng_color_stats_init(&stats);
+    unsigned err = lodepng_compute_color_stats(&stats, pixels, w, h, &raw);
+    if (!err) err = lodepng_auto_choose_color(&chosen, &raw, &stats);
+    if (err) {
+        lodepng_color_mode_cleanup(&chosen);
+        std::cerr << "lodepng color reduction error " << err << ": " << lodepng_error_text(err) << "\n";
         return false;
     }
-    std::cout << "Loaded " << w << "x" << h << " (source channels: "
-              << src_ch << ", working: 3)\n";
+    const std::string modeName = colorModeName(chosen);
+    const bool small = size_t(w) * h <= kLosslessBruteForcePixels;
 
-    bool ok = false;
-
-    if (isJPEG) {
-        std::cout << "Using standard JPEG encoder pipeline.\n";
-
-        // optional light chroma denoise at lower quality (quality <= 0.6)
-        if (quality <= 0.6f) {
-            std::vector<YCbCr> ycbcr(w * h);
-            for (int i = 0; i < w*h; ++i)
-                ycbcr[i] = YCbCr::fromRGB({data[i*3], data[i*3+1], data[i*3+2]});
-            chromaBlur(ycbcr, w, h, 0.4f);
-            for (int i = 0; i < w*h; ++i) {
-                RGB rgb = ycbcr[i].toRGB();
-                data[i*3] = rgb.r; data[i*3+1] = rgb.g; data[i*3+2] = rgb.b;
+    struct Trial {
+        size_t filter, deflate;
+        std::vector<unsigned char> png;
+        unsigned error = 0;
+    };
+    std::vector<Trial> trials;
+    // encodes trials[begin, end) on up to 'threads' threads
+    auto runTrials = [&](size_t begin, size_t end) {
+        std::atomic<size_t> next{begin};
+        auto worker = [&]() {
+            for (size_t i; (i = next.fetch_add(1)) < end;) {
+                Trial& trial = trials[i];
+                const LosslessDeflate& deflate = kLosslessDeflates[trial.deflate];
+                lodepng::State state;
+                state.info_png.interlace_method = interlace ? 1 : 0;  // Adam7
+                lodepng_color_mode_copy(&state.info_raw, &raw);
+                lodepng_color_mode_copy(&state.info_png.color, &chosen);
+                state.encoder.auto_convert = 0;  // chosen above, once for every trial
+                state.encoder.filter_palette_zero = 0;
+                state.encoder.filter_strategy = kLosslessFilters[trial.filter].filter;
+                state.encoder.zlibsettings.windowsize = deflate.windowsize;
+                state.encoder.zlibsettings.nicematch = deflate.nicematch;
+                state.encoder.zlibsettings.lazymatching = deflate.lazymatching;
+                trial.error = lodepng::encode(trial.png, pixels, w, h, state);
+                if (trial.error)
+                    std::cerr << "lodepng encode error " << trial.error << " (" << kLosslessFilters[trial.filter].name
+                              << ", " << deflate.name << "): " << lodepng_error_text(trial.error) << "\n";
             }
-        }
+        };
+        std::vector<std::thread> pool;
+        for (int t = 1; t < std::min<int>(threads, static_cast<int>(end - begin)); ++t) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+    };
+    auto smaller = [&](size_t a, size_t b) {
+        return !trials[a].error && (trials[b].error || trials[a].png.size() < trials[b].png.size());
+    };
 
-        // Map quality [0,1] -> JPEG quality [50..95]
-        int jpegQuality = 50 + static_cast<int>(quality * 45.0f);
-        jpegQuality = std::clamp(jpegQuality, 1, 100);
-        std::cout << "Writing JPEG quality: " << jpegQuality << "\n";
-        ok = (stbi_write_jpg(output, w, h, 3, data, jpegQuality) != 0);
+    // round one: every filter with the first deflate setting
+    const size_t filters = small ? std::size(kLosslessFilters) : std::size(kLosslessFilters) - 1;
+    for (size_t f = 0; f < filters; ++f) trials.push_back({f, 0, {}, 0});
+    runTrials(0, filters);
+    // round two: the finalists with the other settings
+    std::vector<size_t> ranked(filters);
+    for (size_t i = 0; i < filters; ++i) ranked[i] = i;
+    std::stable_sort(ranked.begin(), ranked.end(), smaller);
+    for (size_t k = 0; k < std::min(kLosslessFinalists, filters); ++k) {
+        if (trials[ranked[k]].error) continue;
+        for (size_t d = 1; d < std::size(kLosslessDeflates); ++d)
+            if (small || !kLosslessDeflates[d].smallOnly) trials.push_back({trials[ranked[k]].filter, d, {}, 0});
+    }
+    runTrials(filters, trials.size());
+    lodepng_color_mode_cleanup(&chosen);
 
-    } else if (isPNG) {
-        std::cout << "Using custom PNG compression pipeline.\n";
+    size_t best = 0;
+    for (size_t i = 1; i < trials.size(); ++i)
+        if (smaller(i, best)) best = i;
+    if (trials[best].error) return false;
+    outPNG.swap(trials[best].png);
+    description = "Wrote lossless PNG (" + modeName + ", " + kLosslessFilters[trials[best].filter].name +
+                  " filters, " + kLosslessDeflates[trials[best].deflate].name + ", best of " +
+                  std::to_string(trials.size()) + " trials" + (interlace ? ", Adam7 interlaced)" : ")");
+    return true;
+}
 
-        // 1) RGB -> YCbCr
-        std::vector<YCbCr> ycbcr(w * h);
-        for (int i = 0; i < w*h; ++i)
-            ycbcr[i] = YCbCr::fromRGB({data[i*3], data[i*3+1], data[i*3+2]});
-
-        // 2) params — flip tier logic using 'inv'
-        // Old: useTier1 when compression <= 0.3
-        // New: useTier1 when inv <= 0.3  => quality >= 0.7
-        const bool useTier1 = (quality >= 0.7f - 1e-6f);
-
-        int   lumaLevels, chromaLevels, subsampleFactor;
-        float blurSigma; bool useDithering;
-
-        if (useTier1) {
-            subsampleFactor = 2;
-            float t = inv / 0.3f; // 0..1 as quality drops
-            lumaLevels   = 256 - static_cast<int>(t * 64.0f);
-            chromaLevels = 256 - static_cast<int>(t * 192.0f);
-            blurSigma    = t * 0.7f;
-            useDithering = true;
-        } else {
-            float t = (inv - 0.3f) / 0.7f; // 0..1 as quality gets lower
-            t = std::clamp(t, 0.0f, 1.0f);
-            lumaLevels       = std::max(4,  192 - static_cast<int>(t * 188.0f));
-            chromaLevels     = std::max(2,   64 - static_cast<int>(t *  62.0f));
-            subsampleFactor  = 2 + static_cast<int>(t * 6.0f); // up to ~8
-            blurSigma        = 0.7f + t * 0.6f;
-            useDithering     = (t < 0.5f);
-        }
+// ---------- interlaced PNG-24 ----------
+// stb_image_write only writes non-interlaced PNGs. This writes the same
+// truecolor PNG with Adam7 interlacing: the seven passes are gathered
+// (adam7.h), each filtered with stb's own filter choice (every pass starts
+// without a row above), and the lot deflated by stb at the same level.
+static void appendChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t n) {
+    const uint8_t* tag = reinterpret_cast<const uint8_t*>(type);
+    const uint32_t length = static_cast<uint32_t>(n), crc = Checksum::crc32(Checksum::crc32(0, tag, 4), data, n);
+    const uint8_t len[4] = {uint8_t(length >> 24), uint8_t(length >> 16), uint8_t(length >> 8), uint8_t(length)};
+    const uint8_t sum[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc)};
+    out.insert(out.end(), len, len + 4);
+    out.insert(out.end(), tag, tag + 4);
+    if (n) out.insert(out.end(), data, data + n);
+    out.insert(out.end(), sum, sum + 4);
+}
 
-        std::cout << "Quality (0..1): " << quality
-                  << (useTier1 ? "  -> Tier 1 (perceptually lossless-ish)\n"
-                               : "  -> Tier 2+ (visible compression)\n");
-        std::cout << "Luma levels: " << lumaLevels << "\n"
-                  << "Chroma levels: " << chromaLevels << "\n"
-                  << "Chroma subsample: " << subsampleFactor << "x\n"
-                  << "Chroma blur sigma: " << blurSigma << "\n"
-                  << "Ordered dithering: " << (useDithering ? "on" : "off") << "\n";
-
-        // 3) blur + subsample
-        if (blurSigma > 0.0f) chromaBlur(ycbcr, w, h, blurSigma);
-        chromaSubsample(ycbcr, w, h, subsampleFactor);
-
-        // 4) quantize (+ dither Y if enabled)
-        if (useDithering) {
-            for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x) {
-                int idx = y*w + x;
-                float dY = orderedDither(ycbcr[idx].y, x, y, lumaLevels);
-                ycbcr[idx].y  = quantize(dY,            lumaLevels);
-                ycbcr[idx].cb = quantize(ycbcr[idx].cb, chromaLevels);
-                ycbcr[idx].cr = quantize(ycbcr[idx].cr, chromaLevels);
+// Deflates already-filtered 8-bit RGB scanlines (all seven passes' worth for
+// Adam7) into a PNG file.
+static bool writePNG24(std::vector<uint8_t>& outPNG, const std::vector<uint8_t>& filtered, int w, int h,
+                       bool interlace) {
+    int zlen = 0;
+    unsigned char* z = stbi_zlib_compress(const_cast<uint8_t*>(filtered.data()), static_cast<int>(filtered.size()),
+                                          &zlen, stbi_write_png_compression_level);
+    if (!z) return false;
+
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const uint8_t ihdr[13] = {uint8_t(w >> 24), uint8_t(w >> 16), uint8_t(w >> 8), uint8_t(w),
+                              uint8_t(h >> 24), uint8_t(h >> 16), uint8_t(h >> 8), uint8_t(h),
+                              8, 2, 0, 0, uint8_t(interlace ? 1 : 0)};  // 8-bit RGB, deflate, adaptive filters
+    outPNG.assign(signature, signature + 8);
+    appendChunk(outPNG, "IHDR", ihdr, sizeof ihdr);
+    appendChunk(outPNG, "IDAT", z, static_cast<size_t>(zlen));
+    appendChunk(outPNG, "IEND", nullptr, 0);
+    STBIW_FREE(z);
+    return true;
+}
+
+static bool encode_png24_adam7(std::vector<uint8_t>& outPNG, const uint8_t* rgb, int w, int h) {
+    size_t rawBytes = 0, largest = 0;
+    for (int pass = 0; pass < Adam7::kPasses; ++pass) {
+        const size_t pw = Adam7::passWidth(pass, w), ph = Adam7::passHeight(pass, h);
+        if (pw) rawBytes += ph * (pw * 3 + 1);  // empty passes have no rows at all
+        largest = std::max(largest, pw * ph * 3);
+    }
+    std::vector<uint8_t> pixels(largest), filtered(rawBytes), scratch(size_t(w) * 6);
+    size_t pos = 0;
+    for (int pass = 0; pass < Adam7::kPasses; ++pass) {
+        const size_t pw = Adam7::passWidth(pass, w), ph = Adam7::passHeight(pass, h), line = pw * 3;
+        if (pw == 0) continue;
+        Adam7::extract(rgb, w, h, 3, pass, pixels.data());
+        for (size_t y = 0; y < ph; ++y) {
+            const uint8_t* row = pixels.data() + y * line;
+            filtered[pos] = static_cast<uint8_t>(stbFilterRow(row, y ? row - line : nullptr, &filtered[pos + 1], line, 3,
+                                                              -1, scratch.data()));
+            pos += line + 1;
+        }
+    }
+    return writePNG24(outPNG, filtered, w, h, true);
+}
+
+// ---------- pixel-rewriting PNG-24 ----------
+// Writers whose row filter also rewrites the pixels (near_lossless.h,
+// lossy_lz.h) emit the filtered rows themselves, 'filter(pixels, w, h, out)'
+// for the whole image or, with Adam7, for each pass as its own image.
+template <typename Filter>
+static bool encode_png24_filtered(std::vector<uint8_t>& outPNG, const uint8_t* rgb, int w, int h, bool interlace,
+                                  Filter&& filter) {
+    auto filteredSize = [](size_t pw, size_t ph) { return pw ? ph * (pw * 3 + 1) : 0; };
+    if (!interlace) {
+        std::vector<uint8_t> filtered(filteredSize(w, h));
+        filter(rgb, size_t(w), size_t(h), filtered.data());
+        return writePNG24(outPNG, filtered, w, h, false);
+    }
+    size_t rawBytes = 0;
+    for (int pass = 0; pass < Adam7::kPasses; ++pass)
+        rawBytes += filteredSize(Adam7::passWidth(pass, w), Adam7::passHeight(pass, h));
+    std::vector<uint8_t> pixels(size_t(w) * h * 3), filtered(rawBytes);
+    size_t pos = 0;
+    for (int pass = 0; pass < Adam7::kPasses; ++pass) {
+        const size_t pw = Adam7::passWidth(pass, w), ph = Adam7::passHeight(pass, h);
+        Adam7::extract(rgb, w, h, 3, pass, pixels.data());
+        filter(pixels.data(), pw, ph, &filtered[pos]);
+        pos += filteredSize(pw, ph);
+    }
+    return writePNG24(outPNG, filtered, w, h, true);
+}
+
+// --near-lossless=K: the source pixels, each channel moved by at most K where
+// that makes the filter residuals repeat.
+static bool encode_png24_near_lossless(std::vector<uint8_t>& outPNG, const uint8_t* rgb, int w, int h,
+                                       int maxError, bool interlace) {
+    return encode_png24_filtered(outPNG, rgb, w, h, interlace,
+                                 [&](const uint8_t* pixels, size_t pw, size_t ph, uint8_t* out) {
+                                     NearLossless::filter(pixels, pw, ph, 3, maxError, out);
+                                 });
+}
+
+// Low tiers: stb's filters, with runs of filtered bytes replaced by copies of
+// earlier ones wherever the pixels stay within 'tolerance'.
+static bool encode_png24_lossy_lz(std::vector<uint8_t>& outPNG, const uint8_t* rgb, int w, int h, int tolerance,
+                                  bool interlace) {
+    return encode_png24_filtered(outPNG, rgb, w, h, interlace,
+                                 [&](const uint8_t* pixels, size_t pw, size_t ph, uint8_t* out) {
+                                     LossyLZ::filter(pixels, pw, ph, 3, tolerance, out);
+                                 });
+}
+
+static inline uint32_t packRGB(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint32_t(r) << 16) | (uint32_t(g) << 8) | uint32_t(b);
+}
+
+// ---------- CPU dispatch report ----------
+// Plain function multiversioning follows the same resolver rules as the
+// target_clones kernels, so this reports exactly the variant bound at load.
+#if IMGC_HAVE_MULTIVERSION
+__attribute__((target("default"))) static const char* kernelVariant() { return "default (x86-64 baseline)"; }
+__attribute__((target("sse4.2")))  static const char* kernelVariant() { return "sse4.2"; }
+__attribute__((target("avx2")))    static const char* kernelVariant() { return "avx2"; }
+__attribute__((target("avx512f"))) static const char* kernelVariant() { return "avx512f"; }
+#else
+static const char* kernelVariant() { return "portable (multiversioning not available)"; }
+#endif
+
+static void printCpuInfo() {
+#if IMGC_HAVE_MULTIVERSION
+    __builtin_cpu_init();
+    auto yn = [](int v) { return v ? "yes" : "no"; };
+    std::cout << "CPU features: sse4.2=" << yn(__builtin_cpu_supports("sse4.2"))
+              << " avx2=" << yn(__builtin_cpu_supports("avx2"))
+              << " avx512f=" << yn(__builtin_cpu_supports("avx512f")) << "\n";
+    std::cout << "Kernel clones: default, sse4.2, avx2, avx512f\n";
+#endif
+    std::cout << "Active kernel variant: " << kernelVariant() << "\n";
+    std::cout << "Checksums: crc32=" << Checksum::crcVariant() << " adler32=" << Checksum::adlerVariant() << "\n";
+    std::cout << "Multiversioned kernels: color conversion, chroma blur, chroma subsample, "
+                 "quantize, PNG filter/deflate (lodepng, stb), JPEG DCT (stb)\n";
+}
+
+// ---------- options ----------
+enum class LevelMode { Uniform, LloydMax };
+
+// How convert..toRGB runs when its intermediates are not kept: fused per
+// cache-sized tile, streamed as row bands, or as separate full-frame stages.
+enum class ExecMode { Tiles, Bands, Stages };
+
+// Adam7-interlaced PNG output. Auto interlaces images of kAutoInterlacePixels
+// and up, whose PNGs are large enough for progressive display over a slow
+// link to be worth the few percent of size interlacing costs.
+enum class InterlaceMode { Off, On, Auto };
+constexpr size_t kAutoInterlacePixels = size_t(2) << 20;
+
+struct CompressOptions {
+    DitherMode dither = DitherMode::Bayer;  // luma dither used where the tier enables dithering
+    int paletteColors = 0;                  // >0: PNG with more colors is quantized to this palette
+    int threads = 0;                        // 0 = one per hardware thread
+    LevelMode levels = LevelMode::Uniform;  // PNG quantization levels: uniform steps or Lloyd-Max fit
+    ExecMode exec = ExecMode::Tiles;
+    InterlaceMode interlace = InterlaceMode::Off;  // Adam7 PNG output
+    bool lossless = false;                  // PNG: exact pixels, optimized encode (the quality is ignored)
+    int nearLossless = 0;                   // >0: PNG within this many levels per channel (the quality is ignored)
+    bool lossyLZ = true;                    // PNG-24 on the low tiers: approximate deflate matches
+    bool jpegAQ = true;                     // JPEG: per-block dead zone and decimation by activity
+};
+
+static const char* ditherName(DitherMode mode) {
+    return mode == DitherMode::Bayer ? "ordered (4x4 Bayer)" : mode == DitherMode::Rows ? "ordered (row-constant)"
+         : mode == DitherMode::Columns ? "ordered (column-constant)" : diffusionKernel(mode).name;
+}
+
+// ---------- stage graph ----------
+// The pipeline as typed stages: decode, convert, blur, subsample, quantize,
+// toRGB, palette and encode. A stage's output is keyed by its input's key plus
+// its own parameters, so a key spells out the whole chain, e.g.
+//   decode:<content hash>:<size>|convert|blur=<sigma>|subsample=4|quantize=...
+// A StageCache shared across runs (slider sessions, quality sweeps, one image
+// written as both PNG and JPEG) then recomputes only the stages whose inputs or
+// parameters changed. With a zero budget nothing is kept and every stage takes
+// its input over in place, as the one-shot CLI always did.
+using StageKey = std::string;
+
+template <typename T>
+struct Artifact {
+    StageKey key;
+    std::shared_ptr<T> value;  // null: the stage failed
+};
+
+struct RGBImage {
+    int w = 0, h = 0, channels = 3;  // channels of the source file
+    std::vector<uint8_t> rgb;
+    std::vector<uint8_t> source;     // decode, when cached: the file, to verify key hits
+    bool inexact = false;            // 'rgb' drops part of the source (alpha, tRNS, 16-bit samples)
+    std::shared_ptr<const NativePixels> native;  // decode with 'exact': the source as it is, when inexact
+};
+
+struct PaletteImage {                // empty palette: the image stays truecolor
+    std::vector<uint8_t> paletteRGBA, indices;
+    std::string description;
+};
+
+struct EncodedImage {
+    std::vector<uint8_t> bytes;
+    std::string description;
+};
+
+static size_t artifactBytes(const RGBImage& v) {
+    return v.rgb.size() + v.source.size() + (v.native ? v.native->pixels.size() : 0);
+}
+static size_t artifactBytes(const PlanarYCbCr& v)  { return v.size() * 3 * sizeof(float); }
+static size_t artifactBytes(const PaletteImage& v) { return v.paletteRGBA.size() + v.indices.size(); }
+static size_t artifactBytes(const EncodedImage& v) { return v.bytes.size(); }
+
+// Stage outputs in an LRU bounded by bytes. Entries carry their type, so a key
+// is never read back as another stage's output. Pinned entries (session roots)
+// count against the budget but are never evicted.
+class StageCache {
+public:
+    explicit StageCache(size_t budget = 0) : budget_(budget) {}
+
+    bool retains() const { return budget_ > 0; }
+
+    template <typename T>
+    std::shared_ptr<T> find(const StageKey& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second.type != typeTag<T>()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return std::static_pointer_cast<T>(it->second.value);
+    }
+
+    template <typename T>
+    void insert(const StageKey& key, const std::shared_ptr<T>& value) {
+        const size_t bytes = artifactBytes(*value);
+        if (bytes > budget_) return;
+        erase(key);
+        lru_.push_front(key);
+        entries_[key] = {value, typeTag<T>(), bytes, lru_.begin()};
+        used_ += bytes;
+        evict();
+    }
+
+    bool pin(const StageKey& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) return false;
+        if (it->second.pins++ == 0) pinned_ += it->second.bytes;
+        return true;
+    }
+
+    // true while other pins remain
+    bool unpin(const StageKey& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second.pins == 0) return false;
+        if (--it->second.pins == 0) pinned_ -= it->second.bytes;
+        return it->second.pins > 0;
+    }
+
+    bool overPinned() const { return pinned_ > budget_; }
+
+    // drops root and every output derived from it
+    void eraseTree(const StageKey& root) {
+        auto it = entries_.lower_bound(root);
+        while (it != entries_.end() && it->first.compare(0, root.size(), root) == 0) {
+            if (it->first.size() > root.size() && it->first[root.size()] != '|') { ++it; continue; }
+            if (it->second.pins > 0) pinned_ -= it->second.bytes;
+            used_ -= it->second.bytes;
+            lru_.erase(it->second.lru);
+            it = entries_.erase(it);
+        }
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<void> value;
+        const void* type;
+        size_t bytes;
+        std::list<StageKey>::iterator lru;
+        int pins = 0;
+    };
+
+    template <typename T>
+    static const void* typeTag() { static const char tag = 0; return &tag; }
+
+    void erase(const StageKey& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) return;
+        if (it->second.pins > 0) pinned_ -= it->second.bytes;
+        used_ -= it->second.bytes;
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+
+    // least recently used first, skipping pinned entries
+    void evict() {
+        for (auto it = lru_.end(); used_ > budget_ && it != lru_.begin();) {
+            --it;
+            const auto e = entries_.find(*it);
+            if (e->second.pins > 0) continue;
+            used_ -= e->second.bytes;
+            entries_.erase(e);
+            it = lru_.erase(it);
+        }
+    }
+
+    size_t budget_, used_ = 0, pinned_ = 0;
+    std::map<StageKey, Entry> entries_;
+    std::list<StageKey> lru_;  // most recently used first
+};
+
+// 64-bit content hash for decode keys; hits are verified against the file, so
+// collisions cost a decode, never a wrong image.
+static uint64_t hashBytes(const uint8_t* p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    }
+    for (; n > 0; ++p, --n) h = (h ^ *p) * 0x94D049BB133111EBull;
+    return h ^ (h >> 29);
+}
+
+static std::string keyParam(float v) {  // exact: hex float
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%a", static_cast<double>(v));
+    return buf;
+}
+
+// Moves the value out when nothing else (cache, other artifacts) shares it.
+template <typename T>
+static T takeOver(Artifact<T>& in) {
+    if (in.value.use_count() == 1) return std::move(*in.value);
+    return *in.value;
+}
+
+struct QuantizeParams {
+    int lumaLevels, chromaLevels;
+    bool dither;          // dither Y (and even-round it) with 'mode'
+    DitherMode mode;
+    LevelMode levels;
+
+    // the ordered pattern, if the dither is one
+    OrderedPattern pattern() const { return dither && isOrdered(mode) ? orderedPattern(mode) : OrderedPattern::None; }
+
+    std::string key() const {
+        return std::to_string(lumaLevels) + "," + std::to_string(chromaLevels) + "," +
+               (dither ? std::to_string(static_cast<int>(mode)) : "-") + "," +
+               std::to_string(static_cast<int>(levels));
+    }
+};
+
+static void appendBytes(void* context, void* data, int size) {
+    auto* out = static_cast<std::vector<uint8_t>*>(context);
+    out->insert(out->end(), static_cast<uint8_t*>(data), static_cast<uint8_t*>(data) + size);
+}
+
+// Runs stages against a cache and records what each one cost.
+class Pipeline {
+public:
+    explicit Pipeline(StageCache& cache, int threads = 0) : cache_(cache), threads_(workerThreads(threads)) {}
+
+    // threads for the parallel stages still to run (see --batch)
+    void setThreads(int threads) { threads_ = workerThreads(threads); }
+
+    // 'exact' also keeps the source's own pixels where 8-bit RGB loses part
+    // of them (for --lossless)
+    Artifact<RGBImage> decode(const char* path, bool exact = false) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        return decode(bytes.data(), bytes.size(), path, exact);
+    }
+
+    // decodes an encoded file held in memory (e.g. the shared ring) in place
+    Artifact<RGBImage> decode(const uint8_t* bytes, size_t size, const char* name, bool exact = false) {
+        char hash[24];
+        std::snprintf(hash, sizeof hash, "%016llx", static_cast<unsigned long long>(hashBytes(bytes, size)));
+        const StageKey key = std::string("decode:") + hash + ":" + std::to_string(size) + (exact ? ":exact" : "");
+        auto sameSource = [&](const RGBImage& img) {
+            return img.source.size() == size && std::equal(img.source.begin(), img.source.end(), bytes);
+        };
+        if (auto hit = cache_.find<RGBImage>(key); hit && sameSource(*hit)) {
+            timings_.emplace_back("decode", -1.0);
+            return {key, hit};
+        }
+        return run<RGBImage>("decode", key, [&]() -> std::shared_ptr<RGBImage> {
+            auto img = std::make_shared<RGBImage>();
+            img->inexact = pngNeedsNative(bytes, size);
+            if (exact && img->inexact && !(img->native = decodeNative(bytes, size))) return nullptr;
+            PngDecoder png;  // streaming fast path for 8-bit PNGs; stb_image for the rest
+            if (png.decode(bytes, size, img->rgb)) {
+                img->w = png.width();
+                img->h = png.height();
+                img->channels = png.channels();
+                if (cache_.retains()) img->source.assign(bytes, bytes + size);
+                return img;
             }
-        } else {
-            for (auto& p : ycbcr) {
-                p.y  = quantize(p.y,  lumaLevels);
-                p.cb = quantize(p.cb, chromaLevels);
-                p.cr = quantize(p.cr, chromaLevels);
+            unsigned char* data = (size == 0 || size > size_t(std::numeric_limits<int>::max())) ? nullptr
+                : stbi_load_from_memory(bytes, static_cast<int>(size), &img->w, &img->h, &img->channels, 3);
+            if (!data) {
+                std::cerr << "Failed to load image: " << name << "\n";
+                return nullptr;
             }
-        }
+            img->rgb.assign(data, data + size_t(img->w) * img->h * 3);
+            stbi_image_free(data);
+            if (cache_.retains()) img->source.assign(bytes, bytes + size);
+            return img;
+        }, /*lookup=*/false);
+    }
 
-        // 5) (optional) even-round Y only if dithering is on
-        if (useDithering) {
-            for (auto& p : ycbcr) {
-                p.y = std::round(p.y / 2.0f) * 2.0f;
-                p.y = std::clamp(p.y, 0.0f, 255.0f);
+    // box-filtered copy whose longer side is at most maxDim
+    Artifact<RGBImage> downscale(const Artifact<RGBImage>& in, int maxDim) {
+        const RGBImage& src = *in.value;
+        if (std::max(src.w, src.h) <= maxDim) return in;
+        return run<RGBImage>("downscale", in.key + "|downscale=" + std::to_string(maxDim), [&] {
+            auto small = std::make_shared<RGBImage>();
+            const double scale = double(maxDim) / std::max(src.w, src.h);
+            small->w = std::max(1, static_cast<int>(std::lround(src.w * scale)));
+            small->h = std::max(1, static_cast<int>(std::lround(src.h * scale)));
+            small->channels = src.channels;
+            small->rgb.resize(size_t(small->w) * small->h * 3);
+            for (int y = 0; y < small->h; ++y) {
+                const int y0 = int(int64_t(y) * src.h / small->h);
+                const int y1 = std::max(y0 + 1, int(int64_t(y + 1) * src.h / small->h));
+                for (int x = 0; x < small->w; ++x) {
+                    const int x0 = int(int64_t(x) * src.w / small->w);
+                    const int x1 = std::max(x0 + 1, int(int64_t(x + 1) * src.w / small->w));
+                    uint32_t sum[3] = {0, 0, 0};
+                    for (int sy = y0; sy < y1; ++sy)
+                        for (int sx = x0; sx < x1; ++sx)
+                            for (int c = 0; c < 3; ++c) sum[c] += src.rgb[(size_t(sy) * src.w + sx) * 3 + c];
+                    const uint32_t n = uint32_t(y1 - y0) * (x1 - x0);
+                    for (int c = 0; c < 3; ++c)
+                        small->rgb[(size_t(y) * small->w + x) * 3 + c] = static_cast<uint8_t>((sum[c] + n / 2) / n);
+                }
             }
-        }
+            return small;
+        });
+    }
+
+    Artifact<PlanarYCbCr> convert(const Artifact<RGBImage>& in) {
+        return run<PlanarYCbCr>("convert", in.key + "|convert", [&] {
+            auto p = std::make_shared<PlanarYCbCr>(in.value->w, in.value->h);
+            rgbToPlanar(in.value->rgb.data(), *p);
+            return p;
+        });
+    }
+
+    Artifact<PlanarYCbCr> blur(Artifact<PlanarYCbCr> in, float sigma) {
+        if (sigma < 0.1f) return in;  // chromaBlur is a no-op there
+        return run<PlanarYCbCr>("blur", in.key + "|blur=" + keyParam(sigma), [&] {
+            auto p = std::make_shared<PlanarYCbCr>(takeOver(in));
+            chromaBlur(*p, sigma);
+            return p;
+        });
+    }
+
+    Artifact<PlanarYCbCr> subsample(Artifact<PlanarYCbCr> in, int factor) {
+        return run<PlanarYCbCr>("subsample", in.key + "|subsample=" + std::to_string(factor), [&] {
+            auto p = std::make_shared<PlanarYCbCr>(takeOver(in));
+            chromaSubsample(*p, factor);
+            return p;
+        });
+    }
+
+    // level quantization (+ dither Y and even-round it if enabled)
+    Artifact<PlanarYCbCr> quantize(Artifact<PlanarYCbCr> in, const QuantizeParams& q) {
+        return run<PlanarYCbCr>("quantize", in.key + "|quantize=" + q.key(), [&] {
+            auto p = std::make_shared<PlanarYCbCr>(takeOver(in));
+            PlanarYCbCr& planes = *p;
+            if (q.levels == LevelMode::LloydMax) {
+                const PlaneLevels lv = lloydMaxPlanes(planes, q.lumaLevels, q.chromaLevels);
+                std::cout << "Lloyd-Max levels used (Y/Cb/Cr): " << lv.y.used << "/" << lv.cb.used
+                          << "/" << lv.cr.used << "\n";
+                if (q.dither && !isOrdered(q.mode)) {
+                    quantizeChromaPlanes(planes, lv);
+                    diffuseLuma(planes, q.lumaLevels, q.mode, threads_, &lv.y);
+                } else {
+                    quantizePlanes(planes, lv, q.lumaLevels, q.pattern());
+                }
+            } else if (q.dither && !isOrdered(q.mode)) {
+                quantizeChromaPlanes(planes, q.chromaLevels);
+                diffuseLuma(planes, q.lumaLevels, q.mode, threads_);
+            } else {
+                quantizePlanes(planes, q.lumaLevels, q.chromaLevels, q.pattern());
+            }
+            return p;
+        });
+    }
 
-        // 6) back to RGB with perceptual rounding
-        // Old threshold: compression < 0.6  -> now quality > 0.4
-        const int rgbMultiple = (quality > 0.4f) ? 2 : 4;
-        for (int i = 0; i < w*h; ++i) {
-            RGB rgb = ycbcr[i].toRGBRounded(rgbMultiple);
-            data[i*3] = rgb.r; data[i*3+1] = rgb.g; data[i*3+2] = rgb.b;
+    // convert -> blur -> (subsample -> quantize, if q) -> toRGB. When none of
+    // the intermediates would be kept and every step is local (uniform levels,
+    // ordered or no dither) the chain runs as one stage, fused per tile (see
+    // runTiles) or streaming row bands (see runBands); otherwise, or with
+    // ExecMode::Stages, as the separate, memoized stages. All produce the same
+    // bytes under the same key.
+    Artifact<RGBImage> planarChain(const Artifact<RGBImage>& in, float sigma, int factor,
+                                   const QuantizeParams* q, int multiple, int channels, ExecMode mode) {
+        const bool bandLocal = !q || (q->levels == LevelMode::Uniform && (!q->dither || isOrdered(q->mode)));
+        if (cache_.retains() || !bandLocal || mode == ExecMode::Stages) {
+            Artifact<PlanarYCbCr> planes = blur(convert(in), sigma);
+            if (q) planes = quantize(subsample(std::move(planes), factor), *q);
+            return toRGB(std::move(planes), multiple, channels);
         }
 
-        // 7) try PNG-8 (≤256 colors), else PNG-24
-        std::set<uint32_t> uniq;
-        for (int i = 0; i < w*h; ++i) {
-            uniq.insert(packRGB(data[i*3], data[i*3+1], data[i*3+2]));
-            if (uniq.size() > 256) break;
+        const bool blurs = sigma >= 0.1f;
+        StageKey key = in.key + "|convert";
+        if (blurs) key += "|blur=" + keyParam(sigma);
+        if (q) key += "|subsample=" + std::to_string(factor) + "|quantize=" + q->key();
+        key += "|rgb=" + std::to_string(multiple);
+
+        if (mode == ExecMode::Tiles) {
+            return run<RGBImage>("tiles", key, [&] {
+                const RGBImage& src = *in.value;
+                auto img = std::make_shared<RGBImage>();
+                img->w = src.w; img->h = src.h; img->channels = channels;
+                img->rgb.resize(src.rgb.size());
+                TilePlan plan;
+                plan.blurSigma = sigma;
+                plan.rgbMultiple = multiple;
+                if (q) {
+                    plan.subsample = factor;
+                    plan.quantize = true;
+                    plan.lumaLevels = q->lumaLevels;
+                    plan.chromaLevels = q->chromaLevels;
+                    plan.dither = q->pattern();
+                }
+                runTiles(src.rgb.data(), src.w, src.h, img->rgb.data(), plan, threads_);
+                return img;
+            });
         }
 
-        if (!uniq.empty() && uniq.size() <= 256) {
-            std::vector<uint8_t> palette; palette.reserve(uniq.size()*4);
-            std::unordered_map<uint32_t,uint8_t> toIdx; toIdx.reserve(uniq.size()*2);
-            uint8_t idx = 0;
-            for (uint32_t c : uniq) {
-                palette.push_back((c>>16)&0xFF);
-                palette.push_back((c>>8 )&0xFF);
-                palette.push_back((c    )&0xFF);
-                palette.push_back(255);
-                toIdx[c] = idx++;
-            }
-            std::vector<uint8_t> indices(w*h);
-            for (int i = 0; i < w*h; ++i) {
-                uint32_t c = packRGB(data[i*3], data[i*3+1], data[i*3+2]);
-                indices[i] = toIdx[c];
-            }
-            std::cout << "Writing PNG-8 (indexed) via lodepng (" << uniq.size() << " colors)\n";
-            ok = write_png8_indexed(output, indices, palette, (unsigned)w, (unsigned)h);
-            if (!ok) {
+        std::string breakdown;
+        Artifact<RGBImage> out = run<RGBImage>("bands", key, [&] {
+            const RGBImage& src = *in.value;
+            const int w = src.w, h = src.h;
+            auto img = std::make_shared<RGBImage>();
+            img->w = w; img->h = h; img->channels = channels;
+            img->rgb.resize(size_t(w) * h * 3);
+            PlanarYCbCr p(w, h);
+
+            const std::vector<float> kernel = blurs ? gaussianKernel(sigma) : std::vector<float>();
+            const int radius = static_cast<int>(kernel.size() / 2);
+            std::vector<float> tmpCb(blurs ? p.size() : 0), tmpCr(tmpCb.size()), line;
+            int blurredH = 0;  // rows through the horizontal pass
+
+            std::vector<BandStage> stages;
+            stages.push_back({"convert", 0, [&](int y0, int y1) {
+                rgbToPlanar(src.rgb.data(), p, size_t(y0) * w, size_t(y1) * w);
+            }});
+            if (blurs) {
+                stages.push_back({"blur", radius, [&](int y0, int y1) {
+                    const int rows = std::min(h, y1 + radius);
+                    blurRowsH(p.cb, tmpCb, w, blurredH, rows, kernel, line);
+                    blurRowsH(p.cr, tmpCr, w, blurredH, rows, kernel, line);
+                    blurredH = rows;
+                    blurRowsV(p.cb, tmpCb, w, h, y0, y1, kernel);
+                    blurRowsV(p.cr, tmpCr, w, h, y0, y1, kernel);
+                }});
+            }
+            if (q && factor > 1) {
+                stages.push_back({"subsample", 0, [&](int y0, int y1) {
+                    subsamplePlane(p.cb, w, factor, y0, y1);
+                    subsamplePlane(p.cr, w, factor, y0, y1);
+                }});
+            }
+            if (q) {
+                stages.push_back({"quantize", 0, [&](int y0, int y1) {
+                    quantizePlanes(p, q->lumaLevels, q->chromaLevels, q->pattern(), y0, y1);
+                }});
+            }
+            stages.push_back({"toRGB", 0, [&](int y0, int y1) {
+                planarToRGB(p, img->rgb.data(), multiple, size_t(y0) * w, size_t(y1) * w);
+            }});
+
+            // bands start on subsample block boundaries
+            const int block = (q && factor > 1) ? factor : 1;
+            const int band = (32 + block - 1) / block * block;
+            const std::vector<double> busy = runBands(stages, h, band, threads_ > 1);
+            std::ostringstream parts;
+            for (size_t i = 0; i < stages.size(); ++i)
+                parts << (i ? " " : "") << stages[i].name << " " << busy[i];
+            breakdown = parts.str();
+            return img;
+        });
+        if (!breakdown.empty()) timings_.back().first = "bands [" + breakdown + "]";
+        return out;
+    }
+
+    // back to RGB, rounding to multiples of 'multiple'
+    Artifact<RGBImage> toRGB(Artifact<PlanarYCbCr> in, int multiple, int channels) {
+        return run<RGBImage>("toRGB", in.key + "|rgb=" + std::to_string(multiple), [&] {
+            auto img = std::make_shared<RGBImage>();
+            img->w = in.value->w; img->h = in.value->h; img->channels = channels;
+            img->rgb.resize(size_t(img->w) * img->h * 3);
+            planarToRGB(*in.value, img->rgb.data(), multiple);
+            return img;
+        });
+    }
+
+    // exact palette when the image has ≤256 colors, else a median-cut palette
+    // with error diffusion if paletteColors > 0, else none (truecolor)
+    Artifact<PaletteImage> palette(const Artifact<RGBImage>& in, int paletteColors, DitherMode dither) {
+        const StageKey key = in.key + "|palette=" + std::to_string(paletteColors) + "," +
+                             std::to_string(static_cast<int>(dither));
+        return run<PaletteImage>("palette", key, [&] {
+            const RGBImage& src = *in.value;
+            const uint8_t* data = src.rgb.data();
+            const size_t n = size_t(src.w) * src.h;
+            auto out = std::make_shared<PaletteImage>();
+
+            std::set<uint32_t> uniq;
+            for (size_t i = 0; i < n; ++i) {
+                uniq.insert(packRGB(data[i*3], data[i*3+1], data[i*3+2]));
+                if (uniq.size() > 256) break;
+            }
+
+            if (!uniq.empty() && uniq.size() <= 256) {
+                std::vector<uint8_t>& palette = out->paletteRGBA;
+                palette.reserve(uniq.size()*4);
+                for (uint32_t c : uniq) {
+                    palette.push_back((c>>16)&0xFF);
+                    palette.push_back((c>>8 )&0xFF);
+                    palette.push_back((c    )&0xFF);
+                    palette.push_back(255);
+                }
+                // every pixel is a palette color, so nearest == exact match
+                out->indices.resize(n);
+                PaletteLookup(palette).mapIndices(data, n, out->indices.data(), threads_);
+                out->description = "PNG-8 (indexed) via lodepng (" + std::to_string(uniq.size()) + " colors)";
+            } else if (paletteColors > 0) {
+                // quantize to a median-cut palette, error-diffusing the mapping
+                const DitherMode mode = isOrdered(dither) ? DitherMode::FloydSteinberg : dither;
+                out->paletteRGBA = medianCutPalette(data, n, paletteColors);
+                diffuseToPalette(data, src.w, src.h, out->paletteRGBA, out->indices, mode, threads_);
+                out->description = "PNG-8 (indexed) via lodepng (" + std::to_string(out->paletteRGBA.size() / 4) +
+                                   "-color palette, " + diffusionKernel(mode).name + " diffusion)";
+            }
+            return out;
+        });
+    }
+
+    Artifact<EncodedImage> encodePNG(const Artifact<RGBImage>& rgb, const Artifact<PaletteImage>& pal,
+                                     bool interlace = false, int lzTolerance = 0) {
+        const StageKey key = pal.key + (interlace ? "|png=adam7" : "|png") +
+                             (lzTolerance ? ",lz=" + std::to_string(lzTolerance) : "");
+        return run<EncodedImage>("encode", key, [&]() -> std::shared_ptr<EncodedImage> {
+            const RGBImage& src = *rgb.value;
+            auto out = std::make_shared<EncodedImage>();
+            if (!pal.value->paletteRGBA.empty()) {
+                std::cout << "Writing " << pal.value->description << (interlace ? ", Adam7 interlaced" : "") << "\n";
+                if (encode_png8_indexed(out->bytes, pal.value->indices, pal.value->paletteRGBA,
+                                        (unsigned)src.w, (unsigned)src.h, interlace)) {
+                    return out;
+                }
                 std::cerr << "PNG-8 encode failed. Falling back to PNG-24.\n";
-                stbi_write_png_compression_level = 9;
-                ok = (stbi_write_png(output, w, h, 3, data, w*3) != 0);
+                out->bytes.clear();
             }
-        } else {
-            stbi_write_png_compression_level = 9;
-            ok = (stbi_write_png(output, w, h, 3, data, w*3) != 0);
-            if (ok) std::cout << "Wrote PNG-24 (truecolor)\n";
+            if (lzTolerance) {
+                if (!encode_png24_lossy_lz(out->bytes, src.rgb.data(), src.w, src.h, lzTolerance, interlace))
+                    return nullptr;
+            } else if (interlace) {
+                if (!encode_png24_adam7(out->bytes, src.rgb.data(), src.w, src.h)) return nullptr;
+            } else if (!stbi_write_png_to_func(appendBytes, &out->bytes, src.w, src.h, 3, src.rgb.data(), src.w*3)) {
+                return nullptr;
+            }
+            if (pal.value->paletteRGBA.empty()) {
+                out->description = "Wrote PNG-24 (truecolor";
+                if (lzTolerance) out->description += ", lossy LZ77 within " + std::to_string(lzTolerance);
+                out->description += interlace ? ", Adam7 interlaced)" : ")";
+            }
+            return out;
+        });
+    }
+
+    Artifact<EncodedImage> encodeLossless(const Artifact<RGBImage>& rgb, bool interlace = false) {
+        return run<EncodedImage>("encode", rgb.key + (interlace ? "|png=lossless,adam7" : "|png=lossless"),
+                                 [&]() -> std::shared_ptr<EncodedImage> {
+            const RGBImage& src = *rgb.value;
+            auto out = std::make_shared<EncodedImage>();
+            const LodePNGColorMode rgb8 = lodepng_color_mode_make(LCT_RGB, 8);
+            const bool ok = src.native
+                ? encode_png_lossless(out->bytes, out->description, src.native->pixels.data(),
+                                      src.native->state.info_png.color, (unsigned)src.w, (unsigned)src.h, interlace,
+                                      threads_)
+                : encode_png_lossless(out->bytes, out->description, src.rgb.data(), rgb8, (unsigned)src.w,
+                                      (unsigned)src.h, interlace, threads_);
+            if (!ok) return nullptr;
+            return out;
+        });
+    }
+
+    Artifact<EncodedImage> encodeNearLossless(const Artifact<RGBImage>& rgb, int maxError, bool interlace = false) {
+        return run<EncodedImage>("encode", rgb.key + "|png=near" + std::to_string(maxError) + (interlace ? ",adam7" : ""),
+                                 [&]() -> std::shared_ptr<EncodedImage> {
+            const RGBImage& src = *rgb.value;
+            auto out = std::make_shared<EncodedImage>();
+            if (!encode_png24_near_lossless(out->bytes, src.rgb.data(), src.w, src.h, maxError, interlace))
+                return nullptr;
+            out->description = "Wrote near-lossless PNG-24 (max error " + std::to_string(maxError) +
+                               (interlace ? ", Adam7 interlaced)" : ")");
+            return out;
+        });
+    }
+
+    Artifact<EncodedImage> encodeJPEG(const Artifact<RGBImage>& rgb, int quality, bool adaptive) {
+        const StageKey key = rgb.key + "|jpeg=" + std::to_string(quality) + (adaptive ? ",aq" : "");
+        return run<EncodedImage>("encode", key, [&]() -> std::shared_ptr<EncodedImage> {
+            const RGBImage& src = *rgb.value;
+            auto out = std::make_shared<EncodedImage>();
+            const JpegAQ::Scope aq(adaptive);
+            if (!stbi_write_jpg_to_func(appendBytes, &out->bytes, src.w, src.h, 3, src.rgb.data(), quality))
+                return nullptr;
+            return out;
+        });
+    }
+
+    // e.g. "decode cached, convert 12.3 ms, blur 40.1 ms"
+    std::string report() const {
+        std::ostringstream out;
+        for (size_t i = 0; i < timings_.size(); ++i) {
+            out << (i ? ", " : "") << timings_[i].first;
+            if (timings_[i].second < 0) out << " cached";
+            else out << " " << timings_[i].second << " ms";
+        }
+        return out.str();
+    }
+
+private:
+    template <typename T, typename F>
+    Artifact<T> run(const char* stage, StageKey key, F&& compute, bool lookup = true) {
+        if (lookup) {
+            if (auto hit = cache_.find<T>(key)) {
+                timings_.emplace_back(stage, -1.0);
+                return {std::move(key), hit};
+            }
+        }
+        const auto t0 = std::chrono::steady_clock::now();
+        std::shared_ptr<T> value = compute();
+        timings_.emplace_back(stage, std::chrono::duration<double, std::milli>(
+                                         std::chrono::steady_clock::now() - t0).count());
+        if (value) cache_.insert(key, value);
+        return {std::move(key), std::move(value)};
+    }
+
+    StageCache& cache_;
+    int threads_;
+    std::vector<std::pair<std::string, double>> timings_;  // ms; < 0 for a cache hit
+};
+
+static bool writeFile(const char* path, const std::vector<uint8_t>& bytes) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(out);
+}
+
+// ---------- main compression ----------
+enum class OutputFormat { Unsupported, PNG, JPEG };
+
+static bool checkRequest(const char* output, float quality, OutputFormat& format) {
+    if (!(quality >= 0.0f && quality <= 1.0f) || !std::isfinite(quality)) {
+        std::cerr << "Compression (quality) must be a finite float in [0.0, 1.0]\n";
+        return false;
+    }
+    std::string outPath(output);
+    std::size_t dotPos = outPath.find_last_of('.');
+    if (dotPos == std::string::npos) {
+        std::cerr << "Error: Output filename must end with .png or .jpg/.jpeg\n";
+        return false;
+    }
+    std::string ext = outPath.substr(dotPos + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c){ return static_cast<char>(std::tolower(c)); });
+    format = (ext == "jpg" || ext == "jpeg") ? OutputFormat::JPEG
+           : (ext == "png") ? OutputFormat::PNG : OutputFormat::Unsupported;
+    return true;
+}
+
+// PNG tier parameters for a quality
+struct PngTier {
+    bool tier1;
+    int lumaLevels, chromaLevels, subsampleFactor;
+    float blurSigma;
+    bool useDithering;
+    int rgbMultiple;
+    int lzTolerance;  // PNG-24 deflate may copy runs within this error (0 = exact only)
+};
+
+static PngTier pngTier(float quality) {
+    const float inv = 1.0f - quality;  // old "compression" scale
+    PngTier t;
+
+    // flip tier logic using 'inv'
+    // Old: useTier1 when compression <= 0.3
+    // New: useTier1 when inv <= 0.3  => quality >= 0.7
+    t.tier1 = (quality >= 0.7f - 1e-6f);
+
+    if (t.tier1) {
+        t.subsampleFactor = 2;
+        float s = inv / 0.3f; // 0..1 as quality drops
+        t.lumaLevels   = 256 - static_cast<int>(s * 64.0f);
+        t.chromaLevels = 256 - static_cast<int>(s * 192.0f);
+        t.blurSigma    = s * 0.7f;
+        t.useDithering = true;
+        t.lzTolerance  = 0;
+    } else {
+        float s = (inv - 0.3f) / 0.7f; // 0..1 as quality gets lower
+        s = std::clamp(s, 0.0f, 1.0f);
+        t.lumaLevels       = std::max(4,  192 - static_cast<int>(s * 188.0f));
+        t.chromaLevels     = std::max(2,   64 - static_cast<int>(s *  62.0f));
+        t.subsampleFactor  = 2 + static_cast<int>(s * 6.0f); // up to ~8
+        t.blurSigma        = 0.7f + s * 0.6f;
+        t.useDithering     = (s < 0.5f);
+        // not over a dither pattern: its exact repeats are what deflate
+        // already codes well in flat areas, and rewriting breaks them up
+        t.lzTolerance      = t.useDithering ? 0 : static_cast<int>(s * 12.0f);
+    }
+
+    // perceptual rounding back in RGB
+    // Old threshold: compression < 0.6  -> now quality > 0.4
+    t.rgbMultiple = (quality > 0.4f) ? 2 : 4;
+    return t;
+}
+
+// Map quality [0,1] -> JPEG quality [50..95]
+static int jpegQualityFor(float quality) {
+    return std::clamp(50 + static_cast<int>(quality * 45.0f), 1, 100);
+}
+
+// Where encoded bytes go instead of the output file (see the shared ring).
+using OutputSink = std::function<bool(const std::shared_ptr<EncodedImage>&)>;
+
+// Everything up to the final encode; split from encodeImage so --batch can
+// run the serial encoders on other threads.
+struct PreparedImage {
+    OutputFormat format = OutputFormat::Unsupported;
+    Artifact<RGBImage> rgb;
+    Artifact<PaletteImage> palette;
+    int jpegQuality = 0;
+    bool jpegAQ = false;     // JPEG: block-adaptive quantization
+    bool interlace = false;  // PNG: Adam7
+    bool lossless = false;   // PNG: 'rgb' is the source, written by the optimizer
+    int nearLossless = 0;    // PNG: 'rgb' is the source, written within this error
+    int lzTolerance = 0;     // PNG-24: lossy LZ77
+};
+
+// NOTE: 'compression' here means QUALITY in [0,1], where 1.0 = highest quality.
+static bool prepareImage(Pipeline& pipe, const Artifact<RGBImage>& src, const char* output, float compression,
+                         const CompressOptions& opts, PreparedImage& prepared) {
+    OutputFormat format;
+    if (!checkRequest(output, compression, format)) return false;
+    const float quality = compression;     // alias for clarity
+    prepared.format = format;
+
+    std::cout << "Loaded " << src.value->w << "x" << src.value->h << " (source channels: "
+              << src.value->channels << ", working: 3)\n";
+
+    if ((opts.lossless || opts.nearLossless) && format != OutputFormat::PNG) {
+        std::cerr << (opts.lossless ? "--lossless" : "--near-lossless") << " needs .png output\n";
+        return false;
+    }
+    if (opts.lossless && opts.nearLossless) {
+        std::cerr << "--lossless and --near-lossless are exclusive\n";
+        return false;
+    }
+
+    if (format == OutputFormat::JPEG) {
+        std::cout << "Using standard JPEG encoder pipeline.\n";
+
+        // optional light chroma denoise at lower quality (quality <= 0.6)
+        Artifact<RGBImage> rgb = src;
+        if (quality <= 0.6f) rgb = pipe.planarChain(src, 0.4f, 0, nullptr, 1, src.value->channels, opts.exec);
+
+        const int jpegQuality = jpegQualityFor(quality);
+        std::cout << "Writing JPEG quality: " << jpegQuality << (opts.jpegAQ ? " (block-adaptive)" : "") << "\n";
+        prepared.rgb = rgb;
+        prepared.jpegQuality = jpegQuality;
+        prepared.jpegAQ = opts.jpegAQ;
+
+    } else if (format == OutputFormat::PNG && opts.lossless) {
+        if (src.value->inexact && !src.value->native) {
+            std::cerr << "--lossless: the source has alpha, tRNS or 16-bit samples, and this image was decoded "
+                         "without them (session images are)\n";
+            return false;
         }
+        std::cout << "Using lossless PNG optimizer (quality ignored).\n";
+        prepared.rgb = src;
+        prepared.lossless = true;
+
+    } else if (format == OutputFormat::PNG && opts.nearLossless) {
+        std::cout << "Using near-lossless PNG (max error " << opts.nearLossless << ", quality ignored).\n";
+        prepared.rgb = src;
+        prepared.nearLossless = opts.nearLossless;
+        prepared.palette = pipe.palette(src, 0, opts.dither);  // <= 256 colors: exact PNG-8 is smaller still
+
+    } else if (format == OutputFormat::PNG) {
+        std::cout << "Using custom PNG compression pipeline.\n";
+
+        const PngTier t = pngTier(quality);
+        std::cout << "Quality (0..1): " << quality
+                  << (t.tier1 ? "  -> Tier 1 (perceptually lossless-ish)\n"
+                              : "  -> Tier 2+ (visible compression)\n");
+        std::cout << "Luma levels: " << t.lumaLevels << "\n"
+                  << "Chroma levels: " << t.chromaLevels << "\n"
+                  << "Chroma subsample: " << t.subsampleFactor << "x\n"
+                  << "Chroma blur sigma: " << t.blurSigma << "\n"
+                  << "Dithering: " << (t.useDithering ? ditherName(opts.dither) : "off") << "\n"
+                  << "Levels: " << (opts.levels == LevelMode::LloydMax ? "lloyd-max" : "uniform") << "\n";
+
+        // RGB -> planar YCbCr -> blur -> subsample -> quantize -> RGB -> palette -> encode
+        const QuantizeParams q{t.lumaLevels, t.chromaLevels, t.useDithering, opts.dither, opts.levels};
+        prepared.rgb = pipe.planarChain(src, t.blurSigma, t.subsampleFactor, &q, t.rgbMultiple, src.value->channels,
+                                       opts.exec);
+        prepared.palette = pipe.palette(prepared.rgb, opts.paletteColors, opts.dither);
+        prepared.lzTolerance = opts.lossyLZ ? t.lzTolerance : 0;
 
     } else {
         std::cerr << "Unsupported output format. Use .png or .jpg/.jpeg\n";
     }
+    prepared.interlace = format == OutputFormat::PNG &&
+                         (opts.interlace == InterlaceMode::On ||
+                          (opts.interlace == InterlaceMode::Auto &&
+                           size_t(src.value->w) * src.value->h >= kAutoInterlacePixels));
+    return true;
+}
 
-    stbi_image_free(data);
+static bool finishImage(Pipeline& pipe, const PreparedImage& prepared, const char* output,
+                        const OutputSink& sink = nullptr) {
+    Artifact<EncodedImage> encoded;
+    if (prepared.format == OutputFormat::JPEG) {
+        encoded = pipe.encodeJPEG(prepared.rgb, prepared.jpegQuality, prepared.jpegAQ);
+    } else if (prepared.format == OutputFormat::PNG) {
+        if (prepared.lossless)
+            encoded = pipe.encodeLossless(prepared.rgb, prepared.interlace);
+        else if (prepared.nearLossless && prepared.palette.value->paletteRGBA.empty())
+            encoded = pipe.encodeNearLossless(prepared.rgb, prepared.nearLossless, prepared.interlace);
+        else
+            encoded = pipe.encodePNG(prepared.rgb, prepared.palette, prepared.interlace, prepared.lzTolerance);
+        if (encoded.value && !encoded.value->description.empty())
+            std::cout << encoded.value->description << "\n";
+    }
+
+    const bool ok = encoded.value && (sink ? sink(encoded.value) : writeFile(output, encoded.value->bytes));
+    if (prepared.format != OutputFormat::Unsupported) std::cout << "Stages: " << pipe.report() << "\n";
     if (!ok) std::cerr << "Failed to write image: " << output << "\n";
     else std::cout << "Compressed image saved to: " << output << "\n";
     return ok;
 }
 
+bool encodeImage(Pipeline& pipe, const Artifact<RGBImage>& src, const char* output, float compression,
+                 const CompressOptions& opts = {}, const OutputSink& sink = nullptr) {
+    PreparedImage prepared;
+    return prepareImage(pipe, src, output, compression, opts, prepared) &&
+           finishImage(pipe, prepared, output, sink);
+}
+
+bool compressImage(const char* input, const char* output, float compression,
+                   const CompressOptions& opts = {}) {
+    OutputFormat format;
+    if (!checkRequest(output, compression, format)) return false;
+    StageCache cache;  // one-shot: nothing to reuse
+    Pipeline pipe(cache, opts.threads);
+    const Artifact<RGBImage> src = pipe.decode(input, opts.lossless);
+    if (!src.value) return false;
+    return encodeImage(pipe, src, output, compression, opts);
+}
+
+// Parses one --key=value pipeline option; false if unknown or out of range.
+static bool parseOption(const std::string& arg, CompressOptions& opts) {
+    const std::size_t eq = arg.find('=');
+    const std::string key = arg.substr(0, eq);
+    const std::string val = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+    if (key == "--dither" && (val == "bayer" || val == "fs" || val == "sierra" || val == "rows" ||
+                              val == "columns" || val == "residual")) {
+        opts.dither = (val == "fs") ? DitherMode::FloydSteinberg
+                    : (val == "sierra") ? DitherMode::Sierra
+                    : (val == "rows") ? DitherMode::Rows
+                    : (val == "columns") ? DitherMode::Columns
+                    : (val == "residual") ? DitherMode::Residual : DitherMode::Bayer;
+    } else if (key == "--palette" && std::atoi(val.c_str()) >= 2 && std::atoi(val.c_str()) <= 256) {
+        opts.paletteColors = std::atoi(val.c_str());
+    } else if (key == "--threads" && std::atoi(val.c_str()) >= 1) {
+        opts.threads = std::atoi(val.c_str());
+    } else if (key == "--levels" && (val == "uniform" || val == "lloyd")) {
+        opts.levels = (val == "lloyd") ? LevelMode::LloydMax : LevelMode::Uniform;
+    } else if (key == "--exec" && (val == "tiles" || val == "bands" || val == "stages")) {
+        opts.exec = (val == "bands") ? ExecMode::Bands : (val == "stages") ? ExecMode::Stages : ExecMode::Tiles;
+    } else if (key == "--interlace" && (val == "off" || val == "on" || val == "auto")) {
+        opts.interlace = (val == "on") ? InterlaceMode::On : (val == "auto") ? InterlaceMode::Auto : InterlaceMode::Off;
+    } else if (key == "--lossy-lz" && (val == "on" || val == "off")) {
+        opts.lossyLZ = (val == "on");
+    } else if (key == "--jpeg-aq" && (val == "on" || val == "off")) {
+        opts.jpegAQ = (val == "on");
+    } else if (arg == "--lossless") {
+        opts.lossless = true;
+    } else if (key == "--near-lossless" && std::atoi(val.c_str()) >= 1 &&
+               std::atoi(val.c_str()) <= NearLossless::kMaxError) {
+        opts.nearLossless = std::atoi(val.c_str());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// ---------- shared-memory ring ----------
+// With --ring-mb=N a daemon maps an N MB memfd that the server opens through
+// /proc/<pid>/fd/<fd>. Jobs then name their input and output by offset and
+// length in it: the upload is decoded where the server wrote it and the
+// encoded image is written where the server sends it from, so neither crosses
+// a pipe or the filesystem. The server owns the allocation of the region.
+class SharedRing {
+public:
+    ~SharedRing() {
+#ifdef __linux__
+        if (base_) munmap(base_, size_);
+        if (fd_ >= 0) close(fd_);
+#endif
+    }
+
+    bool open(size_t bytes) {
+#ifdef __linux__
+        fd_ = memfd_create("imgc-ring", MFD_CLOEXEC);
+        if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(bytes)) != 0) {
+            std::cerr << "Failed to create shared ring: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            std::cerr << "Failed to map shared ring: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        base_ = static_cast<uint8_t*>(base);
+        size_ = bytes;
+        return true;
+#else
+        (void)bytes;
+        std::cerr << "Shared ring not supported on this platform\n";
+        return false;
+#endif
+    }
+
+    bool contains(size_t offset, size_t length) const {
+        return base_ && offset <= size_ && length <= size_ - offset;
+    }
+    uint8_t* at(size_t offset) const { return base_ + offset; }
+    int fd() const { return fd_; }
+    size_t size() const { return size_; }
+
+private:
+    uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    int fd_ = -1;
+};
+
+static bool parseSize(const std::string& field, size_t& value) {
+    char* endp = nullptr;
+    const unsigned long long v = std::strtoull(field.c_str(), &endp, 10);
+    if (field.empty() || *endp != '\0' || field[0] == '-') return false;
+    value = static_cast<size_t>(v);
+    return true;
+}
+
+// ---------- slider sessions (--serve) ----------
+static std::vector<std::string> splitFields(const std::string& line) {
+    std::vector<std::string> fields;
+    std::size_t start = 0;
+    for (;;) {
+        const std::size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab - start));
+        if (tab == std::string::npos) return fields;
+        start = tab + 1;
+    }
+}
+
+static std::string firstLine(const std::string& text, const char* fallback) {
+    const std::string line = text.substr(0, text.find('\n'));
+    return line.empty() ? fallback : line;
+}
+
+// Splits stdin into command lines; next(line, false) returns only lines that
+// have already arrived, so serve() can read ahead without blocking.
+class CommandReader {
+public:
+    bool next(std::string& line, bool block) {
+        for (;;) {
+            const size_t newline = buffer_.find('\n');
+            if (newline != std::string::npos) {
+                line = buffer_.substr(0, newline);
+                buffer_.erase(0, newline + 1);
+                return true;
+            }
+            if (eof_) {
+                line.swap(buffer_);
+                buffer_.clear();
+                return !line.empty();
+            }
+#ifdef __linux__
+            pollfd ready = {0, POLLIN, 0};
+            if (!block && ::poll(&ready, 1, 0) <= 0) return false;
+            char chunk[4096];
+            const ssize_t n = ::read(0, chunk, sizeof chunk);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) eof_ = true;
+            else buffer_.append(chunk, static_cast<size_t>(n));
+#else
+            if (!block) return false;
+            return static_cast<bool>(std::getline(std::cin, line));
+#endif
+        }
+    }
+
+private:
+    std::string buffer_;
+    bool eof_ = false;
+};
+
+// One command's answer, held until every earlier reply has been sent.
+struct Reply {
+    std::string text;         // "ok ..." header and body, or "error ..."
+    std::string writeFailed;  // sent instead when the output write fails
+    bool composed = false;
+    int written = 1;          // -1 while the output write is in flight, 0 if it failed
+    bool ready() const { return composed && written >= 0; }
+};
+
+// Long-running mode for the web server, driven over stdin/stdout with one
+// tab-separated command per line.
+//   open <id> <input>                        -> ok <w> <h>
+//   compress <id> <output> <quality> [opts]  -> ok <output bytes> <log bytes>, then the log
+//   close <id>                               -> ok
+//   ring                                     -> ok <pid> <fd> <bytes>
+//   job <in off> <in len> <out off> <out cap> <png|jpg> <quality> [opts]
+//                                            -> ok <output bytes> <log bytes>, then the log
+// Failures answer "error <message>". Besides the pipeline options, compress
+// takes --preview=N to encode a copy scaled to at most N pixels a side. A
+// session names its decoded image in one StageCache bounded by --cache-mb, so
+// every intermediate of every session competes in the same LRU. Decoded images
+// are pinned while a session uses them; once they alone exceed the budget the
+// least recently used session is closed and answers "unknown session".
+// A job whose output does not fit answers "error need <bytes>".
+//
+// File I/O goes through AsyncIO: commands already waiting on stdin are read
+// ahead and the inputs of their opens are fetched in one batch while earlier
+// commands compute, and outputs are written asynchronously. Replies still
+// leave in command order, a compress reply once its output is on disk.
+static int serve(size_t cacheBytes, size_t ringBytes) {
+    std::ostream reply(std::cout.rdbuf());
+    StageCache cache(cacheBytes);
+    SharedRing ring;
+    if (ringBytes > 0 && !ring.open(ringBytes)) return 1;
+    struct Session { StageKey key; uint64_t lastUse; };
+    std::map<std::string, Session> sessions;
+    uint64_t clock = 0;
+    auto closeSession = [&](std::map<std::string, Session>::iterator session) {
+        // the same upload may back several sessions
+        if (!cache.unpin(session->second.key)) cache.eraseTree(session->second.key);
+        sessions.erase(session);
+    };
+    AsyncIO io;
+    CommandReader input;
+    struct Command { std::vector<std::string> f; AsyncIO::ReadTicket source; };
+    std::deque<Command> commands;
+    std::deque<std::shared_ptr<Reply>> replies;
+    constexpr size_t kLookahead = 8;
+    auto enqueue = [&](const std::string& line) {
+        Command command{splitFields(line), nullptr};
+        if (command.f[0].empty()) return;
+        if (command.f[0] == "open" && command.f.size() == 3) command.source = io.read(command.f[2]);
+        commands.push_back(std::move(command));
+    };
+    auto flushReplies = [&]() {
+        while (!replies.empty() && replies.front()->ready()) {
+            const Reply& r = *replies.front();
+            reply << (r.written ? r.text : r.writeFailed);
+            replies.pop_front();
+        }
+        reply << std::flush;
+    };
+
+    std::string line;
+    for (;;) {
+        if (commands.empty()) {
+            // idle: let pending writes land and answer before blocking on stdin
+            io.drain();
+            flushReplies();
+            if (!input.next(line, true)) break;
+            enqueue(line);
+        }
+        while (commands.size() < kLookahead && input.next(line, false)) enqueue(line);
+        io.submit();
+        if (commands.empty()) continue;
+        const Command command = std::move(commands.front());
+        commands.pop_front();
+        const std::vector<std::string>& f = command.f;
+        const auto out = std::make_shared<Reply>();
+        replies.push_back(out);
+
+        // the pipeline logs to std::cout/std::cerr; capture both per command
+        std::ostringstream log, errors;
+        std::streambuf* const outBuf = std::cout.rdbuf(log.rdbuf());
+        std::streambuf* const errBuf = std::cerr.rdbuf(errors.rdbuf());
+        std::string header, body;
+
+        if (f[0] == "open" && f.size() == 3) {
+            Pipeline pipe(cache);
+            io.wait(command.source);
+            const AsyncIO::Read& file = *command.source;
+            const Artifact<RGBImage> src = pipe.decode(file.data, file.ok ? file.size : 0, f[2].c_str());
+            io.release(command.source);
+            if (!src.value) {
+                // error already logged
+            } else if (!cache.pin(src.key)) {
+                std::cerr << "Image exceeds the session cache\n";
+            } else {
+                if (const auto old = sessions.find(f[1]); old != sessions.end()) closeSession(old);
+                sessions[f[1]] = {src.key, ++clock};
+                header = "ok\t" + std::to_string(src.value->w) + "\t" + std::to_string(src.value->h);
+            }
+        } else if (f[0] == "compress" && f.size() >= 4) {
+            char* endp = nullptr;
+            const float quality = std::strtof(f[3].c_str(), &endp);
+            CompressOptions opts;
+            int preview = 0;
+            bool valid = (endp != f[3].c_str());
+            for (size_t k = 4; k < f.size() && valid; ++k) {
+                if (f[k].rfind("--preview=", 0) == 0) valid = (preview = std::atoi(f[k].c_str() + 10)) >= 16;
+                else valid = parseOption(f[k], opts);
+            }
+            const auto session = sessions.find(f[1]);
+            Artifact<RGBImage> src;
+            if (session != sessions.end()) {
+                src = {session->second.key, cache.find<RGBImage>(session->second.key)};
+                session->second.lastUse = ++clock;
+            }
+            if (!valid) {
+                std::cerr << "Invalid compress arguments\n";
+            } else if (!src.value) {
+                std::cerr << "unknown session\n";
+            } else {
+                Pipeline pipe(cache, opts.threads);
+                if (preview > 0) src = pipe.downscale(src, preview);
+                size_t outputBytes = 0;
+                const OutputSink toFile = [&](const std::shared_ptr<EncodedImage>& encoded) {
+                    outputBytes = encoded->bytes.size();
+                    out->written = -1;
+                    out->writeFailed = "error\tFailed to write image: " + f[2] + "\n";
+                    io.write(f[2], AsyncIO::Bytes(encoded, &encoded->bytes),
+                             [out](bool ok) { out->written = ok ? 1 : 0; });
+                    return true;
+                };
+                if (encodeImage(pipe, src, f[2].c_str(), quality, opts, toFile)) {
+                    body = log.str();
+                    header = "ok\t" + std::to_string(outputBytes) + "\t" + std::to_string(body.size());
+                }
+            }
+        } else if (f[0] == "ring" && f.size() == 1) {
+            if (ring.size() == 0) {
+                std::cerr << "No shared ring (start with --ring-mb=N)\n";
+            } else {
+                header = "ok\t" + std::to_string(static_cast<long long>(getpid())) + "\t" +
+                         std::to_string(ring.fd()) + "\t" + std::to_string(ring.size());
+            }
+        } else if (f[0] == "job" && f.size() >= 7) {
+            size_t inOff = 0, inLen = 0, outOff = 0, outCap = 0;
+            char* endp = nullptr;
+            const float quality = std::strtof(f[6].c_str(), &endp);
+            CompressOptions opts;
+            bool valid = parseSize(f[1], inOff) && parseSize(f[2], inLen) && parseSize(f[3], outOff) &&
+                         parseSize(f[4], outCap) && endp != f[6].c_str() &&
+                         ring.contains(inOff, inLen) && ring.contains(outOff, outCap);
+            for (size_t k = 7; k < f.size() && valid; ++k) valid = parseOption(f[k], opts);
+            if (!valid) {
+                std::cerr << "Invalid job arguments\n";
+            } else {
+                // one-shot: nothing of a job is worth keeping
+                StageCache scratch(0);
+                Pipeline pipe(scratch, opts.threads);
+                const std::string name = "ring@" + f[3] + "." + f[5];
+                size_t outLen = 0;
+                const OutputSink toRing = [&](const std::shared_ptr<EncodedImage>& encoded) {
+                    const std::vector<uint8_t>& bytes = encoded->bytes;
+                    if (bytes.size() > outCap) {
+                        std::cerr << "need\t" << bytes.size() << "\n";
+                        return false;
+                    }
+                    std::memcpy(ring.at(outOff), bytes.data(), bytes.size());
+                    outLen = bytes.size();
+                    return true;
+                };
+                const Artifact<RGBImage> src = pipe.decode(ring.at(inOff), inLen, "ring", opts.lossless);
+                if (src.value && encodeImage(pipe, src, name.c_str(), quality, opts, toRing)) {
+                    body = log.str();
+                    header = "ok\t" + std::to_string(outLen) + "\t" + std::to_string(body.size());
+                }
+            }
+        } else if (f[0] == "close" && f.size() == 2) {
+            if (const auto session = sessions.find(f[1]); session != sessions.end()) closeSession(session);
+            header = "ok";
+        } else {
+            std::cerr << "Unknown command: " << f[0] << "\n";
+        }
+
+        while (cache.overPinned() && sessions.size() > 1) {
+            closeSession(std::min_element(sessions.begin(), sessions.end(), [](const auto& a, const auto& b) {
+                return a.second.lastUse < b.second.lastUse;
+            }));
+        }
+
+        std::cout.rdbuf(outBuf);
+        std::cerr.rdbuf(errBuf);
+        if (header.empty()) header = "error\t" + firstLine(errors.str(), "command failed");
+        out->text = header + "\n" + body;
+        out->composed = true;
+        io.poll();
+        flushReplies();
+    }
+    io.drain();
+    flushReplies();
+    return 0;
+}
+
+// ---------- batch mode (--batch) ----------
+// compress --batch <list> [options] compresses every line of <list> ('-' for
+// stdin), each "input<TAB>output<TAB>quality[<TAB>options]", through three
+// stages: decode, process (convert .. palette) and encode + write. Stages
+// hand images over through bounded queues, so image N+1 decodes while N is
+// processed and N-1 deflates. The worker threads take work from the stage
+// furthest downstream that has some, each stage within a share of the
+// threads proportional to its measured cost per image; threads left idle run
+// the process stage's parallel kernels. One result line per image is printed
+// in completion order, then a summary.
+struct BatchJob {
+    std::string input, output;
+    float quality = 0.0f;
+    CompressOptions opts;
+    StageCache cache;  // one-shot, as in compressImage
+    std::unique_ptr<Pipeline> pipe;
+    Artifact<RGBImage> src;
+    PreparedImage prepared;
+    size_t outputBytes = 0;
+};
+
+class BatchExecutor {
+public:
+    BatchExecutor(int threads, size_t queueDepth) : threads_(threads), depth_(queueDepth) {}
+
+    // Runs every job; returns how many failed.
+    size_t run(std::vector<std::unique_ptr<BatchJob>> jobs, std::ostream& results) {
+        total_ = jobs.size();
+        for (auto& job : jobs) queues_[0].push_back(std::move(job));
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads_; ++t) workers.emplace_back([&] { work(results); });
+        for (auto& worker : workers) worker.join();
+        return failed_;
+    }
+
+    // mean seconds per image of a stage, 0 before it first ran
+    double cost(int stage) const { return count_[stage] ? seconds_[stage] / count_[stage] : 0.0; }
+
+private:
+    static constexpr int kStages = 3;  // decode, process, encode
+
+    void work(std::ostream& results) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            int stage = -1;
+            cv_.wait(lock, [&] { return finished_ == total_ || (stage = pick()) >= 0; });
+            if (stage < 0) return;
+            std::unique_ptr<BatchJob> job = std::move(queues_[stage].front());
+            queues_[stage].pop_front();
+            ++running_[stage];
+            const int idle = threads_ - (running_[0] + running_[1] + running_[2]);
+            lock.unlock();
+
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok = runStage(stage, *job, 1 + idle);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            lock.lock();
+            --running_[stage];
+            seconds_[stage] += seconds;
+            ++count_[stage];
+            if (ok && stage + 1 < kStages) {
+                queues_[stage + 1].push_back(std::move(job));
+            } else {
+                if (!ok) ++failed_;
+                ++finished_;
+                results << (ok ? "ok\t" : "error\t") << job->input << "\t" << job->output;
+                if (ok) results << "\t" << job->outputBytes;
+                results << std::endl;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    // Stage to run next, or -1: downstream first, within each stage's share
+    // of the threads; past the shares only if a thread would idle otherwise.
+    int pick() const {
+        double sum = 0.0;
+        bool measured = true;
+        for (int s = 0; s < kStages; ++s) {
+            sum += cost(s);
+            measured = measured && count_[s] > 0;
+        }
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int s = kStages - 1; s >= 0; --s) {
+                if (queues_[s].empty()) continue;
+                if (s + 1 < kStages && queues_[s + 1].size() + running_[s] >= depth_) continue;
+                const int share = (measured && sum > 0.0)
+                    ? std::max(1, static_cast<int>(std::lround(threads_ * cost(s) / sum))) : threads_;
+                if (pass == 0 && running_[s] >= share) continue;
+                return s;
+            }
+        }
+        return -1;
+    }
+
+    static bool runStage(int stage, BatchJob& job, int threads) {
+        switch (stage) {
+        case 0:
+            job.pipe = std::make_unique<Pipeline>(job.cache, 1);
+            job.src = job.pipe->decode(job.input.c_str(), job.opts.lossless);
+            return job.src.value != nullptr;
+        case 1:
+            job.pipe->setThreads(job.opts.threads > 0 ? job.opts.threads : threads);
+            if (!prepareImage(*job.pipe, job.src, job.output.c_str(), job.quality, job.opts, job.prepared)) return false;
+            job.src = {};  // the decoded image is no longer needed
+            return true;
+        default: {
+            const OutputSink toFile = [&](const std::shared_ptr<EncodedImage>& encoded) {
+                job.outputBytes = encoded->bytes.size();
+                return writeFile(job.output.c_str(), encoded->bytes);
+            };
+            const bool ok = finishImage(*job.pipe, job.prepared, job.output.c_str(), toFile);
+            job.prepared = {};
+            return ok;
+        }
+        }
+    }
+
+    const int threads_;
+    const size_t depth_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<BatchJob>> queues_[kStages];
+    int running_[kStages] = {0, 0, 0};
+    double seconds_[kStages] = {0.0, 0.0, 0.0};
+    size_t count_[kStages] = {0, 0, 0};
+    size_t total_ = 0, finished_ = 0, failed_ = 0;
+};
+
+static int runBatch(const char* list, const CompressOptions& defaults) {
+    std::ifstream file;
+    if (std::string(list) != "-") {
+        file.open(list);
+        if (!file) {
+            std::cerr << "Failed to open batch list: " << list << "\n";
+            return 1;
+        }
+    }
+    std::istream& in = file.is_open() ? static_cast<std::istream&>(file) : std::cin;
+
+    std::vector<std::unique_ptr<BatchJob>> jobs;
+    std::string line;
+    for (size_t lineNo = 1; std::getline(in, line); ++lineNo) {
+        if (line.empty() || line[0] == '#') continue;
+        const std::vector<std::string> f = splitFields(line);
+        auto job = std::make_unique<BatchJob>();
+        job->opts = defaults;
+        bool valid = f.size() >= 3;
+        if (valid) {
+            char* endp = nullptr;
+            job->input = f[0];
+            job->output = f[1];
+            job->quality = std::strtof(f[2].c_str(), &endp);
+            valid = endp != f[2].c_str() && std::isfinite(job->quality) && job->quality >= 0.0f && job->quality <= 1.0f;
+        }
+        for (size_t k = 3; k < f.size() && valid; ++k) valid = parseOption(f[k], job->opts);
+        if (!valid) {
+            std::cerr << "Invalid batch line " << lineNo << ": " << line << "\n";
+            return 1;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    const int threads = workerThreads(defaults.threads);
+    const size_t count = jobs.size();
+    std::ostream results(std::cout.rdbuf());
+    std::cout.setstate(std::ios::badbit);  // per-image pipeline logs would interleave
+    BatchExecutor executor(threads, 2);
+    const auto start = std::chrono::steady_clock::now();
+    const size_t failed = executor.run(std::move(jobs), results);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout.clear();
+
+    char summary[160];
+    std::snprintf(summary, sizeof summary,
+                  "Batch: %zu images, %zu failed, %.2f s on %d threads (per image: decode %.1f ms, process %.1f ms, encode %.1f ms)",
+                  count, failed, seconds, threads,
+                  executor.cost(0) * 1e3, executor.cost(1) * 1e3, executor.cost(2) * 1e3);
+    results << summary << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+// ---------- sharded compression (--sharded, --shard-node) ----------
+// For very large scans one process is held back by one socket's memory
+// bandwidth and by a serial deflate. compress --sharded decodes the image,
+// cuts it into horizontal shards and has shard nodes (compress --shard-node
+// <socket>) process and encode them in parallel, then stitches what they send
+// back into one file:
+//   PNG   each shard filters its rows (seeing the row above it) and deflates
+//         them alone; every stream but the last ends in a sync flush (an empty
+//         stored block), so the pieces concatenate into one zlib stream whose
+//         Adler-32 is combined from the shards'.
+//   JPEG  shards are cut on restart intervals; each interval is encoded alone
+//         (DC prediction starts from 0, as after an RSTn) and the intervals are
+//         joined with RST markers under one header carrying a DRI.
+// A shard is sent its rows plus the blur's halo (and for PNG one subsample
+// block above, for the filter's previous row), so the pixels are those of a
+// one-process run. Only band-local settings shard: Lloyd-Max levels, error
+// diffusion and palettes need the whole image and run in one process. Sharded
+// PNGs are always truecolor, so the PNG tiers that stop dithering (below
+// quality 0.35), whose coarse levels usually fit a palette and whose lossy
+// LZ77 matches reach across shard boundaries, run in one process too.
+// Nodes are local child processes on Unix sockets in a temp dir, or with
+// --nodes the sockets of nodes started elsewhere, standing in for remote hosts
+// (a socket forwarded from another machine speaks the same protocol):
+//   shard <png|jpg> <quality> <w> <h> <y0> <y1> <input y0> <input y1> [opts]
+//     followed by the input rows as RGB
+//     -> ok <header bytes> <body bytes> <adler32> <filtered bytes>, then both
+//     -> error <message>
+#ifdef __linux__
+struct ShardPlan {
+    OutputFormat format = OutputFormat::Unsupported;
+    bool process = false;  // run the tile chain (JPEG above 0.6 encodes the source as is)
+    TilePlan tiles;
+    int jpegQuality = 0;
+    bool jpegAQ = false;
+    int halo = 0;          // blur radius in rows
+};
+
+// false when the settings need the whole image
+static bool shardPlan(OutputFormat format, float quality, const CompressOptions& opts, ShardPlan& plan) {
+    plan.format = format;
+    if (opts.lossless) return false;  // the trials encode the whole image
+    if (opts.nearLossless) return false;  // rows depend on the adjusted row above
+    if (format == OutputFormat::JPEG) {
+        plan.jpegQuality = jpegQualityFor(quality);
+        plan.jpegAQ = opts.jpegAQ;
+        plan.process = quality <= 0.6f;
+        plan.tiles.blurSigma = 0.4f;
+    } else if (format == OutputFormat::PNG) {
+        const PngTier t = pngTier(quality);
+        if (opts.paletteColors > 0 || opts.levels != LevelMode::Uniform) return false;
+        if (opts.interlace != InterlaceMode::Off) return false;  // Adam7 passes span every row
+        if (!t.useDithering) return false;  // PNG-8 and lossy LZ77 see the whole image
+        if (!isOrdered(opts.dither)) return false;
+        plan.process = true;
+        plan.tiles.blurSigma = t.blurSigma;
+        plan.tiles.subsample = t.subsampleFactor;
+        plan.tiles.quantize = true;
+        plan.tiles.lumaLevels = t.lumaLevels;
+        plan.tiles.chromaLevels = t.chromaLevels;
+        plan.tiles.dither = orderedPattern(opts.dither);
+        plan.tiles.rgbMultiple = t.rgbMultiple;
+    } else {
+        return false;
+    }
+    if (plan.process && plan.tiles.blurSigma >= 0.1f)
+        plan.halo = static_cast<int>(gaussianKernel(plan.tiles.blurSigma).size() / 2);
+    return true;
+}
+
+// stb subsamples chroma 2x2 up to quality 90, giving 16x16 MCUs
+static int jpegMCU(int jpegQuality) { return jpegQuality <= 90 ? 16 : 8; }
+
+// Rows per JPEG restart interval: whole MCU rows, at most 16 and at most what
+// DRI's 16-bit MCU count allows.
+static int jpegIntervalRows(int w, int jpegQuality) {
+    const int mcu = jpegMCU(jpegQuality);
+    const int mcusPerRow = (w + mcu - 1) / mcu;
+    return mcu * std::clamp(65535 / mcusPerRow, 1, 16);
+}
+
+// Shards start on multiples of this: subsample blocks for PNG, restart
+// intervals for JPEG.
+static int shardUnit(const ShardPlan& plan, int w) {
+    if (plan.format == OutputFormat::JPEG) return jpegIntervalRows(w, plan.jpegQuality);
+    return std::max(plan.tiles.subsample, 1);
+}
+
+// What a node computes for the output rows [y0, y1), and the input it needs.
+struct ShardRows {
+    int computeY0;         // first row through the tile chain
+    int inputY0, inputY1;  // rows sent
+};
+
+static ShardRows shardRows(const ShardPlan& plan, int h, int y0, int y1) {
+    ShardRows r{y0, y0, y1};
+    if (plan.format == OutputFormat::PNG && y0 > 0) r.computeY0 = y0 - std::max(plan.tiles.subsample, 1);
+    r.inputY0 = std::max(0, r.computeY0 - plan.halo);
+    r.inputY1 = std::min(h, y1 + plan.halo);
+    return r;
+}
+
+struct ShardResult {
+    std::vector<uint8_t> header, body;  // header: JPEG only, up to and including SOS
+    uint32_t adler = 1;                 // PNG: of the filtered rows
+    uint64_t rawBytes = 0;              // PNG: filtered bytes
+};
+
+// Bit offset just past the end-of-block code of the fixed-Huffman block that
+// starts 'data' (stb's deflate writes a single one), or 0 if it is malformed.
+static size_t fixedBlockEnd(const std::vector<uint8_t>& data) {
+    static const uint8_t lengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static const uint8_t distExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    const size_t bits = data.size() * 8;
+    size_t pos = 3;  // past BFINAL and BTYPE
+    auto bit = [&]() -> int {
+        const int b = pos < bits ? (data[pos >> 3] >> (pos & 7)) & 1 : 0;
+        ++pos;
+        return b;
+    };
+    auto skip = [&](int count) { pos += count; };
+    for (;;) {
+        // Huffman codes are packed most significant bit first
+        int code = 0;
+        for (int i = 0; i < 7; ++i) code = (code << 1) | bit();
+        int symbol;
+        if (code <= 0x17) {
+            symbol = 256 + code;
+        } else {
+            code = (code << 1) | bit();
+            if (code >= 0x30 && code <= 0xBF) symbol = code - 0x30;
+            else if (code >= 0xC0 && code <= 0xC7) symbol = 280 + code - 0xC0;
+            else symbol = 144 + ((code << 1) | bit()) - 0x190;
+        }
+        if (symbol == 256) return pos <= bits ? pos : 0;
+        if (symbol > 256) {
+            if (symbol > 285) return 0;
+            skip(lengthExtra[symbol - 257]);
+            int distance = 0;
+            for (int i = 0; i < 5; ++i) distance = (distance << 1) | bit();
+            if (distance > 29) return 0;
+            skip(distExtra[distance]);
+        }
+        if (pos > bits) return 0;
+    }
+}
+
+// Turns a shard's zlib stream from stbi_zlib_compress into its piece of the
+// image's deflate stream: header and Adler-32 split off and, unless it is the
+// last piece, the final block made non-final so the next piece can follow.
+static bool deflatePiece(const uint8_t* z, size_t n, bool last, ShardResult& out) {
+    if (n < 7) return false;
+    out.adler = (uint32_t(z[n-4]) << 24) | (uint32_t(z[n-3]) << 16) | (uint32_t(z[n-2]) << 8) | z[n-1];
+    std::vector<uint8_t>& piece = out.body;
+    piece.assign(z + 2, z + n - 4);
+    if (last) return true;
+
+    const int type = (piece[0] >> 1) & 3;
+    if (type == 1) {
+        // one fixed-Huffman block: clear BFINAL, then sync flush after its
+        // end-of-block code (stb pads to the byte with zero bits, which serve
+        // as the stored block's header where at least three are left)
+        piece[0] &= ~1;
+        const size_t end = fixedBlockEnd(piece);
+        if (end == 0) return false;
+        piece.resize((end + 7) / 8);
+        if (end % 8 == 0 || end % 8 > 5) piece.push_back(0);
+        for (uint8_t b : {0x00, 0x00, 0xFF, 0xFF}) piece.push_back(b);
+        return true;
+    }
+    if (type == 0) {
+        // stb fell back to stored blocks, which end byte-aligned: clear the
+        // last one's BFINAL
+        for (size_t pos = 0; pos + 5 <= piece.size();) {
+            const size_t length = piece[pos + 1] | (size_t(piece[pos + 2]) << 8);
+            if (piece[pos] & 1) {
+                piece[pos] &= ~1;
+                return pos + 5 + length == piece.size();
+            }
+            pos += 5 + length;
+        }
+    }
+    return false;
+}
+
+static uint32_t adler32Combine(uint32_t a, uint32_t b, uint64_t lengthB) {
+    constexpr uint64_t kBase = 65521;
+    const uint64_t rem = lengthB % kBase;
+    const uint64_t a1 = a & 0xFFFF, a2 = a >> 16, b1 = b & 0xFFFF, b2 = b >> 16;
+    const uint64_t s1 = (a1 + b1 + kBase - 1) % kBase;
+    const uint64_t s2 = (a2 + b2 + rem * ((a1 + kBase - 1) % kBase)) % kBase;
+    return static_cast<uint32_t>((s2 << 16) | s1);
+}
+
+// Offset of the entropy-coded data in a baseline JPEG (just past SOS), or 0.
+static size_t jpegScanStart(const std::vector<uint8_t>& jpg) {
+    for (size_t pos = 2; pos + 4 <= jpg.size() && jpg[pos] == 0xFF;) {
+        const uint8_t marker = jpg[pos + 1];
+        pos += 2 + ((size_t(jpg[pos + 2]) << 8) | jpg[pos + 3]);
+        if (marker == 0xDA) return pos + 2 <= jpg.size() ? pos : 0;
+    }
+    return 0;
+}
+
+// Processes and encodes the output rows [y0, y1) of a w x h image from
+// 'input', which holds rows shardRows(...).inputY0 .. inputY1.
+static bool encodeShard(const ShardPlan& plan, const uint8_t* input, int w, int h, int y0, int y1,
+                        int threads, ShardResult& result) {
+    const ShardRows rows = shardRows(plan, h, y0, y1);
+    const size_t stride = size_t(w) * 3;
+    std::vector<uint8_t> processed;
+    const uint8_t* pixels = input + (rows.computeY0 - rows.inputY0) * stride;  // row computeY0
+    if (plan.process) {
+        processed.resize((y1 - rows.computeY0) * stride);
+        runTiles(input, w, h, processed.data(), plan.tiles, threads, rows.computeY0, y1, rows.inputY0);
+        pixels = processed.data();
+    }
+    const int skip = y0 - rows.computeY0;  // rows computed only for the PNG filter
+
+    if (plan.format == OutputFormat::PNG) {
+        // the filter choice of stbi_write_png, with the row above in reach
+        const size_t line = stride + 1, count = size_t(y1 - y0);
+        std::vector<uint8_t> filtered(line * count);
+        parallelFor(count * stride, threads, [&](size_t begin, size_t end) {
+            std::vector<uint8_t> scratch(2 * stride);
+            for (size_t j = begin / stride; j < end / stride; ++j) {
+                const size_t row = size_t(skip) + j;  // 0 only for the image's first row
+                const uint8_t* z = pixels + row * stride;
+                filtered[j * line] = static_cast<uint8_t>(stbFilterRow(z, row ? z - stride : nullptr, &filtered[j * line + 1],
+                                                                       stride, 3, -1, scratch.data()));
+            }
+        });
+        int zlen = 0;
+        unsigned char* z = stbi_zlib_compress(filtered.data(), static_cast<int>(filtered.size()), &zlen, 9);
+        if (!z) return false;
+        const bool ok = deflatePiece(z, static_cast<size_t>(zlen), y1 == h, result);
+        STBIW_FREE(z);
+        result.rawBytes = filtered.size();
+        return ok;
+    }
+
+    // JPEG: every restart interval separately, then joined with RSTn
+    const int intervalRows = jpegIntervalRows(w, plan.jpegQuality);
+    const int intervals = (y1 - y0 + intervalRows - 1) / intervalRows;
+    std::vector<std::vector<uint8_t>> encoded(intervals);
+    std::atomic<bool> ok{true};
+    const size_t total = size_t(y1 - y0) * w;
+    parallelFor(total, threads, [&](size_t begin, size_t end) {
+        const JpegAQ::Scope aq(plan.jpegAQ);
+        for (size_t k = begin * intervals / total; k < end * intervals / total; ++k) {
+            const int iy0 = y0 + static_cast<int>(k) * intervalRows, iy1 = std::min(y1, iy0 + intervalRows);
+            if (!stbi_write_jpg_to_func(appendBytes, &encoded[k], w, iy1 - iy0, 3,
+                                        pixels + (iy0 - rows.computeY0) * stride, plan.jpegQuality))
+                ok = false;
+        }
+    });
+    if (!ok) return false;
+    for (int k = 0; k < intervals; ++k) {
+        const std::vector<uint8_t>& jpg = encoded[k];
+        const size_t scan = jpegScanStart(jpg);
+        if (scan == 0 || jpg.size() < scan + 2 || jpg[jpg.size() - 2] != 0xFF || jpg[jpg.size() - 1] != 0xD9)
+            return false;
+        if (k == 0) result.header.assign(jpg.begin(), jpg.begin() + scan);
+        result.body.insert(result.body.end(), jpg.begin() + scan, jpg.end() - 2);
+        const int index = y0 / intervalRows + k;
+        if (y0 + (k + 1) * intervalRows < h)
+            for (uint8_t b : {uint8_t(0xFF), uint8_t(0xD0 + index % 8)}) result.body.push_back(b);
+    }
+    return true;
+}
+
+// The first interval's headers made the image's: its height in SOF0 and a DRI
+// (restart interval in MCUs) before SOS.
+static bool jpegStitchedHeader(std::vector<uint8_t> header, int w, int h, int jpegQuality, std::vector<uint8_t>& out) {
+    const int mcu = jpegMCU(jpegQuality);
+    const int interval = (w + mcu - 1) / mcu * (jpegIntervalRows(w, jpegQuality) / mcu);
+    for (size_t pos = 2; pos + 4 <= header.size() && header[pos] == 0xFF;) {
+        const uint8_t marker = header[pos + 1];
+        if (marker == 0xC0 && pos + 9 <= header.size()) {
+            header[pos + 5] = static_cast<uint8_t>(h >> 8);
+            header[pos + 6] = static_cast<uint8_t>(h);
+        } else if (marker == 0xDA) {
+            out.assign(header.begin(), header.begin() + pos);
+            const uint8_t dri[6] = {0xFF, 0xDD, 0x00, 0x04, static_cast<uint8_t>(interval >> 8), static_cast<uint8_t>(interval)};
+            out.insert(out.end(), dri, dri + 6);
+            out.insert(out.end(), header.begin() + pos, header.end());
+            return true;
+        }
+        pos += 2 + ((size_t(header[pos + 2]) << 8) | header[pos + 3]);
+    }
+    return false;
+}
+
+// One end of a node connection: text lines plus raw payloads.
+class SocketChannel {
+public:
+    explicit SocketChannel(int fd = -1) : fd_(fd) {}
+    ~SocketChannel() { if (fd_ >= 0) close(fd_); }
+    SocketChannel(const SocketChannel&) = delete;
+    SocketChannel& operator=(const SocketChannel&) = delete;
+
+    bool connect(const std::string& path) {
+        sockaddr_un addr{};
+        if (!socketAddress(path, addr)) return false;
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ >= 0 && ::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0) return true;
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    bool write(const void* data, size_t n) {
+        const char* p = static_cast<const char*>(data);
+        while (n > 0) {
+            const ssize_t sent = send(fd_, p, n, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            p += sent;
+            n -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+    bool write(const std::string& text) { return write(text.data(), text.size()); }
+
+    bool readLine(std::string& line) {
+        for (;;) {
+            const size_t nl = buffer_.find('\n');
+            if (nl != std::string::npos) {
+                line = buffer_.substr(0, nl);
+                buffer_.erase(0, nl + 1);
+                return true;
+            }
+            char chunk[4096];
+            const ssize_t got = recv(fd_, chunk, sizeof chunk, 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0 || buffer_.size() > 65536) return false;
+            buffer_.append(chunk, static_cast<size_t>(got));
+        }
+    }
+
+    bool read(void* out, size_t n) {
+        char* p = static_cast<char*>(out);
+        const size_t buffered = std::min(n, buffer_.size());
+        std::memcpy(p, buffer_.data(), buffered);
+        buffer_.erase(0, buffered);
+        for (p += buffered, n -= buffered; n > 0;) {
+            const ssize_t got = recv(fd_, p, n, 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            p += got;
+            n -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    static bool socketAddress(const std::string& path, sockaddr_un& addr) {
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof addr.sun_path) {
+            std::cerr << "Socket path too long: " << path << "\n";
+            return false;
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+private:
+    int fd_;
+    std::string buffer_;  // read past the last line
+};
+
+// Answers one shard request; false ends the connection.
+static bool serveShard(SocketChannel& channel, const std::vector<std::string>& f) {
+    auto fail = [&](const std::string& message) { return channel.write("error\t" + message + "\n"); };
+    auto number = [](const std::string& s, long long& v) {
+        char* endp = nullptr;
+        v = std::strtoll(s.c_str(), &endp, 10);
+        return !s.empty() && *endp == '\0';
+    };
+    long long w = 0, h = 0, y0 = 0, y1 = 0, in0 = 0, in1 = 0;
+    if (f.size() < 9 || f[0] != "shard" || !number(f[3], w) || !number(f[4], h) || !number(f[5], y0) ||
+        !number(f[6], y1) || !number(f[7], in0) || !number(f[8], in1) ||
+        w <= 0 || h <= 0 || w > 1 << 20 || h > 1 << 20 || y0 < 0 || y1 <= y0 || y1 > h || in0 < 0 || in1 <= in0 || in1 > h)
+    {
+        fail("malformed request");
+        return false;  // the payload length is unknown: drop the connection
+    }
+
+    std::vector<uint8_t> input(size_t(in1 - in0) * w * 3);
+    if (!channel.read(input.data(), input.size())) return false;
+
+    CompressOptions opts;
+    for (size_t k = 9; k < f.size(); ++k)
+        if (!parseOption(f[k], opts)) return fail("invalid option " + f[k]);
+    char* endp = nullptr;
+    const float quality = std::strtof(f[2].c_str(), &endp);
+    const OutputFormat format = f[1] == "png" ? OutputFormat::PNG : f[1] == "jpg" ? OutputFormat::JPEG : OutputFormat::Unsupported;
+    ShardPlan plan;
+    if (endp == f[2].c_str() || !(quality >= 0.0f && quality <= 1.0f) || !shardPlan(format, quality, opts, plan))
+        return fail("settings cannot be sharded");
+    const ShardRows rows = shardRows(plan, int(h), int(y0), int(y1));
+    if (y0 % shardUnit(plan, int(w)) != 0 || rows.inputY0 != in0 || rows.inputY1 != in1)
+        return fail("shard rows do not match the plan");
+
+    ShardResult result;
+    if (!encodeShard(plan, input.data(), int(w), int(h), int(y0), int(y1), workerThreads(opts.threads), result))
+        return fail("encode failed");
+    return channel.write("ok\t" + std::to_string(result.header.size()) + "\t" + std::to_string(result.body.size()) +
+                         "\t" + std::to_string(result.adler) + "\t" + std::to_string(result.rawBytes) + "\n") &&
+           channel.write(result.header.data(), result.header.size()) &&
+           channel.write(result.body.data(), result.body.size());
+}
+
+// compress --shard-node <socket> [--once]: serves shard requests, one
+// connection at a time; with --once (nodes started by --sharded) only the
+// first connection, giving up if none arrives within 30 s.
+static int runShardNode(const std::string& path, bool once) {
+    sockaddr_un addr{};
+    if (!SocketChannel::socketAddress(path, addr)) return 1;
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || listen(listener, 4) != 0) {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+    if (!once) std::cout << "Shard node listening on " << path << std::endl;
+    for (;;) {
+        if (once) {
+            pollfd pfd{listener, POLLIN, 0};
+            if (poll(&pfd, 1, 30000) <= 0) break;
+        }
+        const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        if (once) unlink(path.c_str());
+        SocketChannel channel(fd);
+        std::string line;
+        while (channel.readLine(line) && serveShard(channel, splitFields(line))) {}
+        if (once) break;
+    }
+    close(listener);
+    if (!once) unlink(path.c_str());
+    return 0;
+}
+
+struct ShardSetup {
+    int processes = 0;               // local nodes to start; 0 = one per hardware thread
+    std::vector<std::string> nodes;  // sockets of running nodes (--nodes), instead of local ones
+    int shards = 0;                  // 0 = two per node
+};
+
+// Starts a one-connection shard node on 'path'.
+static pid_t spawnShardNode(const std::string& path) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "compress", "--shard-node", path.c_str(), "--once", static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    return pid;
+}
+
+static void writeChunk(std::ostream& out, const char* type, const uint8_t* a, size_t na,
+                       const uint8_t* b = nullptr, size_t nb = 0, const uint8_t* c = nullptr, size_t nc = 0) {
+    const uint8_t* tag = reinterpret_cast<const uint8_t*>(type);
+    uint32_t crc = Checksum::crc32(0, tag, 4);
+    if (na) crc = Checksum::crc32(crc, a, na);
+    if (nb) crc = Checksum::crc32(crc, b, nb);
+    if (nc) crc = Checksum::crc32(crc, c, nc);
+    const uint32_t length = static_cast<uint32_t>(na + nb + nc);
+    const uint8_t len[4] = {uint8_t(length >> 24), uint8_t(length >> 16), uint8_t(length >> 8), uint8_t(length)};
+    const uint8_t sum[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc)};
+    out.write(reinterpret_cast<const char*>(len), 4);
+    out.write(type, 4);
+    if (na) out.write(reinterpret_cast<const char*>(a), static_cast<std::streamsize>(na));
+    if (nb) out.write(reinterpret_cast<const char*>(b), static_cast<std::streamsize>(nb));
+    if (nc) out.write(reinterpret_cast<const char*>(c), static_cast<std::streamsize>(nc));
+    out.write(reinterpret_cast<const char*>(sum), 4);
+}
+
+bool compressSharded(const char* input, const char* output, float quality, const CompressOptions& opts,
+                     const std::vector<std::string>& optionArgs, const ShardSetup& setup) {
+    OutputFormat format;
+    if (!checkRequest(output, quality, format)) return false;
+    if (format == OutputFormat::Unsupported) {
+        std::cerr << "Unsupported output format. Use .png or .jpg/.jpeg\n";
+        return false;
+    }
+    ShardPlan plan;
+    if (!shardPlan(format, quality, opts, plan)) {
+        std::cout << "Sharding needs uniform levels, ordered dither, no palette and (PNG) quality 0.35 or above; "
+                     "compressing in one process.\n";
+        return compressImage(input, output, quality, opts);
+    }
+
+    // local nodes start up while the image decodes
+    const bool local = setup.nodes.empty();
+    const int nodeCount = local ? workerThreads(setup.processes) : static_cast<int>(setup.nodes.size());
+    std::vector<std::string> sockets = setup.nodes;
+    std::vector<pid_t> children;
+    std::string dir;
+    if (local) {
+        char tmpl[] = "/tmp/imgc-shards-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            std::cerr << "Failed to create socket directory: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        dir = tmpl;
+        for (int i = 0; i < nodeCount; ++i) {
+            sockets.push_back(dir + "/node" + std::to_string(i) + ".sock");
+            children.push_back(spawnShardNode(sockets.back()));
+        }
+    }
+    auto cleanup = [&] {
+        for (pid_t pid : children) if (pid > 0) waitpid(pid, nullptr, 0);
+        for (size_t i = 0; local && i < sockets.size(); ++i) unlink(sockets[i].c_str());
+        if (!dir.empty()) rmdir(dir.c_str());
+    };
+
+    const auto t0 = std::chrono::steady_clock::now();
+    StageCache cache;
+    Pipeline pipe(cache, opts.threads);
+    const Artifact<RGBImage> src = pipe.decode(input);
+    const auto t1 = std::chrono::steady_clock::now();
+    if (!src.value || (format == OutputFormat::JPEG && std::max(src.value->w, src.value->h) > 65535)) {
+        if (src.value) std::cerr << "JPEG dimensions are limited to 65535\n";
+        for (pid_t pid : children) kill(pid, SIGTERM);
+        cleanup();
+        return false;
+    }
+    const int w = src.value->w, h = src.value->h;
+    std::cout << "Loaded " << w << "x" << h << " (source channels: " << src.value->channels << ", working: 3)\n";
+
+    // shard rows: whole units, and few enough filtered bytes for stb's int sizes
+    const int unit = shardUnit(plan, w);
+    const int shardCount = setup.shards > 0 ? setup.shards : 2 * nodeCount;
+    const int maxRows = std::max(unit, static_cast<int>((size_t(1) << 30) / (size_t(w) * 3 + 1)) / unit * unit);
+    const int shardH = std::min(maxRows, ((h + shardCount - 1) / shardCount + unit - 1) / unit * unit);
+    const int shards = (h + shardH - 1) / shardH;
+    std::cout << "Sharding into " << shards << " x " << shardH << " rows over " << nodeCount
+              << (local ? " local processes" : " nodes") << " (halo " << plan.halo << " rows)\n";
+
+    std::string options;
+    for (const std::string& arg : optionArgs) options += "\t" + arg;
+    if (local && opts.threads == 0)  // share the cores between the processes
+        options += "\t--threads=" + std::to_string(std::max(1, workerThreads(0) / nodeCount));
+    char qualityText[32];
+    std::snprintf(qualityText, sizeof qualityText, "%.9g", static_cast<double>(quality));
+    const std::string ext = format == OutputFormat::PNG ? "png" : "jpg";
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<int> pending;
+    for (int i = 0; i < shards; ++i) pending.push_back(i);
+    std::vector<std::unique_ptr<ShardResult>> results(shards);
+    int alive = nodeCount;
+    bool failed = false;
+
+    auto runNode = [&](int node) {
+        SocketChannel channel;
+        bool connected = false;
+        for (int attempt = 0; attempt < 1000 && !connected; ++attempt) {
+            connected = channel.connect(sockets[node]);
+            if (connected || !local) break;
+            if (waitpid(children[node], nullptr, WNOHANG) != 0) { children[node] = -1; break; }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (!connected) std::cerr << "Cannot reach shard node " << sockets[node] << "\n";
+        for (;;) {
+            int shard = -1;
+            if (connected) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!pending.empty() && !failed) {
+                    shard = pending.front();
+                    pending.pop_front();
+                }
+            }
+            if (shard < 0) break;
+            const int y0 = shard * shardH, y1 = std::min(h, y0 + shardH);
+            const ShardRows rows = shardRows(plan, h, y0, y1);
+            const std::string request = "shard\t" + ext + "\t" + qualityText + "\t" + std::to_string(w) + "\t" +
+                std::to_string(h) + "\t" + std::to_string(y0) + "\t" + std::to_string(y1) + "\t" +
+                std::to_string(rows.inputY0) + "\t" + std::to_string(rows.inputY1) + options + "\n";
+            auto result = std::make_unique<ShardResult>();
+            std::string reply;
+            bool sent = channel.write(request) &&
+                        channel.write(src.value->rgb.data() + size_t(rows.inputY0) * w * 3,
+                                      size_t(rows.inputY1 - rows.inputY0) * w * 3) &&
+                        channel.readLine(reply);
+            const std::vector<std::string> f = splitFields(reply);
+            if (sent && f.size() == 5 && f[0] == "ok") {
+                result->header.resize(std::strtoull(f[1].c_str(), nullptr, 10));
+                result->body.resize(std::strtoull(f[2].c_str(), nullptr, 10));
+                result->adler = static_cast<uint32_t>(std::strtoul(f[3].c_str(), nullptr, 10));
+                result->rawBytes = std::strtoull(f[4].c_str(), nullptr, 10);
+                sent = channel.read(result->header.data(), result->header.size()) &&
+                       channel.read(result->body.data(), result->body.size());
+                if (sent) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    results[shard] = std::move(result);
+                    changed.notify_all();
+                    continue;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (sent && !f.empty() && f[0] == "error") {
+                // the request itself failed; another node would fail it too
+                std::cerr << "Shard " << shard << " failed on " << sockets[node] << ": "
+                          << (f.size() > 1 ? f[1] : "") << "\n";
+                failed = true;
+            } else {
+                std::cerr << "Shard node " << sockets[node] << " went away; shard " << shard << " is retried\n";
+                pending.push_front(shard);
+            }
+            break;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        --alive;
+        changed.notify_all();
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nodeCount; ++i) threads.emplace_back(runNode, i);
+
+    // stitch in order as the shards arrive
+    std::ofstream out(output, std::ios::binary);
+    uint32_t adler = 1;
+    bool ok = static_cast<bool>(out);
+    if (ok && format == OutputFormat::PNG) {
+        static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+        const uint8_t ihdr[13] = {uint8_t(w >> 24), uint8_t(w >> 16), uint8_t(w >> 8), uint8_t(w),
+                                  uint8_t(h >> 24), uint8_t(h >> 16), uint8_t(h >> 8), uint8_t(h),
+                                  8, 2, 0, 0, 0};  // 8-bit truecolor
+        out.write(reinterpret_cast<const char*>(signature), 8);
+        writeChunk(out, "IHDR", ihdr, sizeof ihdr);
+    }
+    for (int i = 0; ok && i < shards; ++i) {
+        std::unique_ptr<ShardResult> r;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return results[i] || failed || alive == 0; });
+            r = std::move(results[i]);
+            if (!r) {
+                if (!failed) std::cerr << "No shard node left for shard " << i << "\n";
+                failed = true;
+                ok = false;
+                break;
+            }
+        }
+        if (format == OutputFormat::PNG) {
+            static const uint8_t zlibHeader[2] = {0x78, 0x5e};  // as stb's deflate
+            adler = i == 0 ? r->adler : adler32Combine(adler, r->adler, r->rawBytes);
+            const uint8_t sum[4] = {uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8), uint8_t(adler)};
+            const bool last = i + 1 == shards;
+            writeChunk(out, "IDAT", zlibHeader, i == 0 ? 2 : 0, r->body.data(), r->body.size(), sum, last ? 4 : 0);
+        } else {
+            if (i == 0) {
+                std::vector<uint8_t> header;
+                ok = jpegStitchedHeader(r->header, w, h, plan.jpegQuality, header);
+                out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+            }
+            out.write(reinterpret_cast<const char*>(r->body.data()), static_cast<std::streamsize>(r->body.size()));
+        }
+    }
+    if (ok && format == OutputFormat::PNG) {
+        writeChunk(out, "IEND", nullptr, 0);
+    } else if (ok) {
+        static const uint8_t eoi[2] = {0xFF, 0xD9};
+        out.write(reinterpret_cast<const char*>(eoi), 2);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = failed || !ok;  // idle nodes stop taking shards
+    }
+    for (auto& t : threads) t.join();  // closes the connections, ending the local nodes
+    cleanup();
+    out.close();
+    ok = ok && static_cast<bool>(out);
+
+    const double decodeMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    const double shardMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+    if (!ok) {
+        std::remove(output);
+        std::cerr << "Failed to write image: " << output << "\n";
+        return false;
+    }
+    std::cout << (format == OutputFormat::PNG ? "Wrote PNG-24 (truecolor)\n"
+                                              : "Writing JPEG quality: " + std::to_string(plan.jpegQuality) + "\n");
+    std::cout << "Stages: decode " << decodeMs << " ms, shards " << shardMs << " ms\n";
+    std::cout << "Compressed image saved to: " << output << "\n";
+    return true;
+}
+#endif  // __linux__
+
+static bool parseCompression(const char* text, float& compression) {
+    char* endp = nullptr;
+    compression = std::strtof(text, &endp);
+    if (endp == text || !std::isfinite(compression) || compression < 0.0f || compression > 1.0f) {
+        std::cerr << "compression must be a float in [0.0, 1.0]\n";
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cout << "Usage: " << argv[0] << " <input> <output> <compression>\n";
+    // stb reads this global on every PNG deflate; set it before any worker thread starts.
+    stbi_write_png_compression_level = 9;
+    if (argc == 2 && std::string(argv[1]) == "--cpu-info") {
+        printCpuInfo();
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--serve") {
+        size_t cacheMB = 512, ringMB = 0;
+        for (int i = 2; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg.rfind("--cache-mb=", 0) == 0 && std::atoi(argv[i] + 11) > 0) {
+                cacheMB = static_cast<size_t>(std::atoi(argv[i] + 11));
+            } else if (arg.rfind("--ring-mb=", 0) == 0 && std::atoi(argv[i] + 10) > 0) {
+                ringMB = static_cast<size_t>(std::atoi(argv[i] + 10));
+            } else {
+                std::cerr << "Usage: " << argv[0] << " --serve [--cache-mb=N] [--ring-mb=N]\n";
+                return 1;
+            }
+        }
+        return serve(cacheMB << 20, ringMB << 20);
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--batch") {
+        CompressOptions defaults;
+        for (int i = 3; i < argc; ++i) {
+            if (!parseOption(argv[i], defaults)) {
+                std::cerr << "Invalid option: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        return runBatch(argv[2], defaults);
+    }
+#ifdef __linux__
+    if (argc >= 3 && std::string(argv[1]) == "--shard-node") {
+        const bool once = argc == 4 && std::string(argv[3]) == "--once";
+        if (argc > 4 || (argc == 4 && !once)) {
+            std::cerr << "Usage: " << argv[0] << " --shard-node <socket>\n";
+            return 1;
+        }
+        return runShardNode(argv[2], once);
+    }
+    if (argc >= 5 && std::string(argv[1]) == "--sharded") {
+        float compression = 0.0f;
+        if (!parseCompression(argv[4], compression)) return 1;
+        CompressOptions opts;
+        ShardSetup setup;
+        std::vector<std::string> optionArgs;  // forwarded to the nodes
+        for (int i = 5; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg.rfind("--processes=", 0) == 0 && std::atoi(argv[i] + 12) > 0) {
+                setup.processes = std::atoi(argv[i] + 12);
+            } else if (arg.rfind("--shards=", 0) == 0 && std::atoi(argv[i] + 9) > 0) {
+                setup.shards = std::atoi(argv[i] + 9);
+            } else if (arg.rfind("--nodes=", 0) == 0 && arg.size() > 8) {
+                std::stringstream list(arg.substr(8));
+                for (std::string node; std::getline(list, node, ',');)
+                    if (!node.empty()) setup.nodes.push_back(node);
+            } else if (parseOption(arg, opts)) {
+                optionArgs.push_back(arg);
+            } else {
+                std::cerr << "Invalid option: " << arg << "\n";
+                return 1;
+            }
+        }
+        return compressSharded(argv[2], argv[3], compression, opts, optionArgs, setup) ? 0 : 1;
+    }
+#endif
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " <input> <output> <compression> [options]\n";
+        std::cout << "       " << argv[0] << " --batch <list|-> [options]   lines of input<TAB>output<TAB>compression[<TAB>options]\n";
+        std::cout << "       " << argv[0] << " --sharded <input> <output> <compression> [--processes=N|--nodes=SOCK,...] [--shards=N] [options]\n";
+        std::cout << "       " << argv[0] << " --shard-node <socket>   serve shards to --sharded --nodes\n";
+        std::cout << "       " << argv[0] << " --cpu-info\n";
+        std::cout << "       " << argv[0] << " --serve [--cache-mb=N] [--ring-mb=N]   daemon for the web server\n";
         std::cout << "  input: .png, .jpg, or .jpeg file\n";
         std::cout << "  output: .png or .jpg/.jpeg file\n";
         std::cout << "  compression: 0.0 (lowest quality) to 1.0 (highest quality)\n";
+        std::cout << "  options:\n";
+        std::cout << "    --dither=MODE             luma dither where the tier dithers: bayer (default), fs, sierra,\n"
+                     "                              rows, columns (patterns PNG's filters predict), residual\n";
+        std::cout << "    --palette=N               quantize PNGs with >256 colors to N colors (2..256)\n";
+        std::cout << "    --threads=N               worker threads (default: all cores)\n";
+        std::cout << "    --levels=uniform|lloyd    PNG quantization levels (default uniform)\n";
+        std::cout << "    --exec=tiles|bands|stages how convert..toRGB runs (default tiles)\n";
+        std::cout << "    --interlace=off|on|auto   Adam7 PNG output; auto from 2 MP up (default off)\n";
+        std::cout << "    --lossless                exact PNG: reduce colors losslessly, keep the smallest encode\n";
+        std::cout << "    --near-lossless=K         PNG with every channel within K of the source (1..16)\n";
+        std::cout << "    --lossy-lz=on|off         approximate deflate matches for PNG-24 below quality 0.35,\n"
+                     "                              where the tier stops dithering (default on)\n";
+        std::cout << "    --jpeg-aq=on|off          JPEG: zero more coefficients in smooth blocks (default on)\n";
         return 1;
     }
 
     const char* input  = argv[1];
     const char* output = argv[2];
 
-    char* endp = nullptr;
-    float compression = std::strtof(argv[3], &endp);
-    if (endp == argv[3] || !std::isfinite(compression) ||
-        compression < 0.0f || compression > 1.0f) {
-        std::cerr << "compression must be a float in [0.0, 1.0]\n";
-        return 1;
+    float compression = 0.0f;
+    if (!parseCompression(argv[3], compression)) return 1;
+
+    CompressOptions opts;
+    for (int i = 4; i < argc; ++i) {
+        if (!parseOption(argv[i], opts)) {
+            std::cerr << "Invalid option: " << argv[i] << "\n";
+            return 1;
+        }
     }
 
-    return compressImage(input, output, compression) ? 0 : 1;
-}
\ No newline at end of file
+    return compressImage(input, output, compression, opts) ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+// cpu_dispatch.h
+// Function multi-versioning for the static compress binary.
+//
+// We ship one binary built for baseline x86-64, so hot kernels are marked
+// IMGC_MULTIVERSION: GCC/Clang emit one clone per ISA level listed below and
+// an IFUNC resolver binds the best one for the running CPU at load time.
+// Used by compress.cpp and by the vendored encoders (lodepng deflate/filter,
+// stb_image_write DCT/deflate via STBIW_KERNEL).
+
+#ifndef IMGC_CPU_DISPATCH_H
+#define IMGC_CPU_DISPATCH_H
+
+// target_clones needs IFUNC support: ELF + glibc on x86-64.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(IMGC_NO_MULTIVERSION)
+#define IMGC_HAVE_MULTIVERSION 1
+#define IMGC_MULTIVERSION __attribute__((target_clones("default", "sse4.2", "avx2", "avx512f")))
+#else
+#define IMGC_HAVE_MULTIVERSION 0
+#define IMGC_MULTIVERSION
+#endif
+
+#endif // IMGC_CPU_DISPATCH_H
@@ -0,0 +1,111 @@
+const { spawn } = require('child_process');
+
+// Client for `compress --serve`: one long-lived compressor process holding
+// decoded images for slider sessions. Commands are tab-separated lines and
+// the process answers them in order, so replies are matched FIFO.
+class CompressDaemon {
+    constructor(binaryPath, args = []) {
+        this.binaryPath = binaryPath;
+        this.args = args;
+        this.proc = null;
+        this.pending = [];
+        this.buffer = Buffer.alloc(0);
+        this.onExit = null;   // called when the process dies; its sessions are gone
+    }
+
+    start() {
+        if (this.proc) return;
+        const proc = spawn(this.binaryPath, ['--serve', ...this.args]);
+        this.proc = proc;
+        this.buffer = Buffer.alloc(0);
+
+        proc.stdout.on('data', (chunk) => {
+            this.buffer = Buffer.concat([this.buffer, chunk]);
+            this.drain();
+        });
+        proc.stderr.on('data', (data) => {
+            console.error('[C++ serve]:', data.toString());
+        });
+        const fail = (err) => {
+            if (this.proc !== proc) return;
+            this.proc = null;
+            const pending = this.pending;
+            this.pending = [];
+            pending.forEach((p) => p.reject(err));
+            if (this.onExit) this.onExit(err);
+        };
+        proc.on('exit', (code) => fail(new Error('Compressor daemon exited with code ' + code)));
+        proc.on('error', (err) => fail(new Error('Failed to start compressor daemon: ' + err.message)));
+        proc.stdin.on('error', () => {});   // surfaced through 'exit'
+    }
+
+    // Parses "ok ..." / "error <message>" headers; a compress reply carries
+    // its pipeline log as a length-prefixed body.
+    drain() {
+        while (this.pending.length > 0) {
+            const newline = this.buffer.indexOf(0x0a);
+            if (newline < 0) return;
+            const fields = this.buffer.subarray(0, newline).toString().split('\t');
+            const current = this.pending[0];
+            let bodyLength = 0;
+            if (fields[0] === 'ok' && (current.command === 'compress' || current.command === 'job')) {
+                bodyLength = parseInt(fields[2], 10) || 0;
+            }
+            if (this.buffer.length < newline + 1 + bodyLength) return;
+            const body = this.buffer.subarray(newline + 1, newline + 1 + bodyLength).toString();
+            this.buffer = this.buffer.subarray(newline + 1 + bodyLength);
+            this.pending.shift();
+
+            if (fields[0] === 'ok') {
+                current.resolve({ fields: fields.slice(1), body });
+            } else {
+                const err = new Error(fields.slice(1).join(' ') || 'Compressor command failed');
+                err.unknownSession = (fields[1] === 'unknown session');
+                if (fields[1] === 'need') err.need = parseInt(fields[2], 10);
+                current.reject(err);
+            }
+        }
+    }
+
+    request(fields) {
+        if (fields.some((f) => /[\t\n]/.test(String(f)))) {
+            return Promise.reject(new Error('Invalid characters in compressor command'));
+        }
+        this.start();
+        return new Promise((resolve, reject) => {
+            this.pending.push({ command: fields[0], resolve, reject });
+            this.proc.stdin.write(fields.join('\t') + '\n');
+        });
+    }
+
+    async open(id, inputPath) {
+        const { fields } = await this.request(['open', id, inputPath]);
+        return { width: parseInt(fields[0], 10), height: parseInt(fields[1], 10) };
+    }
+
+    async compress(id, outputPath, quality, options = []) {
+        const { fields, body } = await this.request(['compress', id, outputPath, quality.toString(), ...options]);
+        return { outputSize: parseInt(fields[0], 10), log: body };
+    }
+
+    // The process's shared ring (started with --ring-mb=N): a memfd to open
+    // through /proc/<pid>/fd/<fd>.
+    async ring() {
+        const { fields } = await this.request(['ring']);
+        return { pid: parseInt(fields[0], 10), fd: parseInt(fields[1], 10), size: parseInt(fields[2], 10) };
+    }
+
+    // Compresses the ring bytes [inOffset, +inLength) into [outOffset, +outCapacity);
+    // rejects with err.need set when the output does not fit.
+    async job(inOffset, inLength, outOffset, outCapacity, format, quality, options = []) {
+        const { fields, body } = await this.request(['job', inOffset, inLength, outOffset, outCapacity,
+                                                     format, quality.toString(), ...options].map(String));
+        return { outputSize: parseInt(fields[0], 10), log: body };
+    }
+
+    close(id) {
+        return this.request(['close', id]);
+    }
+}
+
+module.exports = { CompressDaemon };
@@ -0,0 +1,68 @@
+// jpeg_aq.h
+// Block-adaptive quantization for baseline JPEG output (--jpeg-aq).
+//
+// Baseline JPEG has one quantization table per component and no per-block
+// scale, so the adaptation is in the rounding. A block's activity is its AC
+// energy in quantizer steps: by Parseval its variance, weighted by what the
+// table deems visible, and free from the DCT the encoder already ran. The
+// smoother the block, the wider the dead zone around zero, and a smooth block
+// whose remaining AC is only a few scattered +-1s, each costing a run/size
+// code for one step of detail, is decimated to its DC alone (run-length
+// aware, after x264's decimation). Busy and edge blocks keep plain rounding.
+// Any baseline decoder reads the result.
+
+#ifndef IMGC_JPEG_AQ_H
+#define IMGC_JPEG_AQ_H
+
+class JpegAQ {
+public:
+    // Enables the adaptation on this thread while in scope (encodes run on
+    // several threads under --batch and --serve).
+    class Scope {
+    public:
+        explicit Scope(bool enable) : saved_(enabled_) { enabled_ = enable; }
+        ~Scope() { enabled_ = saved_; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        bool saved_;
+    };
+
+    // du: the block's rounded coefficients, coeffs: unrounded (coefficient /
+    // step), both zigzag; rewrites du's AC in place.
+    static void adapt(int* du, const float* coeffs) {
+        if (!enabled_) return;
+        float energy = 0.0f;
+        for (int k = 1; k < 64; ++k) energy += coeffs[k] * coeffs[k];
+        const float smooth = kActivity / (kActivity + energy);  // 1 flat .. 0 busy
+
+        const float deadZone = 0.5f + kDeadZone * smooth;
+        int score = 0, run = 0;
+        for (int k = 1; k < 64; ++k) {
+            const float a = coeffs[k] < 0 ? -coeffs[k] : coeffs[k];
+            if (a < deadZone) du[k] = 0;
+            if (du[k] == 0) {
+                ++run;
+                continue;
+            }
+            score += (du[k] == 1 || du[k] == -1) ? kRunScore[run < 6 ? run : 6] : kKeep;
+            run = 0;
+        }
+        if (score < kDecimate * smooth)
+            for (int k = 1; k < 64; ++k) du[k] = 0;
+    }
+
+private:
+    static constexpr float kActivity = 16.0f;  // AC energy (steps^2) at which a block counts half smooth
+    static constexpr float kDeadZone = 0.35f;  // widening of the +-0.5 rounding threshold on flat blocks
+    static constexpr int kDecimate = 6;        // decimation threshold on a flat block
+    static constexpr int kKeep = 64;           // any |coefficient| > 1 keeps the block
+    // worth of a +-1 by the zero run before it: clustered ones are detail,
+    // isolated ones mostly noise
+    static constexpr int kRunScore[7] = {3, 2, 2, 1, 1, 1, 0};
+
+    static inline thread_local bool enabled_ = false;
+};
+
+#endif // IMGC_JPEG_AQ_H
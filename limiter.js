@@ -0,0 +1,125 @@
+const os = require('os');
+
+// Adaptive concurrency limit for compressor jobs: AIMD against a latency
+// target, in the spirit of Netflix's concurrency-limits.
+//
+// Every finished job contributes a latency sample, normalized by its cost
+// (input megabytes) so large and small images are comparable. The baseline is
+// the no-load latency: it follows improvements at once and rises only slowly,
+// toward current/tolerance, so running at the target never feeds back into
+// it. While latency stays within `tolerance` x baseline and the window is in
+// use, the limit grows by one per window of completions; once queueing for
+// the CPU pushes latency over the target it is cut by `backoff`, at most once
+// per window. Requests beyond the limit wait in a bounded FIFO; when that is
+// full, or a request waited too long, it is shed.
+class AdaptiveLimiter {
+    constructor(options = {}) {
+        const cpus = os.cpus().length || 1;
+        this.minLimit = options.minLimit || 1;
+        this.maxLimit = options.maxLimit || cpus * 4;
+        this.limit = Math.min(options.initialLimit || cpus, this.maxLimit);
+        this.tolerance = options.tolerance || 1.25;    // target = tolerance x baseline latency
+        this.backoff = options.backoff || 0.9;         // multiplicative decrease
+        this.longWindow = options.longWindow || 500;   // samples over which the baseline may rise
+        this.shortWindow = options.shortWindow || 5;   // samples averaged into the current latency
+        this.maxQueue = options.maxQueue || 64;
+        this.maxWaitMs = options.maxWaitMs || 30000;
+
+        this.inflight = 0;
+        this.queue = [];
+        this.longLatency = null;
+        this.shortLatency = null;
+        this.sinceDecrease = 0;
+        this.completed = 0;
+        this.shed = 0;
+    }
+
+    // Runs fn() once a slot is free; rejects with err.shed set when the
+    // request is turned away instead.
+    async run(fn, cost = 1) {
+        await this.acquire();
+        const started = Date.now();
+        try {
+            return await fn();
+        } finally {
+            this.release((Date.now() - started) / Math.max(cost, 0.1));
+        }
+    }
+
+    acquire() {
+        if (this.inflight < this.window() && this.queue.length === 0) {
+            this.inflight++;
+            return Promise.resolve();
+        }
+        if (this.queue.length >= this.maxQueue) {
+            return Promise.reject(this.shedError('queue full'));
+        }
+        return new Promise((resolve, reject) => {
+            const waiter = { resolve, reject, timer: null };
+            waiter.timer = setTimeout(() => {
+                this.queue.splice(this.queue.indexOf(waiter), 1);
+                reject(this.shedError('waited ' + this.maxWaitMs + ' ms'));
+            }, this.maxWaitMs);
+            this.queue.push(waiter);
+        });
+    }
+
+    release(latency) {
+        this.inflight--;
+        this.completed++;
+        this.update(latency);
+        while (this.queue.length > 0 && this.inflight < this.window()) {
+            const waiter = this.queue.shift();
+            clearTimeout(waiter.timer);
+            this.inflight++;
+            waiter.resolve();
+        }
+    }
+
+    update(latency) {
+        const ema = (avg, sample, window) => (avg === null ? sample : avg + (sample - avg) / window);
+        this.shortLatency = ema(this.shortLatency, latency, this.shortWindow);
+        const settled = this.shortLatency / this.tolerance;
+        if (this.longLatency === null || this.shortLatency < this.longLatency) {
+            this.longLatency = this.shortLatency;
+        } else if (settled > this.longLatency) {
+            this.longLatency = ema(this.longLatency, settled, this.longWindow);
+        }
+
+        this.sinceDecrease++;
+        if (this.shortLatency > this.tolerance * this.longLatency) {
+            if (this.sinceDecrease >= this.limit) {
+                this.limit = Math.max(this.minLimit, this.limit * this.backoff);
+                this.sinceDecrease = 0;
+            }
+        } else if (this.inflight + 1 >= this.window()) {
+            // an idle window says nothing about capacity
+            this.limit = Math.min(this.maxLimit, this.limit + 1 / this.limit);
+        }
+    }
+
+    window() {
+        return Math.max(this.minLimit, Math.floor(this.limit));
+    }
+
+    shedError(reason) {
+        this.shed++;
+        const err = new Error('Server busy (' + reason + '), retry shortly');
+        err.shed = true;
+        return err;
+    }
+
+    snapshot() {
+        return {
+            limit: Number(this.limit.toFixed(2)),
+            inflight: this.inflight,
+            queued: this.queue.length,
+            completed: this.completed,
+            shed: this.shed,
+            latencyMsPerMB: this.shortLatency === null ? null : Number(this.shortLatency.toFixed(1)),
+            baselineMsPerMB: this.longLatency === null ? null : Number(this.longLatency.toFixed(1))
+        };
+    }
+}
+
+module.exports = { AdaptiveLimiter };
@@ -30,6 +30,13 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include "lodepng.h"
 
+/*Altered for the image compressor: the hot deflate/filter loops are marked IMGC_MULTIVERSION
+so the static binary carries SSE4.2/AVX2/AVX-512 clones of them, see cpu_dispatch.h*/
+#include "cpu_dispatch.h"
+#include "checksum.h"
+#include "png_filter.h"
+#include "adam7.h"
+
 #ifdef LODEPNG_COMPILE_DISK
 #include <limits.h> /* LONG_MAX */
 #include <stdio.h> /* file handling */
@@ -1569,6 +1576,7 @@ sliding window (of windowsize) is used, and all past bytes in that window can be
 the "dictionary". A brute force search through all possible distances would be slow, and
 this hash technique is one out of several ways to speed this up.
 */
+IMGC_MULTIVERSION
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
                            unsigned minmatch, unsigned nicematch, unsigned lazymatching) {
@@ -2119,24 +2127,9 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*Altered for the image compressor: the AVX2 Adler-32 from checksum.h*/
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
-  unsigned s1 = adler & 0xffffu;
-  unsigned s2 = (adler >> 16u) & 0xffffu;
-
-  while(len != 0u) {
-    unsigned i;
-    /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5552u ? 5552u : len;
-    len -= amount;
-    for(i = 0; i != amount; ++i) {
-      s1 += (*data++);
-      s2 += s1;
-    }
-    s1 %= 65521u;
-    s2 %= 65521u;
-  }
-
-  return (s2 << 16u) | s1;
+  return Checksum::adler32(adler, data, len);
 }
 
 /*Return the adler32 of the bytes data[0..len-1]*/
@@ -4236,6 +4229,7 @@ mode_in is raw color profile of the image the stats were computed on, to copy pa
 Minimal PNG color model means the color type and bit depth that gives smallest amount of bits in the output image,
 e.g. gray if only grayscale pixels, palette if less than 256 colors, color key if only single transparent color, ...
 This is used if auto_convert is enabled (it is by default).
+Altered for the image compressor: exported as lodepng_auto_choose_color (see lodepng.h).
 */
 static unsigned auto_choose_color(LodePNGColorMode* mode_out,
                                   const LodePNGColorMode* mode_in,
@@ -4302,6 +4296,11 @@ static unsigned auto_choose_color(LodePNGColorMode* mode_out,
   return error;
 }
 
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                   const LodePNGColorStats* stats) {
+  return auto_choose_color(mode_out, mode_in, stats);
+}
+
 #endif /* #ifdef LODEPNG_COMPILE_ENCODER */
 
 /*Paeth predictor, used by PNG filter type 4*/
@@ -6041,48 +6040,11 @@ static unsigned addChunk_sBIT(ucvector* out, const LodePNGInfo* info) {
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*Altered for the image compressor: the SSE2 kernels from png_filter.h*/
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType) {
-  size_t i;
-  switch(filterType) {
-    case 0: /*None*/
-      for(i = 0; i != length; ++i) out[i] = scanline[i];
-      break;
-    case 1: /*Sub*/
-      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
-      break;
-    case 2: /*Up*/
-      if(prevline) {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
-      } else {
-        for(i = 0; i != length; ++i) out[i] = scanline[i];
-      }
-      break;
-    case 3: /*Average*/
-      if(prevline) {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
-      } else {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
-      }
-      break;
-    case 4: /*Paeth*/
-      if(prevline) {
-        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
-        for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i) {
-          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
-        }
-      } else {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
-      }
-      break;
-    default: return; /*invalid filter type given*/
-  }
+  if(filterType > 4) return; /*invalid filter type given*/
+  PngFilter::apply(filterType, scanline, prevline, out, length, bytewidth, PngFilter::Score::MinSum);
 }
 
 /* integer binary logarithm, max return value is 31 */
@@ -6106,6 +6068,7 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (((size_t)1) << l)) << 1u);
 }
 
+IMGC_MULTIVERSION
 static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
                        const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
   /*
@@ -6144,52 +6107,21 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
   } else if(strategy == LFS_MINSUM) {
     /*adaptive filtering: independently for each row, try all five filter types and select the one that produces the
-    smallest sum of absolute values per row.*/
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
+    smallest sum of absolute values per row. Filter type 0 is scored by its unsigned sum, so it is almost never chosen.
+    Altered for the image compressor: PngFilter::choose filters and scores each type in one pass, into the output row.*/
+    unsigned char* scratch = (unsigned char*)lodepng_malloc(2 * linebytes);
+    if(!scratch) error = 83; /*alloc fail*/
 
     if(!error) {
       for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
-            bestType = type;
-            smallest = sum;
-          }
-        }
-
+        unsigned char* row = &out[y * (linebytes + 1)];
+        row[0] = (unsigned char)PngFilter::choose(&in[y * linebytes], prevline, row + 1, linebytes, bytewidth,
+                                                  PngFilter::Score::MinSum, scratch);
         prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    lodepng_free(scratch);
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -6329,18 +6261,8 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
   if(bpp >= 8) {
-    for(i = 0; i != 7; ++i) {
-      unsigned x, y, b;
-      size_t bytewidth = bpp / 8u;
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x) {
-        size_t pixelinstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i] + x * ADAM7_DX[i]) * bytewidth;
-        size_t pixeloutstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        for(b = 0; b < bytewidth; ++b) {
-          out[pixeloutstart + b] = in[pixelinstart + b];
-        }
-      }
-    }
+    /*Altered for the image compressor: the row-wise gather from adam7.h*/
+    for(i = 0; i != 7; ++i) Adam7::extract(in, w, h, bpp / 8u, (int)i, &out[passstart[i]]);
   } else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/ {
     for(i = 0; i != 7; ++i) {
       unsigned x, y, b;
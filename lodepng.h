@@ -99,7 +99,9 @@ in a comment in the lodepng.c(pp) file in the 'else' case of the searchable LODE
 #ifndef LODEPNG_NO_COMPILE_CRC
 /*pass -DLODEPNG_NO_COMPILE_CRC to the compiler to disable the built-in one,
 or comment out LODEPNG_COMPILE_CRC below*/
-#define LODEPNG_COMPILE_CRC
+/*Altered for the image compressor: off, compress.cpp defines lodepng_crc32 with the
+PCLMULQDQ CRC from checksum.h*/
+/*#define LODEPNG_COMPILE_CRC*/
 #endif
 
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
@@ -901,6 +903,12 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* image, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in);
 
+/*Altered for the image compressor: the color model auto_convert would pick for these stats
+(smallest color type and bit depth that holds every color), so that several encodes of one
+image can share it and run with auto_convert off. mode_out must be inited.*/
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                   const LodePNGColorStats* stats);
+
 /*Settings for the encoder.*/
 typedef struct LodePNGEncoderSettings {
   LodePNGCompressSettings zlibsettings; /*settings for the zlib encoder, such as window size, ...*/
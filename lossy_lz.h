@@ -0,0 +1,184 @@
+// lossy_lz.h
+// Lossy LZ77 for PNG-24 output on the low quality tiers, after lossypng and
+// pngquant's lossy deflate.
+//
+// Deflate only finds exact repeats, and the filtered rows of a noisy photo
+// hardly have any. This filters the image row by row as stb_image_write
+// would (same filter choice) but, at each position, also looks back through
+// the last 32K of filtered output for a run it could copy instead: a
+// candidate is accepted while every pixel value it reconstructs (through the
+// row's filter, from the neighbours as already rewritten) stays within
+// 'tolerance' of the source. The copied bytes are then an exact repeat in
+// the deflate input, and the pixels are rewritten to what they decode to,
+// so any PNG decoder reproduces the image the matches were checked against.
+// Candidates come from a hash chain over quantized residuals, newest first
+// like stb's own match finder, so the repeats are ones deflate will see.
+
+#ifndef IMGC_LOSSY_LZ_H
+#define IMGC_LOSSY_LZ_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "png_filter.h"
+
+class LossyLZ {
+public:
+    // Filters 'in' (rows packed) into 'out', filter byte first on every row.
+    static void filter(const uint8_t* in, size_t w, size_t h, size_t bpp, int tolerance, uint8_t* out) {
+        const size_t line = w * bpp;
+        if (line == 0) return;
+        LossyLZ lz(out, tolerance);
+        std::vector<uint8_t> prior(line, 0), rows(2 * line), scratch(2 * line);
+        for (size_t y = 0; y < h; ++y) {
+            const uint8_t* src = in + y * line;
+            uint8_t* rec = &rows[(y & 1) * line];
+            uint8_t* dst = out + y * (line + 1);
+            const int type = PngFilter::choose(src, y ? prior.data() : nullptr, dst + 1, line, bpp,
+                                               PngFilter::Score::SignedSum, scratch.data());
+            dst[0] = static_cast<uint8_t>(type);
+            lz.emit(static_cast<size_t>(dst - out) + 1);
+            switch (type) {
+            case 1: lz.row<1>(src, prior.data(), rec, dst + 1, line, bpp); break;
+            case 2: lz.row<2>(src, prior.data(), rec, dst + 1, line, bpp); break;
+            case 3: lz.row<3>(src, prior.data(), rec, dst + 1, line, bpp); break;
+            case 4: lz.row<4>(src, prior.data(), rec, dst + 1, line, bpp); break;
+            default: lz.row<0>(src, prior.data(), rec, dst + 1, line, bpp); break;
+            }
+            std::memcpy(prior.data(), rec, line);
+        }
+    }
+
+private:
+    static constexpr size_t kWindow = 32768;  // deflate's
+    static constexpr int kHashBits = 16;
+    static constexpr int kChain = 16;         // hash candidates tried per position
+    static constexpr size_t kRowsAbove = 4;   // and the same position this many rows up
+    static constexpr size_t kMinMatch = 6;    // shorter copies rarely pay for their distance code
+    static constexpr size_t kMaxMatch = 258;
+
+    LossyLZ(uint8_t* stream, int tolerance)
+        : stream_(stream), tolerance_(tolerance), step_(2 * tolerance + 1), head_(size_t(1) << kHashBits, -1),
+          prev_(kWindow, -1) {}
+
+    static int paeth(int a, int b, int c) {
+        const int p = a + b - c, pa = p > a ? p - a : a - p, pb = p > b ? p - b : b - p, pc = p > c ? p - c : c - p;
+        return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+    }
+
+    template <int Type>
+    static int predict(int a, int b, int c) {
+        return Type == 1 ? a : Type == 2 ? b : Type == 3 ? (a + b) >> 1 : Type == 4 ? paeth(a, b, c) : 0;
+    }
+
+    template <int Type>
+    static int predictAt(const uint8_t* rec, const uint8_t* prior, size_t i, size_t bpp) {
+        return predict<Type>(i >= bpp ? rec[i - bpp] : 0, prior[i], i >= bpp ? prior[i - bpp] : 0);
+    }
+
+    // Residuals within the tolerance of each other mostly share a bucket.
+    uint32_t hash(uint8_t r0, uint8_t r1, uint8_t r2) const {
+        const uint32_t q0 = (static_cast<int8_t>(r0) + 128 + tolerance_) / step_;
+        const uint32_t q1 = (static_cast<int8_t>(r1) + 128 + tolerance_) / step_;
+        const uint32_t q2 = (static_cast<int8_t>(r2) + 128 + tolerance_) / step_;
+        return ((q0 * 0x9E3779B1u) ^ (q1 * 0x85EBCA77u) ^ (q2 * 0xC2B2AE3Du)) >> (32 - kHashBits);
+    }
+
+    // Stream bytes up to 'end' are final: chain every position whose three
+    // bytes are now known.
+    void emit(size_t end) {
+        for (; inserted_ + 3 <= end; ++inserted_) {
+            const uint32_t h = hash(stream_[inserted_], stream_[inserted_ + 1], stream_[inserted_ + 2]);
+            prev_[inserted_ % kWindow] = head_[h];
+            head_[h] = static_cast<int64_t>(inserted_);
+        }
+    }
+
+    // Copies stream bytes from 'from' to row position 'x' on while the pixels
+    // stay within the tolerance; returns how many, and in 'exact' how many of
+    // those decode to the source exactly. Overlapping copies read what they
+    // wrote, as in LZ77.
+    template <int Type>
+    size_t copy(size_t from, const uint8_t* src, const uint8_t* prior, uint8_t* rec, uint8_t* out, size_t x,
+                size_t limit, size_t bpp, size_t& exact) const {
+        const size_t at = static_cast<size_t>(out - stream_);
+        size_t k = 0;
+        exact = limit;
+        for (; k < limit; ++k) {
+            const uint8_t f = stream_[from + k];
+            const int v = (predictAt<Type>(rec, prior, x + k, bpp) + f) & 255, d = v - src[x + k];
+            if (d > tolerance_ || d < -tolerance_) break;
+            if (d && exact == limit) exact = k;
+            rec[x + k] = static_cast<uint8_t>(v);
+            stream_[at + x + k] = f;
+        }
+        if (exact > k) exact = k;
+        return k;
+    }
+
+    template <int Type>
+    void row(const uint8_t* src, const uint8_t* prior, uint8_t* rec, uint8_t* out, size_t line, size_t bpp) {
+        const size_t base = static_cast<size_t>(out - stream_);
+        size_t x = 0;
+        while (x < line) {
+            const size_t limit = std::min(kMaxMatch, line - x);
+            size_t bestLength = 0, bestFrom = 0, bestExact = 0;
+            if (limit >= kMinMatch && bpp >= 3) {
+                // the next three residuals of an exact encode; their left
+                // neighbours are already final when pixels are 3+ bytes
+                uint8_t r[3];
+                for (size_t k = 0; k < 3; ++k)
+                    r[k] = static_cast<uint8_t>(src[x + k] - predictAt<Type>(rec, prior, x + k, bpp));
+                const size_t at = base + x;
+                auto consider = [&](size_t from) {
+                    size_t exact;
+                    const size_t length = copy<Type>(from, src, prior, rec, out, x, limit, bpp, exact);
+                    bestExact = std::max(bestExact, exact);
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestFrom = from;
+                    }
+                    return exact == limit;
+                };
+                // the same place a few rows up first: flat and dithered areas
+                // crowd one hash bucket, and their repeats are periodic in rows
+                bool done = false;
+                for (size_t k = 1; k <= kRowsAbove && !done && k * (line + 1) <= at && k * (line + 1) < kWindow; ++k)
+                    done = consider(at - k * (line + 1));
+                int64_t from = head_[hash(r[0], r[1], r[2])];
+                for (int tries = 0; !done && from >= 0 && at - static_cast<size_t>(from) < kWindow && tries < kChain;
+                     ++tries) {
+                    done = consider(static_cast<size_t>(from));
+                    from = prev_[static_cast<size_t>(from) % kWindow];
+                }
+            }
+            if (bestExact >= kMinMatch) {
+                // the source repeats as it is: keep it exact, so the rows
+                // below still predict from the true pixels
+                for (size_t end = x + bestExact; x < end; ++x) {
+                    rec[x] = src[x];
+                    out[x] = static_cast<uint8_t>(src[x] - predictAt<Type>(rec, prior, x, bpp));
+                }
+            } else if (bestLength >= kMinMatch) {
+                size_t exact;
+                copy<Type>(bestFrom, src, prior, rec, out, x, bestLength, bpp, exact);
+                x += bestLength;
+            } else {  // literal: exact
+                rec[x] = src[x];
+                out[x] = static_cast<uint8_t>(src[x] - predictAt<Type>(rec, prior, x, bpp));
+                ++x;
+            }
+            emit(base + x);
+        }
+    }
+
+    uint8_t* stream_;
+    const int tolerance_, step_;
+    std::vector<int64_t> head_, prev_;  // chains of stream positions, newest first
+    size_t inserted_ = 0;
+};
+
+#endif // IMGC_LOSSY_LZ_H
@@ -0,0 +1,97 @@
+// near_lossless.h
+// Near-lossless PNG scanline filtering for --near-lossless=K, after WebP's
+// near-lossless residual quantization.
+//
+// Every channel value may move by up to K so that the filter residuals fall
+// on a few repeated values (multiples of 2K+1, mostly zero), which deflate
+// codes far better than the noise of an exact image. Rows run top to bottom
+// with the filter in the loop: each byte is predicted from the neighbours as
+// already adjusted, its residual is rounded to the nearest multiple of 2K+1
+// (kept exact where that would leave 0..255), and the row keeps whichever of
+// the five filters scores lowest by stb_image_write's measure. The output is
+// the filtered stream itself, filter byte first on every row, so a decoder
+// rebuilds exactly the adjusted pixels and no channel is off by more than K.
+
+#ifndef IMGC_NEAR_LOSSLESS_H
+#define IMGC_NEAR_LOSSLESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class NearLossless {
+public:
+    static constexpr int kMaxError = 16;
+
+    // Filters 'in' (rows packed) into 'out' with every value within
+    // 'maxError' (0..kMaxError) of the original; 0 is plain lossless.
+    static void filter(const uint8_t* in, size_t w, size_t h, size_t bpp, int maxError, uint8_t* out) {
+        const size_t line = w * bpp;
+        if (line == 0) return;
+        int16_t quantized[511];  // residual + 255 -> nearest multiple of 2K+1
+        const int step = 2 * maxError + 1;
+        for (int r = -255; r <= 255; ++r)
+            quantized[r + 255] = static_cast<int16_t>(r >= 0 ? (r + maxError) / step * step
+                                                             : -((maxError - r) / step * step));
+
+        // per filter: the adjusted row and its residuals; prior starts as zeros
+        std::vector<uint8_t> prior(line, 0), adjusted(5 * line), residuals(5 * line);
+        for (size_t y = 0; y < h; ++y) {
+            const uint8_t* row = in + y * line;
+            int best = 0;
+            uint64_t bestScore = 0;
+            for (int type = 0; type < 5; ++type) {
+                uint8_t* a = &adjusted[type * line];
+                uint8_t* r = &residuals[type * line];
+                uint64_t score;
+                switch (type) {
+                case 1: score = run<1>(row, prior.data(), a, r, line, bpp, quantized); break;
+                case 2: score = run<2>(row, prior.data(), a, r, line, bpp, quantized); break;
+                case 3: score = run<3>(row, prior.data(), a, r, line, bpp, quantized); break;
+                case 4: score = run<4>(row, prior.data(), a, r, line, bpp, quantized); break;
+                default: score = run<0>(row, prior.data(), a, r, line, bpp, quantized); break;
+                }
+                if (type == 0 || score < bestScore) {
+                    best = type;
+                    bestScore = score;
+                }
+            }
+            uint8_t* dst = out + y * (line + 1);
+            dst[0] = static_cast<uint8_t>(best);
+            std::memcpy(dst + 1, &residuals[best * line], line);
+            std::memcpy(prior.data(), &adjusted[best * line], line);
+        }
+    }
+
+private:
+    static int paeth(int a, int b, int c) {
+        const int p = a + b - c, pa = p > a ? p - a : a - p, pb = p > b ? p - b : b - p, pc = p > c ? p - c : c - p;
+        return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+    }
+
+    template <int Type>
+    static int predict(int a, int b, int c) {
+        return Type == 1 ? a : Type == 2 ? b : Type == 3 ? (a + b) >> 1 : Type == 4 ? paeth(a, b, c) : 0;
+    }
+
+    // One row with filter 'Type'; returns the sum of |residual as signed char|.
+    template <int Type>
+    static uint64_t run(const uint8_t* row, const uint8_t* prior, uint8_t* adjusted, uint8_t* residuals,
+                        size_t line, size_t bpp, const int16_t* quantized) {
+        uint64_t score = 0;
+        for (size_t i = 0; i < line; ++i) {
+            const int a = i >= bpp ? adjusted[i - bpp] : 0, c = i >= bpp ? prior[i - bpp] : 0;
+            const int pred = predict<Type>(a, prior[i], c), x = row[i];
+            int v = pred + quantized[x - pred + 255];
+            if (v < 0 || v > 255) v = x;
+            adjusted[i] = static_cast<uint8_t>(v);
+            residuals[i] = static_cast<uint8_t>(v - pred);
+            const int s = static_cast<int8_t>(residuals[i]);
+            score += static_cast<uint64_t>(s < 0 ? -s : s);
+        }
+        return score;
+    }
+};
+
+#endif // IMGC_NEAR_LOSSLESS_H
@@ -0,0 +1,556 @@
+// png_decode.h
+// Streaming PNG decoder for the compressor's decode stage.
+//
+// stb_image gathers every IDAT chunk into one growing buffer, inflates the
+// whole stream into a second one and only then unfilters and converts, each a
+// pass over the full image. PngDecoder reads the IDAT chunks where they lie,
+// inflates with table-driven Huffman decoding (an 11-bit first-level table
+// whose literal entries carry two literals where both codes fit, as in
+// libdeflate) into a window of 32 KB history plus a few rows, and unfilters
+// and converts every row to RGB as soon as it is complete, straight into the
+// output image. Up is a flat loop cloned per ISA level; Sub, Avg and Paeth
+// depend on the pixel to their left and run as one tight loop per filter.
+//
+// Only the common case is handled: 8-bit, non-interlaced, any color type.
+// Everything else - other depths, Adam7, CgBI, and any file that looks
+// malformed - is declined, and the caller falls back to stb_image, so the
+// pixels (and the reported channel count) are always what stb would produce.
+
+#ifndef IMGC_PNG_DECODE_H
+#define IMGC_PNG_DECODE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "cpu_dispatch.h"
+
+class PngDecoder {
+public:
+    // Decodes 'bytes' to 8-bit RGB. false - with nothing promised about 'rgb'
+    // - when the file is outside the fast path or not valid.
+    bool decode(const uint8_t* bytes, size_t size, std::vector<uint8_t>& rgb) {
+        if (!scan(bytes, size)) return false;
+        const size_t stride = size_t(w_) * bpp_, rowBytes = stride + 1;
+        rgb.resize(size_t(w_) * h_ * 3);
+        zero_.assign(stride, 0);
+        rows_[0].resize(color_ == kRGB ? 0 : stride);
+        rows_[1].resize(rows_[0].size());
+
+        window_.resize(kHistory + rowBytes + std::max(kSpan, 2 * rowBytes) + kSlack);
+        const size_t limit = window_.size() - kSlack;
+        pos_ = 0;
+        size_t rowStart = 0;
+        int row = 0;
+
+        span_ = 0;
+        in_ = spans_[0].data;
+        inEnd_ = in_ + spans_[0].size;
+        bits_ = 0;
+        count_ = 0;
+        overrun_ = 0;
+        state_ = kHeader;
+        final_ = false;
+        if (!zlibHeader()) return false;
+
+        for (;;) {
+            if (!inflate(limit)) return false;
+            for (; row < h_ && pos_ - rowStart >= rowBytes; ++row, rowStart += rowBytes)
+                if (!emitRow(row, &window_[rowStart], rgb)) return false;
+            if (row == h_) rowStart = pos_;  // trailing data: inflated, checked, dropped
+            if (state_ == kDone) break;
+            // keep 32 KB of history and the partial row
+            const size_t from = std::min(rowStart, pos_ > kHistory ? pos_ - kHistory : 0);
+            std::memmove(window_.data(), window_.data() + from, pos_ - from);
+            pos_ -= from;
+            rowStart -= from;
+        }
+        // the stream must end within the data (zeros past it are only padding)
+        return row == h_ && overrun_ * 8 <= count_;
+    }
+
+    int width() const { return w_; }
+    int height() const { return h_; }
+    int channels() const { return channels_; }  // of the source, as stb_image reports them
+
+private:
+    struct Span {
+        const uint8_t* data;
+        size_t size;
+    };
+
+    enum Color { kGray = 0, kRGB = 2, kPalette = 3, kGrayAlpha = 4, kRGBA = 6 };
+    enum State { kHeader, kStored, kHuffman, kDone };
+    // table entry: bits 0-7 code length, 8-11 kind, 12-15 extra bits (or
+    // subtable index bits), 16-31 literal(s), base value or subtable offset
+    enum Kind { kInvalid = 0, kLiteral, kPair, kMatch, kEnd, kSub };
+
+    static constexpr size_t kHistory = 32768;
+    static constexpr size_t kSpan = size_t(1) << 18;
+    static constexpr size_t kSlack = 258 + 2 + 16;  // longest match, a pair, copy overrun
+    static constexpr int kLitBits = 11, kDistBits = 8;
+
+    // ---------- chunks ----------
+    static uint32_t be32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+
+    // Walks the chunks as stb_image does and collects what decode needs.
+    bool scan(const uint8_t* p, size_t size) {
+        static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+        if (size < 8 || std::memcmp(p, signature, 8) != 0) return false;
+        spans_.clear();
+        paletteSize_ = 0;
+        bool header = false, trns = false;
+        for (size_t pos = 8;;) {
+            if (size - pos < 12) return false;
+            const uint32_t length = be32(p + pos), type = be32(p + pos + 4);
+            const uint8_t* data = p + pos + 8;
+            if (length > size - pos - 12) return false;
+            pos += 12 + size_t(length);
+            if (!header && type != chunk("IHDR")) return false;
+
+            if (type == chunk("IHDR")) {
+                if (header || length != 13) return false;
+                header = true;
+                const uint32_t w = be32(data), h = be32(data + 4);
+                color_ = data[9];
+                // 8-bit non-interlaced only; stb decides everything else
+                if (data[8] != 8 || data[10] != 0 || data[11] != 0 || data[12] != 0) return false;
+                if (color_ != kGray && color_ != kRGB && color_ != kPalette && color_ != kGrayAlpha && color_ != kRGBA)
+                    return false;
+                if (w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24)) return false;
+                bpp_ = color_ == kRGB ? 3 : color_ == kRGBA ? 4 : color_ == kGrayAlpha ? 2 : 1;
+                if ((1u << 30) / w / (color_ == kPalette ? 4 : bpp_) < h) return false;
+                w_ = static_cast<int>(w);
+                h_ = static_cast<int>(h);
+            } else if (type == chunk("PLTE")) {
+                if (length > 768 || length % 3 != 0) return false;
+                paletteSize_ = length / 3;
+                std::memcpy(palette_, data, length);
+            } else if (type == chunk("tRNS")) {
+                if (!spans_.empty()) return false;
+                if (color_ == kPalette) {
+                    if (paletteSize_ == 0 || length > paletteSize_) return false;
+                } else if (color_ != kGray && color_ != kRGB) {
+                    return false;
+                } else if (length != uint32_t(bpp_) * 2) {
+                    return false;
+                }
+                trns = true;
+            } else if (type == chunk("IDAT")) {
+                if (color_ == kPalette && paletteSize_ == 0) return false;
+                if (length > (1u << 30)) return false;
+                if (length > 0) spans_.push_back({data, length});
+            } else if (type == chunk("IEND")) {
+                break;
+            } else if ((type & (1u << 29)) == 0) {
+                return false;  // unknown critical chunk (CgBI included)
+            }
+        }
+        if (spans_.empty()) return false;
+        channels_ = color_ == kPalette ? (trns ? 4 : 3) : bpp_ + (trns ? 1 : 0);
+        return true;
+    }
+
+    static constexpr uint32_t chunk(const char (&t)[5]) {
+        return (uint32_t(uint8_t(t[0])) << 24) | (uint32_t(uint8_t(t[1])) << 16) |
+               (uint32_t(uint8_t(t[2])) << 8) | uint32_t(uint8_t(t[3]));
+    }
+
+    // ---------- bit input across IDAT chunks ----------
+    bool nextSpan() {
+        if (span_ + 1 >= spans_.size()) return false;
+        ++span_;
+        in_ = spans_[span_].data;
+        inEnd_ = in_ + spans_[span_].size;
+        return true;
+    }
+
+    // At least 56 bits in the buffer; past the last chunk zeros are fed in
+    // and counted, and decode() fails if any of them was consumed.
+    void refill() {
+        if (count_ > 56) return;
+        if (inEnd_ - in_ >= 8) {
+            uint64_t v;
+            std::memcpy(&v, in_, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            v = __builtin_bswap64(v);
+#endif
+            bits_ |= v << count_;
+            in_ += (63 - count_) >> 3;
+            count_ |= 56;
+            return;
+        }
+        while (count_ <= 56) {
+            if (in_ == inEnd_ && !nextSpan()) {
+                ++overrun_;
+                count_ += 8;
+                continue;
+            }
+            bits_ |= uint64_t(*in_++) << count_;
+            count_ += 8;
+        }
+    }
+
+    uint32_t take(unsigned n) {  // n <= count_
+        const uint32_t v = static_cast<uint32_t>(bits_ & ((uint64_t(1) << n) - 1));
+        bits_ >>= n;
+        count_ -= n;
+        return v;
+    }
+
+    bool zlibHeader() {
+        refill();
+        const uint32_t cmf = take(8), flg = take(8);
+        return (cmf * 256 + flg) % 31 == 0 && !(flg & 32) && (cmf & 15) == 8;
+    }
+
+    // ---------- Huffman tables ----------
+    static uint32_t entry(Kind kind, uint32_t payload, unsigned extra = 0) {
+        return (payload << 16) | (extra << 12) | (uint32_t(kind) << 8);
+    }
+
+    static uint32_t litlenEntry(int symbol) {
+        static const uint16_t base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        if (symbol < 256) return entry(kLiteral, static_cast<uint32_t>(symbol));
+        if (symbol == 256) return entry(kEnd, 0);
+        if (symbol <= 285) return entry(kMatch, base[symbol - 257], extra[symbol - 257]);
+        return entry(kInvalid, 0);
+    }
+
+    static uint32_t distEntry(int symbol) {
+        static const uint16_t base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                          8193, 12289, 16385, 24577};
+        static const uint8_t extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                          7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        if (symbol < 30) return entry(kMatch, base[symbol], extra[symbol]);
+        return entry(kInvalid, 0);
+    }
+
+    // Canonical code lengths -> 2^tableBits first-level entries, plus one
+    // subtable per prefix of the longer codes. false if over-subscribed.
+    template <typename EntryFor>
+    static bool buildTable(const uint8_t* lengths, int count, int tableBits, std::vector<uint32_t>& table,
+                           EntryFor entryFor) {
+        int lengthCount[16] = {0};
+        for (int s = 0; s < count; ++s) ++lengthCount[lengths[s]];
+        lengthCount[0] = 0;
+        int left = 1, maxLength = 0;
+        for (int len = 1; len < 16; ++len) {
+            left = (left << 1) - lengthCount[len];
+            if (left < 0) return false;
+            if (lengthCount[len]) maxLength = len;
+        }
+        int next[16] = {0};
+        for (int len = 1, code = 0; len < 16; ++len) {
+            code = (code + lengthCount[len - 1]) << 1;
+            next[len] = code;
+        }
+
+        const int subBits = std::max(0, maxLength - tableBits);
+        const uint32_t mainSize = 1u << tableBits;
+        table.assign(mainSize, 0);
+        std::vector<int> subtable(mainSize, -1);
+        for (int s = 0; s < count; ++s) {
+            const int len = lengths[s];
+            if (len == 0) continue;
+            uint32_t code = static_cast<uint32_t>(next[len]++), rev = 0;
+            for (int i = 0; i < len; ++i, code >>= 1) rev = (rev << 1) | (code & 1);
+            if (len <= tableBits) {
+                for (uint32_t i = rev; i < mainSize; i += 1u << len) table[i] = entryFor(s) | uint32_t(len);
+                continue;
+            }
+            const uint32_t prefix = rev & (mainSize - 1);
+            if (subtable[prefix] < 0) {
+                subtable[prefix] = static_cast<int>(table.size());
+                table.resize(table.size() + (size_t(1) << subBits), 0);
+                table[prefix] = entry(kSub, static_cast<uint32_t>(subtable[prefix]), static_cast<unsigned>(subBits)) |
+                                uint32_t(tableBits);
+            }
+            const int subLength = len - tableBits;
+            for (uint32_t i = rev >> tableBits; i < (1u << subBits); i += 1u << subLength)
+                table[subtable[prefix] + i] = entryFor(s) | uint32_t(subLength);
+        }
+        return true;
+    }
+
+    // Two literals per lookup where both codes fit in the first level.
+    static void pairLiterals(std::vector<uint32_t>& table) {
+        const std::vector<uint32_t> single(table.begin(), table.begin() + (1 << kLitBits));
+        for (uint32_t i = 0; i < single.size(); ++i) {
+            const uint32_t first = single[i], len1 = first & 0xFF;
+            if (((first >> 8) & 15) != kLiteral || len1 >= kLitBits) continue;
+            const uint32_t second = single[i >> len1], len2 = second & 0xFF;
+            if (((second >> 8) & 15) != kLiteral || len1 + len2 > kLitBits) continue;
+            table[i] = entry(kPair, (first >> 16) | ((second >> 16) << 8)) | (len1 + len2);
+        }
+    }
+
+    bool buildTables(const uint8_t* lengths, int litCount, int distCount) {
+        if (!buildTable(lengths, litCount, kLitBits, lit_, litlenEntry)) return false;
+        if (!buildTable(lengths + litCount, distCount, kDistBits, dist_, distEntry)) return false;
+        pairLiterals(lit_);
+        return true;
+    }
+
+    bool fixedTables() {
+        uint8_t lengths[288 + 32];
+        std::fill(lengths, lengths + 144, 8);
+        std::fill(lengths + 144, lengths + 256, 9);
+        std::fill(lengths + 256, lengths + 280, 7);
+        std::fill(lengths + 280, lengths + 288, 8);
+        std::fill(lengths + 288, lengths + 320, 5);
+        return buildTables(lengths, 288, 32);
+    }
+
+    bool dynamicTables() {
+        static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        refill();
+        const int litCount = static_cast<int>(take(5)) + 257, distCount = static_cast<int>(take(5)) + 1;
+        const int codeCount = static_cast<int>(take(4)) + 4;
+        uint8_t codeLengths[19] = {0};
+        for (int i = 0; i < codeCount; ++i) {
+            refill();
+            codeLengths[order[i]] = static_cast<uint8_t>(take(3));
+        }
+        std::vector<uint32_t> codes;
+        if (!buildTable(codeLengths, 19, 7, codes, [](int s) { return entry(kLiteral, static_cast<uint32_t>(s)); }))
+            return false;
+
+        uint8_t lengths[288 + 32] = {0};
+        for (int n = 0; n < litCount + distCount;) {
+            refill();
+            const uint32_t e = codes[bits_ & 127];
+            if (((e >> 8) & 15) != kLiteral) return false;
+            take(e & 0xFF);
+            const uint32_t symbol = e >> 16;
+            int repeat = 1;
+            uint8_t value = static_cast<uint8_t>(symbol);
+            if (symbol == 16) {
+                if (n == 0) return false;
+                value = lengths[n - 1];
+                repeat = 3 + static_cast<int>(take(2));
+            } else if (symbol == 17) {
+                value = 0;
+                repeat = 3 + static_cast<int>(take(3));
+            } else if (symbol == 18) {
+                value = 0;
+                repeat = 11 + static_cast<int>(take(7));
+            }
+            if (n + repeat > litCount + distCount) return false;
+            std::fill(lengths + n, lengths + n + repeat, value);
+            n += repeat;
+        }
+        return buildTables(lengths, litCount, distCount);
+    }
+
+    // ---------- inflate ----------
+    // Inflates into window_ until pos_ reaches 'limit' or the stream ends
+    // (state_ == kDone); false on corrupt data.
+    bool inflate(size_t limit) {
+        uint8_t* const out = window_.data();
+        while (pos_ < limit) {
+            if (state_ == kHeader) {
+                if (final_) {
+                    state_ = kDone;
+                    return true;
+                }
+                refill();
+                final_ = take(1) != 0;
+                const uint32_t type = take(2);
+                if (type == 0) {
+                    take(count_ & 7);
+                    const uint32_t length = take(16), check = take(16);
+                    if ((length ^ 0xFFFF) != check) return false;
+                    stored_ = length;
+                    state_ = kStored;
+                } else if ((type == 1 && fixedTables()) || (type == 2 && dynamicTables())) {
+                    state_ = kHuffman;
+                } else {
+                    return false;
+                }
+                continue;
+            }
+
+            if (state_ == kStored) {
+                while (stored_ > 0 && pos_ < limit) {
+                    if (count_ >= 8) {
+                        out[pos_++] = static_cast<uint8_t>(take(8));
+                        --stored_;
+                        continue;
+                    }
+                    bits_ = 0;  // empty and byte-aligned: copy straight from the chunk
+                    if (in_ == inEnd_ && !nextSpan()) return false;
+                    const size_t n = std::min({size_t(stored_), limit - pos_, size_t(inEnd_ - in_)});
+                    std::memcpy(out + pos_, in_, n);
+                    in_ += n;
+                    pos_ += n;
+                    stored_ -= static_cast<uint32_t>(n);
+                }
+                if (stored_ == 0) state_ = kHeader;
+                continue;
+            }
+
+            // Huffman block: one refill covers a literal/length code with its
+            // extra bits and a distance code with its extra bits (<= 48 bits)
+            while (pos_ < limit) {
+                refill();
+                uint32_t e = lit_[bits_ & ((1u << kLitBits) - 1)];
+                if (((e >> 8) & 15) == kSub) {
+                    take(kLitBits);
+                    e = lit_[(e >> 16) + (bits_ & ((1u << ((e >> 12) & 15)) - 1))];
+                }
+                take(e & 0xFF);
+                const uint32_t kind = (e >> 8) & 15;
+                if (kind == kLiteral) {
+                    out[pos_++] = static_cast<uint8_t>(e >> 16);
+                } else if (kind == kPair) {
+                    out[pos_] = static_cast<uint8_t>(e >> 16);
+                    out[pos_ + 1] = static_cast<uint8_t>(e >> 24);
+                    pos_ += 2;
+                } else if (kind == kMatch) {
+                    const size_t length = (e >> 16) + take((e >> 12) & 15);
+                    uint32_t d = dist_[bits_ & ((1u << kDistBits) - 1)];
+                    if (((d >> 8) & 15) == kSub) {
+                        take(kDistBits);
+                        d = dist_[(d >> 16) + (bits_ & ((1u << ((d >> 12) & 15)) - 1))];
+                    }
+                    take(d & 0xFF);
+                    if (((d >> 8) & 15) != kMatch) return false;
+                    const size_t distance = (d >> 16) + take((d >> 12) & 15);
+                    if (distance > pos_) return false;
+                    copyMatch(out + pos_, distance, length);
+                    pos_ += length;
+                } else if (kind == kEnd) {
+                    state_ = kHeader;
+                    break;
+                } else {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Copies a match of 'length' bytes from 'distance' back; may write up to
+    // 16 bytes past the end (into kSlack).
+    static void copyMatch(uint8_t* dst, size_t distance, size_t length) {
+        const uint8_t* src = dst - distance;
+        if (distance >= 8) {
+            for (size_t i = 0; i < length; i += 8) {
+                uint64_t v;
+                std::memcpy(&v, src + i, 8);
+                std::memcpy(dst + i, &v, 8);
+            }
+        } else if (distance == 1) {
+            std::memset(dst, *src, length);
+        } else {  // only the first 'distance' bytes of each load are final yet
+            for (size_t i = 0; i < length; i += distance) {
+                uint64_t v;
+                std::memcpy(&v, src + i, 8);
+                std::memcpy(dst + i, &v, 8);
+            }
+        }
+    }
+
+    // ---------- rows ----------
+    bool emitRow(int row, const uint8_t* raw, std::vector<uint8_t>& rgb) {
+        const size_t stride = size_t(w_) * bpp_;
+        uint8_t* dst = rgb.data() + size_t(row) * w_ * 3;
+        const uint8_t* prior;
+        uint8_t* cur;
+        if (color_ == kRGB) {  // unfiltered in place in the output
+            prior = row ? dst - stride : zero_.data();
+            cur = dst;
+        } else {
+            prior = row ? rows_[(row - 1) & 1].data() : zero_.data();
+            cur = rows_[row & 1].data();
+        }
+        if (!unfilterRow(raw[0], raw + 1, prior, cur, stride, bpp_)) return false;
+
+        const size_t n = size_t(w_);
+        switch (color_) {
+        case kRGB:
+            break;
+        case kRGBA:
+            for (size_t i = 0; i < n; ++i) std::memcpy(dst + i * 3, cur + i * 4, 3);
+            break;
+        case kGray:
+        case kGrayAlpha:
+            for (size_t i = 0; i < n; ++i) dst[i * 3] = dst[i * 3 + 1] = dst[i * 3 + 2] = cur[i * bpp_];
+            break;
+        case kPalette:
+            for (size_t i = 0; i < n; ++i) {
+                if (cur[i] >= paletteSize_) return false;  // stb reads whatever is in its table there
+                std::memcpy(dst + i * 3, palette_ + cur[i] * 3, 3);
+            }
+            break;
+        }
+        return true;
+    }
+
+    IMGC_MULTIVERSION
+    static void unfilterUp(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n) {
+        for (size_t i = 0; i < n; ++i) cur[i] = static_cast<uint8_t>(raw[i] + prior[i]);
+    }
+
+    // The spec's predictor in stb_image's branch-free form.
+    static int paeth(int a, int b, int c) {
+        const int thresh = c * 3 - (a + b);
+        const int lo = a < b ? a : b, hi = a < b ? b : a;
+        return thresh <= lo ? hi : hi <= thresh ? lo : c;
+    }
+
+    static bool unfilterRow(int filter, const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n, int bpp) {
+        if (filter > 4) return false;
+        if (filter == 0) {
+            std::memcpy(cur, raw, n);
+            return true;
+        }
+        if (filter == 2) {
+            unfilterUp(raw, prior, cur, n);
+            return true;
+        }
+        // Sub, Avg and Paeth chain through the byte 'bpp' to the left, so
+        // they stay scalar; one loop per filter keeps the branch out of it
+        const size_t first = std::min(n, size_t(bpp));
+        for (size_t i = 0; i < first; ++i)
+            cur[i] = static_cast<uint8_t>(raw[i] + (filter == 3 ? prior[i] >> 1 : filter == 4 ? prior[i] : 0));
+        if (filter == 1) {
+            for (size_t i = first; i < n; ++i) cur[i] = static_cast<uint8_t>(raw[i] + cur[i - bpp]);
+        } else if (filter == 3) {
+            for (size_t i = first; i < n; ++i) cur[i] = static_cast<uint8_t>(raw[i] + ((cur[i - bpp] + prior[i]) >> 1));
+        } else {
+            for (size_t i = first; i < n; ++i)
+                cur[i] = static_cast<uint8_t>(raw[i] + paeth(cur[i - bpp], prior[i], prior[i - bpp]));
+        }
+        return true;
+    }
+
+    int w_ = 0, h_ = 0, bpp_ = 0, color_ = 0, channels_ = 0;
+    uint8_t palette_[768];
+    uint32_t paletteSize_ = 0;
+    std::vector<Span> spans_;
+    std::vector<uint8_t> window_, zero_, rows_[2];
+    std::vector<uint32_t> lit_, dist_;
+
+    size_t span_ = 0;
+    const uint8_t* in_ = nullptr;
+    const uint8_t* inEnd_ = nullptr;
+    uint64_t bits_ = 0;
+    unsigned count_ = 0;
+    size_t overrun_ = 0;
+
+    State state_ = kHeader;
+    bool final_ = false;
+    uint32_t stored_ = 0;
+    size_t pos_ = 0;
+};
+
+#endif // IMGC_PNG_DECODE_H
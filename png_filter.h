@@ -0,0 +1,166 @@
+// png_filter.h
+// PNG scanline filtering for the encoders (stb_image_write through
+// STBIW_FILTER_ROW, lodepng's filter(), the shard encoder).
+//
+// stb and lodepng write every candidate filter byte by byte into a scratch
+// row and then sum it again in a second loop to score it: ten passes per
+// row at the default adaptive setting. On the encoder side a filter only
+// reads the original pixels, so there is no left-to-right dependency: each
+// kernel here does Sub, Up, Avg or Paeth 16 bytes per SSE2 vector (Paeth in
+// 16-bit lanes) and scores the result in the same pass with psadbw.
+//
+// Scores reproduce the encoders' own heuristics exactly, so the chosen
+// filters - and the output bytes - do not change:
+//   SignedSum  sum of |filtered byte as signed char|     (stb_image_write)
+//   MinSum     same, but 255 - s for bytes >= 128, and
+//              the plain byte sum for filter 0           (lodepng LFS_MINSUM)
+// Ties go to the lower filter type in both.
+
+#ifndef IMGC_PNG_FILTER_H
+#define IMGC_PNG_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+class PngFilter {
+public:
+    enum class Score { SignedSum, MinSum };
+
+    // Filters 'length' bytes of 'row' ('bpp' bytes per pixel) with PNG filter
+    // 'type' into 'out' and returns its score. 'prior' is the row above, or
+    // nullptr for the first row (read as zeros, as the PNG spec says).
+    static uint64_t apply(int type, const uint8_t* row, const uint8_t* prior, uint8_t* out,
+                          size_t length, size_t bpp, Score score) {
+        Sums s;
+        switch (type) {
+        case 1: s = prior ? run<1, true>(row, prior, out, length, bpp) : run<1, false>(row, prior, out, length, bpp); break;
+        case 2: s = prior ? run<2, true>(row, prior, out, length, bpp) : run<2, false>(row, prior, out, length, bpp); break;
+        case 3: s = prior ? run<3, true>(row, prior, out, length, bpp) : run<3, false>(row, prior, out, length, bpp); break;
+        case 4: s = prior ? run<4, true>(row, prior, out, length, bpp) : run<4, false>(row, prior, out, length, bpp); break;
+        default: s = run<0, false>(row, prior, out, length, bpp); break;
+        }
+        if (score == Score::SignedSum) return s.magnitude;
+        return type == 0 ? s.plain : s.magnitude - s.negative;
+    }
+
+    // Tries the five filters and leaves the best-scoring one in 'out';
+    // returns its type. 'scratch' holds 2 * length bytes.
+    static int choose(const uint8_t* row, const uint8_t* prior, uint8_t* out, size_t length, size_t bpp,
+                      Score score, uint8_t* scratch) {
+        uint8_t* buffers[3] = {out, scratch, scratch + length};
+        int best = 0, bestBuffer = 0;
+        uint64_t bestScore = apply(0, row, prior, out, length, bpp, score);
+        for (int type = 1; type < 5; ++type) {
+            const int free = bestBuffer == 1 ? 2 : 1;
+            const uint64_t s = apply(type, row, prior, buffers[free], length, bpp, score);
+            if (s < bestScore) {
+                bestScore = s;
+                best = type;
+                bestBuffer = free;
+            }
+        }
+        if (bestBuffer) std::memcpy(out, buffers[bestBuffer], length);
+        return best;
+    }
+
+private:
+    struct Sums {
+        uint64_t magnitude = 0, negative = 0, plain = 0;
+
+        void add(uint8_t x, uint8_t d) {
+            const int v = static_cast<int8_t>(d);
+            magnitude += static_cast<uint64_t>(v < 0 ? -v : v);
+            negative += v < 0;
+            plain += x;
+        }
+    };
+
+    static uint8_t paeth(int a, int b, int c) {
+        const int pa = b > c ? b - c : c - b, pb = a > c ? a - c : c - a;
+        const int pc = a + b - 2 * c < 0 ? 2 * c - a - b : a + b - 2 * c;
+        return static_cast<uint8_t>((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+    }
+
+    template <int Type>
+    static uint8_t predict(int a, int b, int c) {
+        return Type == 1 ? static_cast<uint8_t>(a) : Type == 2 ? static_cast<uint8_t>(b)
+             : Type == 3 ? static_cast<uint8_t>((a + b) >> 1) : Type == 4 ? paeth(a, b, c) : 0;
+    }
+
+#if defined(__SSE2__)
+    static __m128i load(const uint8_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+
+    // Paeth on eight 16-bit lanes: the first of a, b, c nearest to a + b - c.
+    static __m128i paeth16(__m128i a, __m128i b, __m128i c) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+        const __m128i smallest = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+        const __m128i useA = _mm_cmpeq_epi16(smallest, pa), useB = _mm_cmpeq_epi16(smallest, pb);
+        const __m128i bc = _mm_or_si128(_mm_and_si128(useB, b), _mm_andnot_si128(useB, c));
+        return _mm_or_si128(_mm_and_si128(useA, a), _mm_andnot_si128(useA, bc));
+    }
+
+    template <int Type>
+    static __m128i predict16(__m128i a, __m128i b, __m128i c) {
+        const __m128i zero = _mm_setzero_si128();
+        if (Type == 1) return a;
+        if (Type == 2) return b;
+        if (Type == 3)  // floor((a + b) / 2): pavgb rounds up, so drop the odd bit
+            return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        if (Type == 4) {
+            const __m128i lo = paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+            const __m128i hi = paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+            return _mm_packus_epi16(lo, hi);
+        }
+        return zero;
+    }
+#endif
+
+    template <int Type, bool HasPrior>
+    static Sums run(const uint8_t* row, const uint8_t* prior, uint8_t* out, size_t length, size_t bpp) {
+        Sums s;
+        size_t i = 0;
+        for (; i < bpp && i < length; ++i) {  // no left neighbour: a = c = 0
+            out[i] = static_cast<uint8_t>(row[i] - predict<Type>(0, HasPrior ? prior[i] : 0, 0));
+            s.add(row[i], out[i]);
+        }
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+        __m128i magnitude = zero, negative = zero, plain = zero;
+        for (; i + 16 <= length; i += 16) {
+            const __m128i x = load(row + i);
+            const __m128i a = Type == 1 || Type == 3 || Type == 4 ? load(row + i - bpp) : zero;
+            const __m128i b = HasPrior && Type >= 2 ? load(prior + i) : zero;
+            const __m128i c = HasPrior && Type == 4 ? load(prior + i - bpp) : zero;
+            const __m128i d = _mm_sub_epi8(x, predict16<Type>(a, b, c));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), d);
+            magnitude = _mm_add_epi64(magnitude, _mm_sad_epu8(_mm_min_epu8(d, _mm_sub_epi8(zero, d)), zero));
+            negative = _mm_add_epi64(negative, _mm_sad_epu8(_mm_and_si128(_mm_cmplt_epi8(d, zero), one), zero));
+            if (Type == 0) plain = _mm_add_epi64(plain, _mm_sad_epu8(x, zero));
+        }
+        auto total = [](__m128i v) {
+            return uint64_t(uint32_t(_mm_cvtsi128_si32(v))) + uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+        };
+        s.magnitude += total(magnitude);
+        s.negative += total(negative);
+        s.plain += total(plain);
+#endif
+        for (; i < length; ++i) {
+            out[i] = static_cast<uint8_t>(row[i] - predict<Type>(row[i - bpp], HasPrior ? prior[i] : 0,
+                                                                 HasPrior ? prior[i - bpp] : 0));
+            s.add(row[i], out[i]);
+        }
+        return s;
+    }
+};
+
+#endif // IMGC_PNG_FILTER_H
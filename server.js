@@ -4,6 +4,12 @@ const { spawn } = require('child_process');
 const path = require('path');
 const fs = require('fs');
 const cors = require('cors');
+const crypto = require('crypto');
+const os = require('os');
+const { CompressDaemon } = require('./daemon');
+const { SingleFlight } = require('./singleflight');
+const { AdaptiveLimiter } = require('./limiter');
+const { WorkerPool } = require('./workerpool');
 
 const app = express();
 const PORT = process.env.PORT || 3000;
@@ -32,23 +38,141 @@ const storage = multer.diskStorage({
     }
 });
 
+function imageFilter(req, file, cb) {
+    const allowedTypes = /jpeg|jpg|png/;
+    const extname = allowedTypes.test(path.extname(file.originalname).toLowerCase());
+    const mimetype = allowedTypes.test(file.mimetype);
+
+    if (mimetype && extname) {
+        return cb(null, true);
+    } else {
+        cb(new Error('Only PNG, JPG, and JPEG images are allowed!'));
+    }
+}
+
 const upload = multer({
     storage: storage,
     limits: { fileSize: 50 * 1024 * 1024 },
-    fileFilter: function (req, file, cb) {
-        const allowedTypes = /jpeg|jpg|png/;
-        const extname = allowedTypes.test(path.extname(file.originalname).toLowerCase());
-        const mimetype = allowedTypes.test(file.mimetype);
+    fileFilter: imageFilter
+});
 
-        if (mimetype && extname) {
-            return cb(null, true);
-        } else {
-            cb(new Error('Only PNG, JPG, and JPEG images are allowed!'));
-        }
+// /compress keeps the upload in memory: it is written once, into a worker's
+// shared ring (see workerpool.js), and only touches disk on the fallback path.
+const uploadToMemory = multer({
+    storage: multer.memoryStorage(),
+    limits: { fileSize: 50 * 1024 * 1024 },
+    fileFilter: imageFilter
+});
+
+function compressorBinary() {
+    return path.join(__dirname, process.platform === 'win32' ? 'compress.exe' : 'compress');
+}
+
+function removeOutput(filename) {
+    try {
+        const filepath = path.join(outputsDir, filename);
+        if (fs.existsSync(filepath)) fs.unlinkSync(filepath);
+    } catch (err) {
+        console.error('Error cleaning up output file:', err);
     }
+}
+
+// ---------- admission control ----------
+// Compressor jobs are admitted through an adaptive concurrency limit
+// (limiter.js) so bursts queue, or are shed with 503, instead of thrashing the
+// CPU: one-shot /compress runs, and session opens and full-size session
+// compresses in the daemon. COMPRESS_MAX_CONCURRENCY caps the window.
+const limiter = new AdaptiveLimiter({
+    maxLimit: parseInt(process.env.COMPRESS_MAX_CONCURRENCY, 10) || undefined
+});
+
+// ---------- request coalescing ----------
+// Identical uploads arriving together (a campaign banner posted by many
+// clients at once) share one compressor run: jobs are keyed by the input's
+// SHA-256 plus the parameters, and every request attached to an in-flight job
+// gets its output.
+const inflightJobs = new SingleFlight();
+
+// ---------- compressor options ----------
+// COMPRESS_INTERLACE (off|on|auto, default auto) selects Adam7 PNG output: with
+// auto only large images are interlaced, where a coarse first pass on screen
+// early is worth the larger file.
+const compressorOptions = ['--interlace=' + (process.env.COMPRESS_INTERLACE || 'auto')];
+
+// ---------- shared-memory workers ----------
+// COMPRESS_WORKERS long-running compressors, each with a COMPRESS_RING_MB
+// shared ring for uploads and outputs.
+const workers = new WorkerPool(compressorBinary(), {
+    workers: parseInt(process.env.COMPRESS_WORKERS, 10) || os.cpus().length || 1,
+    ringMB: parseInt(process.env.COMPRESS_RING_MB, 10) || 128,
+    spillDir: outputsDir
 });
 
-app.post('/compress', upload.single('image'), async (req, res) => {
+// Compresses an in-memory upload through a ring worker, or by spawning a
+// compressor on a temporary file where the ring is unavailable.
+async function compressUpload(file, format, quality) {
+    const outputFilename = `compressed-${Date.now()}-${Math.round(Math.random() * 1E9)}.${format}`;
+    try {
+        const { outputSize, log } = await workers.run(file.buffer, format, quality, outputFilename, compressorOptions);
+        console.log('[C++]:', log);
+        return { code: 0, stdout: log, stderr: '', outputFilename, outputSize };
+    } catch (err) {
+        if (!err.fallback) {
+            console.error('[C++ Error]:', err.message);
+            return { code: 1, stdout: '', stderr: err.message, outputFilename, outputSize: null };
+        }
+    }
+    const inputPath = path.join(uploadsDir, `${Date.now()}-${Math.round(Math.random() * 1E9)}${path.extname(file.originalname)}`);
+    fs.writeFileSync(inputPath, file.buffer);
+    try {
+        return await runCompressor(compressorBinary(), inputPath, format, quality);
+    } finally {
+        try {
+            fs.unlinkSync(inputPath);
+        } catch (err) {
+            console.error('Error deleting input file:', err);
+        }
+    }
+}
+
+// Runs the compressor once; resolves with its exit code, output and log.
+function runCompressor(compressorPath, inputPath, format, quality) {
+    const outputFilename = `compressed-${Date.now()}-${Math.round(Math.random() * 1E9)}.${format}`;
+    const outputPath = path.join(outputsDir, outputFilename);
+
+    return new Promise((resolve, reject) => {
+        const compressProcess = spawn(compressorPath, [inputPath, outputPath, quality.toString(), ...compressorOptions]);
+
+        let stdout = '';
+        let stderr = '';
+
+        compressProcess.stdout.on('data', (data) => {
+            stdout += data.toString();
+            console.log('[C++]:', data.toString());
+        });
+
+        compressProcess.stderr.on('data', (data) => {
+            stderr += data.toString();
+            console.error('[C++ Error]:', data.toString());
+        });
+
+        compressProcess.on('close', (code) => {
+            console.log('C++ process exited with code:', code);
+            const outputSize = fs.existsSync(outputPath) ? fs.statSync(outputPath).size : null;
+            if (outputSize !== null) {
+                setTimeout(() => removeOutput(outputFilename), 10 * 60 * 1000);
+            }
+            resolve({ code, stdout, stderr, outputFilename, outputSize });
+        });
+
+        compressProcess.on('error', (err) => {
+            console.error('Failed to start compress process:', err);
+            reject(new Error('Failed to start compression process: ' + err.message));
+        });
+    });
+}
+
+app.post('/compress', uploadToMemory.single('image'), async (req, res) => {
     if (!req.file) {
         return res.status(400).json({ error: 'No file uploaded' });
     }
@@ -64,24 +188,17 @@ app.post('/compress', upload.single('image'), async (req, res) => {
         return res.status(400).json({ error: 'Format must be jpg or png' });
     }
 
-    const inputPath = req.file.path;
-    const outputFilename = `compressed-${Date.now()}.${format}`;
-    const outputPath = path.join(outputsDir, outputFilename);
-
-    const isWindows = process.platform === 'win32';
-    const compressorPath = path.join(__dirname, isWindows ? 'compress.exe' : 'compress');
+    const compressorPath = compressorBinary();
 
     console.log('=== Compression Request ===');
     console.log('Platform:', process.platform);
     console.log('Compressor path:', compressorPath);
-    console.log('Input:', inputPath);
-    console.log('Output:', outputPath);
+    console.log('Input:', req.file.originalname, `(${req.file.size} bytes)`);
     console.log('Quality:', quality);
     console.log('Format:', format);
 
     if (!fs.existsSync(compressorPath)) {
         console.error('Compressor not found at:', compressorPath);
-        fs.unlinkSync(inputPath);
         return res.status(500).json({ 
             error: 'Compression binary not found on server',
             path: compressorPath,
@@ -89,102 +206,227 @@ app.post('/compress', upload.single('image'), async (req, res) => {
         });
     }
 
-    console.log('Compressor found, starting compression...');
-
-    const compressProcess = spawn(compressorPath, [inputPath, outputPath, quality.toString()]);
-
-    let stdout = '';
-    let stderr = '';
+    let job;
+    try {
+        const inputHash = crypto.createHash('sha256').update(req.file.buffer).digest('hex');
+        const { promise, shared } = inflightJobs.run(`${inputHash}:${quality}:${format.toLowerCase()}`,
+            () => limiter.run(() => compressUpload(req.file, format, quality),
+                              req.file.size / (1024 * 1024)));
+        if (shared) {
+            console.log('Coalesced with in-flight job for', inputHash.slice(0, 12));
+        } else {
+            console.log('Compressor found, starting compression...');
+        }
+        job = await promise;
+        job.coalesced = shared;
+    } catch (err) {
+        if (err.shed) {
+            res.set('Retry-After', '2');
+        }
+        return res.status(err.shed ? 503 : 500).json({
+            success: false,
+            error: err.message
+        });
+    }
+    if (job.code === 0) {
+        if (job.outputSize !== null) {
+            const inputSize = req.file.size;
+            const outputSize = job.outputSize;
+            const reduction = (((inputSize - outputSize) / inputSize) * 100).toFixed(1);
+
+            console.log('✓ Compression successful');
+            console.log('Input size:', inputSize, 'bytes');
+            console.log('Output size:', outputSize, 'bytes');
+            console.log('Reduction:', reduction + '%');
+
+            res.json({
+                success: true,
+                filename: job.outputFilename,
+                downloadUrl: `/download/${job.outputFilename}`,
+                originalSize: inputSize,
+                compressedSize: outputSize,
+                reduction: reduction,
+                coalesced: job.coalesced,
+                log: job.stdout
+            });
+        } else {
+            res.status(500).json({
+                success: false,
+                error: 'Compression completed but output file not found',
+                log: job.stdout
+            });
+        }
+    } else {
+        res.status(500).json({
+            success: false,
+            error: job.stderr || 'Compression failed',
+            log: job.stdout,
+            exitCode: job.code
+        });
+    }
+});
 
-    compressProcess.stdout.on('data', (data) => {
-        stdout += data.toString();
-        console.log('[C++]:', data.toString());
-    });
+// ---------- slider-preview sessions ----------
+// An upload opens a session in the long-running compressor, which keeps the
+// decoded image and quality-independent intermediates. Each slider move then
+// only re-runs the stages whose parameters changed. Previews encode a cached
+// downscaled copy; the final compress runs at full size. Opens and final
+// compresses go through the limiter like /compress. Previews bypass it: they
+// are small and follow the slider, where a queued or shed frame is worse than
+// a late one, and their latency per input megabyte would drag the limiter's
+// baseline far below that of full-size jobs.
+const SESSION_TTL_MS = 10 * 60 * 1000;
+const PREVIEW_MAX_DIM = 640;
+const sessions = new Map();   // id -> { originalSize, lastUsed, previewFile }
+
+const daemon = new CompressDaemon(compressorBinary(),
+    process.env.SESSION_CACHE_MB ? ['--cache-mb=' + process.env.SESSION_CACHE_MB] : []);
+daemon.onExit = (err) => {
+    console.error(err.message);
+    for (const id of [...sessions.keys()]) dropSession(id);
+};
+
+function dropSession(id) {
+    const session = sessions.get(id);
+    if (!session) return;
+    sessions.delete(id);
+    if (session.previewFile) removeOutput(session.previewFile);
+}
 
-    compressProcess.stderr.on('data', (data) => {
-        stderr += data.toString();
-        console.error('[C++ Error]:', data.toString());
-    });
+setInterval(() => {
+    const now = Date.now();
+    for (const [id, session] of sessions) {
+        if (now - session.lastUsed > SESSION_TTL_MS) {
+            dropSession(id);
+            daemon.close(id).catch(() => {});
+        }
+    }
+}, 60 * 1000).unref();
 
-    compressProcess.on('close', (code) => {
-        console.log('C++ process exited with code:', code);
+app.post('/session', upload.single('image'), async (req, res) => {
+    if (!req.file) {
+        return res.status(400).json({ error: 'No file uploaded' });
+    }
+    if (!fs.existsSync(compressorBinary())) {
+        fs.unlinkSync(req.file.path);
+        return res.status(500).json({ error: 'Compression binary not found on server' });
+    }
 
+    const id = crypto.randomUUID();
+    try {
+        const { width, height } = await limiter.run(() => daemon.open(id, req.file.path),
+                                                    req.file.size / (1024 * 1024));
+        sessions.set(id, { originalSize: req.file.size, lastUsed: Date.now(), previewFile: null });
+        console.log('Session opened:', id, `${width}x${height}`);
+        res.json({ success: true, sessionId: id, width, height, originalSize: req.file.size });
+    } catch (err) {
+        if (err.shed) {
+            res.set('Retry-After', '2');
+        }
+        res.status(err.shed ? 503 : 500).json({ success: false, error: err.message });
+    } finally {
         try {
-            fs.unlinkSync(inputPath);
+            fs.unlinkSync(req.file.path);
         } catch (err) {
             console.error('Error deleting input file:', err);
         }
+    }
+});
 
-        if (code === 0) {
-            if (fs.existsSync(outputPath)) {
-                const inputSize = req.file.size;
-                const outputSize = fs.statSync(outputPath).size;
-                const reduction = (((inputSize - outputSize) / inputSize) * 100).toFixed(1);
-
-                console.log('✓ Compression successful');
-                console.log('Input size:', inputSize, 'bytes');
-                console.log('Output size:', outputSize, 'bytes');
-                console.log('Reduction:', reduction + '%');
-
-                res.json({
-                    success: true,
-                    filename: outputFilename,
-                    downloadUrl: `/download/${outputFilename}`,
-                    originalSize: inputSize,
-                    compressedSize: outputSize,
-                    reduction: reduction,
-                    log: stdout
-                });
-
-                setTimeout(() => {
-                    try {
-                        if (fs.existsSync(outputPath)) {
-                            fs.unlinkSync(outputPath);
-                            console.log('Cleaned up:', outputFilename);
-                        }
-                    } catch (err) {
-                        console.error('Error cleaning up output file:', err);
-                    }
-                }, 10 * 60 * 1000);
-
-            } else {
-                res.status(500).json({
-                    success: false,
-                    error: 'Compression completed but output file not found',
-                    log: stdout
-                });
-            }
+app.post('/session/:id/compress', async (req, res) => {
+    const id = req.params.id;
+    const session = sessions.get(id);
+    if (!session) {
+        return res.status(404).json({ success: false, error: 'Session not found or expired' });
+    }
+
+    const quality = parseFloat(req.body.quality);
+    const format = (req.body.format || 'jpg').toLowerCase();
+    const preview = req.body.preview === true;
+
+    if (!(quality >= 0 && quality <= 1)) {
+        return res.status(400).json({ error: 'Quality must be between 0 and 1' });
+    }
+    if (!['jpg', 'jpeg', 'png'].includes(format)) {
+        return res.status(400).json({ error: 'Format must be jpg or png' });
+    }
+
+    const outputFilename = `${preview ? 'preview' : 'compressed'}-${Date.now()}-${Math.round(Math.random() * 1E9)}.${format}`;
+    const outputPath = path.join(outputsDir, outputFilename);
+    session.lastUsed = Date.now();
+    const started = Date.now();
+
+    try {
+        const { outputSize, log } = preview
+            ? await daemon.compress(id, outputPath, quality, ['--preview=' + PREVIEW_MAX_DIM])
+            : await limiter.run(() => daemon.compress(id, outputPath, quality, []),
+                                session.originalSize / (1024 * 1024));
+        const elapsedMs = Date.now() - started;
+        console.log(`Session ${id}: quality ${quality} ${format}${preview ? ' (preview)' : ''} in ${elapsedMs} ms`);
+
+        if (preview) {
+            // only the latest preview of a session is kept
+            if (session.previewFile) removeOutput(session.previewFile);
+            session.previewFile = outputFilename;
         } else {
-            res.status(500).json({
-                success: false,
-                error: stderr || 'Compression failed',
-                log: stdout,
-                exitCode: code
-            });
+            setTimeout(() => removeOutput(outputFilename), 10 * 60 * 1000);
         }
-    });
 
-    compressProcess.on('error', (err) => {
-        console.error('Failed to start compress process:', err);
-        
-        try {
-            fs.unlinkSync(inputPath);
-        } catch (e) {
-            console.error('Error deleting input file:', e);
+        res.json({
+            success: true,
+            filename: outputFilename,
+            downloadUrl: `/download/${outputFilename}`,
+            originalSize: session.originalSize,
+            compressedSize: outputSize,
+            reduction: (((session.originalSize - outputSize) / session.originalSize) * 100).toFixed(1),
+            preview,
+            elapsedMs,
+            log
+        });
+    } catch (err) {
+        if (err.unknownSession) {
+            // evicted by the compressor's cache budget
+            dropSession(id);
+            return res.status(404).json({ success: false, error: 'Session not found or expired' });
         }
+        if (err.shed) {
+            res.set('Retry-After', '2');
+        }
+        res.status(err.shed ? 503 : 500).json({ success: false, error: err.message });
+    }
+});
 
-        res.status(500).json({
-            success: false,
-            error: 'Failed to start compression process: ' + err.message
-        });
-    });
+app.delete('/session/:id', (req, res) => {
+    const id = req.params.id;
+    if (!sessions.has(id)) {
+        return res.status(404).json({ error: 'Session not found or expired' });
+    }
+    dropSession(id);
+    daemon.close(id).catch(() => {});
+    res.json({ success: true });
 });
 
 app.get('/download/:filename', (req, res) => {
     const filename = req.params.filename;
     const filepath = path.join(outputsDir, filename);
 
-    if (fs.existsSync(filepath)) {
+    const shared = workers.stream(filename);
+    if (shared) {
+        res.set({
+            'Content-Type': path.extname(filename) === '.png' ? 'image/png' : 'image/jpeg',
+            'Content-Length': shared.length,
+            'Content-Disposition': `attachment; filename="${filename}"`
+        });
+        shared.stream.on('error', (err) => {
+            console.error('Error sending file:', err);
+            res.destroy(err);
+        });
+        res.on('close', () => {
+            shared.stream.unpipe(res);
+            shared.done();
+        });
+        shared.stream.pipe(res);
+    } else if (fs.existsSync(filepath)) {
         res.download(filepath, filename, (err) => {
             if (err) {
                 console.error('Error sending file:', err);
@@ -205,6 +447,8 @@ app.get('/health', (req, res) => {
         platform: process.platform,
         compressorPath: compressorPath,
         compressorExists: compressorExists,
+        concurrency: limiter.snapshot(),
+        workers: workers.snapshot(),
         nodeVersion: process.version,
         uptime: process.uptime()
     });
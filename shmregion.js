@@ -0,0 +1,62 @@
+// Offset allocator for a compressor's shared ring (compress --serve
+// --ring-mb=N). Blocks are handed out first-fit from a free list kept sorted
+// by offset and merged with their neighbours when freed. Uploads live for one
+// job while outputs are kept until downloaded, so frees arrive out of order.
+class ShmRegion {
+    constructor(size, align = 64) {
+        this.size = size;
+        this.align = align;
+        this.free = [{ offset: 0, length: size }];
+        this.used = 0;
+        this.blocks = 0;
+    }
+
+    // Returns { offset, length } or null when no free range is large enough.
+    alloc(length) {
+        const want = Math.max(this.align, Math.ceil(length / this.align) * this.align);
+        for (let i = 0; i < this.free.length; i++) {
+            const range = this.free[i];
+            if (range.length < want) continue;
+            const block = { offset: range.offset, length: want };
+            range.offset += want;
+            range.length -= want;
+            if (range.length === 0) this.free.splice(i, 1);
+            this.used += want;
+            this.blocks++;
+            return block;
+        }
+        return null;
+    }
+
+    // Gives back the tail of a block beyond `length` (an output is allocated
+    // at its worst case and trimmed once its size is known).
+    shrink(block, length) {
+        const keep = Math.max(this.align, Math.ceil(length / this.align) * this.align);
+        if (keep >= block.length) return;
+        this.release(block.offset + keep, block.length - keep);
+        block.length = keep;
+    }
+
+    dispose(block) {
+        this.blocks--;
+        this.release(block.offset, block.length);
+    }
+
+    release(offset, length) {
+        this.used -= length;
+        let i = 0;
+        while (i < this.free.length && this.free[i].offset < offset) i++;
+        this.free.splice(i, 0, { offset, length });
+        // merge with the following range, then with the preceding one
+        if (i + 1 < this.free.length && offset + length === this.free[i + 1].offset) {
+            this.free[i].length += this.free[i + 1].length;
+            this.free.splice(i + 1, 1);
+        }
+        if (i > 0 && this.free[i - 1].offset + this.free[i - 1].length === offset) {
+            this.free[i - 1].length += this.free[i].length;
+            this.free.splice(i, 1);
+        }
+    }
+}
+
+module.exports = { ShmRegion };
@@ -0,0 +1,28 @@
+// Single-flight: concurrent calls with the same key share one execution and
+// all receive its result (or its error). The key is forgotten as soon as the
+// execution settles, so later calls run afresh.
+class SingleFlight {
+    constructor() {
+        this.inflight = new Map();
+    }
+
+    // Returns { promise, shared }: shared is true when the call attached to an
+    // execution another caller started.
+    run(key, fn) {
+        const existing = this.inflight.get(key);
+        if (existing) {
+            return { promise: existing, shared: true };
+        }
+        const promise = Promise.resolve()
+            .then(fn)
+            .finally(() => this.inflight.delete(key));
+        this.inflight.set(key, promise);
+        return { promise, shared: false };
+    }
+
+    get size() {
+        return this.inflight.size;
+    }
+}
+
+module.exports = { SingleFlight };
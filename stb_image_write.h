@@ -26,6 +26,19 @@ BUILDING:
    You can #define STBIW_MALLOC(), STBIW_REALLOC(), and STBIW_FREE() to replace
    malloc,realloc,free.
    You can #define STBIW_MEMMOVE() to replace memmove()
+   You can #define STBIW_KERNEL to add attributes (e.g. target_clones) to the
+   hot DCT and deflate loops.
+   You can #define STBIW_CRC32(buffer, len) and STBIW_ADLER32(data, len) to
+   replace the table CRC-32 of PNG chunks and the Adler-32 loop of the zlib
+   stream.
+   You can #define STBIW_FILTER_ROW(row, prior, out, len, n, force_filter, scratch)
+   to filter and score PNG rows in one pass: it writes row's filtered bytes to
+   out and returns the filter type (force_filter if >= 0, else the best of the
+   five). prior is the row above or NULL; scratch holds 2*len bytes.
+   You can #define STBIW_JPG_ADAPT_DU(DU, coeffs) to adjust each JPEG block's
+   quantized coefficients before they are entropy coded: DU holds the 64
+   rounded values and coeffs the unrounded ones (coefficient / quantizer
+   step), both in zigzag order; it may change DU in place (e.g. zero some).
    You can #define STBIW_ZLIB_COMPRESS to use a custom zlib-style compress function
    for PNG compression (instead of the builtin one), it must have the following signature:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
@@ -240,6 +253,10 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #endif
 
 
+#ifndef STBIW_KERNEL
+#define STBIW_KERNEL
+#endif
+
 #ifndef STBIW_ASSERT
 #include <assert.h>
 #define STBIW_ASSERT(x) assert(x)
@@ -892,7 +909,7 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+STBIWDEF STBIW_KERNEL unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
 {
 #ifdef STBIW_ZLIB_COMPRESS
    // user provided a zlib compress implementation, use that
@@ -1001,6 +1018,10 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    {
       // compute adler32 on input
       unsigned int s1=1, s2=0;
+#ifdef STBIW_ADLER32
+      unsigned int adler = STBIW_ADLER32(data, data_len);
+      s1 = adler & 0xffff; s2 = adler >> 16;
+#else
       int blocklen = (int) (data_len % 5552);
       j=0;
       while (j < data_len) {
@@ -1009,6 +1030,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          j += blocklen;
          blocklen = 5552;
       }
+#endif
       stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
       stbiw__sbpush(out, STBIW_UCHAR(s2));
       stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
@@ -1080,6 +1102,7 @@ static void stbiw__wpcrc(unsigned char **data, int len)
    stbiw__wp32(*data, crc);
 }
 
+#ifndef STBIW_FILTER_ROW
 static unsigned char stbiw__paeth(int a, int b, int c)
 {
    int p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
@@ -1124,6 +1147,7 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
       case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
    }
 }
+#endif // STBIW_FILTER_ROW
 
 STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
 {
@@ -1142,6 +1166,14 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    }
 
    filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+#ifdef STBIW_FILTER_ROW
+   line_buffer = (signed char *) STBIW_MALLOC(2 * x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   for (j=0; j < y; ++j) {
+      unsigned char *z = (unsigned char *) pixels + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      unsigned char *prior = j == 0 ? 0 : z - (stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes);
+      filt[j*(x*n+1)] = (unsigned char) STBIW_FILTER_ROW(z, prior, filt+j*(x*n+1)+1, x*n, n, force_filter, (unsigned char *) line_buffer);
+   }
+#else
    line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
    for (j=0; j < y; ++j) {
       int filter_type;
@@ -1172,6 +1204,7 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
+#endif
    STBIW_FREE(line_buffer);
    zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
    STBIW_FREE(filt);
@@ -1325,11 +1358,15 @@ static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    bits[0] = val & ((1<<bits[1])-1);
 }
 
+STBIW_KERNEL
 static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
    const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
    const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
    int dataOff, i, j, n, diff, end0pos, x, y;
    int DU[64];
+#ifdef STBIW_JPG_ADAPT_DU
+   float coeffs[64];
+#endif
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1349,8 +1386,14 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
          // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
          DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+#ifdef STBIW_JPG_ADAPT_DU
+         coeffs[stbiw__jpg_ZigZag[j]] = v;
+#endif
       }
    }
+#ifdef STBIW_JPG_ADAPT_DU
+   STBIW_JPG_ADAPT_DU(DU, coeffs);
+#endif
 
    // Encode DC
    diff = DU[0] - DC;
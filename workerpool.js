@@ -0,0 +1,227 @@
+const fs = require('fs');
+const path = require('path');
+const { CompressDaemon } = require('./daemon');
+const { ShmRegion } = require('./shmregion');
+
+// Compressor workers that exchange images with the server through shared
+// memory. Each worker is a `compress --serve --ring-mb=N` process whose ring
+// the server opens through /proc; an upload is written into the ring once and
+// the worker decodes it in place, then encodes straight into a block that
+// /download streams from. Outputs stay in the ring until they expire; when a
+// worker runs out of room its oldest outputs are spilled to `spillDir`.
+// Where the ring is not available (no memfd, /proc not readable) run()
+// rejects with err.fallback and the caller spawns a compressor instead.
+class WorkerPool {
+    constructor(binaryPath, options = {}) {
+        this.binaryPath = binaryPath;
+        this.workers = new Array(options.workers || 1).fill(null);
+        this.ringMB = options.ringMB || 128;
+        this.spillDir = options.spillDir;
+        this.outputs = new Map();   // filename -> { worker, block, length, readers, expired, timer }
+        this.disabled = process.platform !== 'linux';
+    }
+
+    // Least busy live worker, starting one in an empty slot if needed.
+    worker() {
+        let best = -1;
+        for (let i = 0; i < this.workers.length; i++) {
+            const w = this.workers[i];
+            if (!w || !w.alive) {
+                this.workers[i] = this.startWorker();
+                return this.workers[i];
+            }
+            if (best < 0 || w.daemon.pending.length < this.workers[best].daemon.pending.length) best = i;
+        }
+        return this.workers[best];
+    }
+
+    startWorker() {
+        const daemon = new CompressDaemon(this.binaryPath, ['--cache-mb=1', '--ring-mb=' + this.ringMB]);
+        const worker = { daemon, alive: true, fd: null, region: null, ready: null };
+        daemon.onExit = (err) => {
+            console.error('Ring worker:', err.message);
+            worker.alive = false;
+            this.closeIfIdle(worker);   // outputs already in the ring stay readable
+        };
+        worker.ready = daemon.ring().then(({ pid, fd, size }) => {
+            worker.fd = fs.openSync(`/proc/${pid}/fd/${fd}`, 'r+');
+            worker.region = new ShmRegion(size);
+        });
+        worker.ready.catch((err) => {
+            console.error('Shared ring unavailable, spawning compressors instead:', err.message);
+            this.disabled = true;
+            worker.alive = false;
+        });
+        return worker;
+    }
+
+    // Compresses `input` (a Buffer holding the upload) and keeps the output in
+    // the ring under `filename`; resolves with { outputSize, log }. `options`
+    // are compressor flags (--key=value) passed with the job.
+    async run(input, format, quality, filename, options = []) {
+        if (this.disabled) throw fallbackError('shared ring disabled');
+        const worker = this.worker();
+        try {
+            await worker.ready;
+        } catch (err) {
+            throw fallbackError(err.message);
+        }
+
+        const inBlock = this.allocate(worker, input.length);
+        if (!inBlock) throw fallbackError('upload does not fit the shared ring');
+        try {
+            fs.writeSync(worker.fd, input, 0, input.length, inBlock.offset);
+            // a worst-case block beyond a quarter of the ring would only force
+            // spills; the rare larger output is retried at its exact size
+            let capacity = Math.min(outputCapacity(input), Math.floor(worker.region.size / 4));
+            for (let attempt = 0; ; attempt++) {
+                const outBlock = this.allocate(worker, capacity);
+                if (!outBlock) throw fallbackError('output does not fit the shared ring');
+                try {
+                    const { outputSize, log } = await worker.daemon.job(inBlock.offset, input.length,
+                        outBlock.offset, capacity, format, quality, options);
+                    worker.region.shrink(outBlock, outputSize);
+                    this.keep(filename, worker, outBlock, outputSize);
+                    return { outputSize, log };
+                } catch (err) {
+                    worker.region.dispose(outBlock);
+                    if (err.need && attempt === 0) {
+                        capacity = err.need;
+                        continue;
+                    }
+                    throw err;
+                }
+            }
+        } finally {
+            worker.region.dispose(inBlock);
+            this.closeIfIdle(worker);
+        }
+    }
+
+    allocate(worker, length) {
+        if (length > worker.region.size) return null;
+        for (;;) {
+            const block = worker.region.alloc(length);
+            if (block) return block;
+            if (!this.spillOldest(worker)) return null;
+        }
+    }
+
+    keep(filename, worker, block, length) {
+        const entry = { worker, block, length, readers: 0, expired: false, timer: null };
+        entry.timer = setTimeout(() => this.remove(filename), 10 * 60 * 1000);
+        this.outputs.set(filename, entry);
+    }
+
+    // { stream, length, done } over a kept output, or null. The block is held
+    // until the stream ends or done() is called (for an aborted download); the
+    // stream must not be destroyed, as that would close the ring's fd.
+    stream(filename) {
+        const entry = this.outputs.get(filename);
+        if (!entry) return null;
+        entry.readers++;
+        const stream = fs.createReadStream(null, {
+            fd: entry.worker.fd,
+            start: entry.block.offset,
+            end: entry.block.offset + entry.length - 1,
+            autoClose: false
+        });
+        let held = true;
+        const done = () => {
+            if (!held) return;
+            held = false;
+            entry.readers--;
+            if (entry.expired) this.release(entry);
+        };
+        stream.on('end', done);
+        stream.on('error', done);
+        return { stream, length: entry.length, done };
+    }
+
+    remove(filename) {
+        const entry = this.outputs.get(filename);
+        if (!entry) return;
+        this.outputs.delete(filename);
+        clearTimeout(entry.timer);
+        entry.expired = true;
+        if (entry.readers === 0) this.release(entry);
+    }
+
+    release(entry) {
+        entry.worker.region.dispose(entry.block);
+        entry.block = null;
+        this.closeIfIdle(entry.worker);
+    }
+
+    // Moves the worker's oldest unread output to disk; false if there is none.
+    spillOldest(worker) {
+        for (const [filename, entry] of this.outputs) {   // insertion order = age
+            if (entry.worker !== worker || entry.readers > 0) continue;
+            const bytes = Buffer.allocUnsafe(entry.length);
+            fs.readSync(worker.fd, bytes, 0, entry.length, entry.block.offset);
+            fs.writeFileSync(path.join(this.spillDir, filename), bytes);
+            this.remove(filename);
+            setTimeout(() => {
+                fs.unlink(path.join(this.spillDir, filename), () => {});
+            }, 10 * 60 * 1000);
+            return true;
+        }
+        return false;
+    }
+
+    // A dead worker's ring is unmapped once nothing in it is referenced.
+    closeIfIdle(worker) {
+        if (!worker.alive && worker.fd !== null && worker.region && worker.region.blocks === 0) {
+            fs.close(worker.fd, () => {});
+            worker.fd = null;
+        }
+    }
+
+    snapshot() {
+        return this.workers.filter((w) => w && w.alive && w.region).map((w) => ({
+            ringBytes: w.region.size,
+            usedBytes: w.region.used,
+            pending: w.daemon.pending.length
+        }));
+    }
+}
+
+function fallbackError(reason) {
+    const err = new Error(reason);
+    err.fallback = true;
+    return err;
+}
+
+// Upper bound for the encoded output: raw RGB plus PNG filter bytes and
+// deflate overhead, from the dimensions in the PNG IHDR or JPEG SOF header.
+// Unknown headers get a guess; the worker answers "need" if it is short.
+function outputCapacity(input) {
+    const dims = imageDimensions(input);
+    if (!dims) return input.length * 4 + 65536;
+    const raw = dims.width * dims.height * 3;
+    return raw + dims.height + Math.ceil(raw / 1000) + 65536;
+}
+
+function imageDimensions(buf) {
+    if (buf.length >= 24 && buf.readUInt32BE(0) === 0x89504e47 && buf.toString('latin1', 12, 16) === 'IHDR') {
+        return { width: buf.readUInt32BE(16), height: buf.readUInt32BE(20) };
+    }
+    if (buf.length < 4 || buf[0] !== 0xff || buf[1] !== 0xd8) return null;
+    let pos = 2;
+    while (pos + 9 < buf.length) {
+        if (buf[pos] !== 0xff) return null;
+        const marker = buf[pos + 1];
+        if (marker === 0xff) {
+            pos++;
+            continue;
+        }
+        const isFrame = marker >= 0xc0 && marker <= 0xcf && marker !== 0xc4 && marker !== 0xc8 && marker !== 0xcc;
+        if (isFrame) {
+            return { width: buf.readUInt16BE(pos + 7), height: buf.readUInt16BE(pos + 5) };
+        }
+        pos += 2 + buf.readUInt16BE(pos + 2);
+    }
+    return null;
+}
+
+module.exports = { WorkerPool };